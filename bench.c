@@ -0,0 +1,963 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <getopt.h>
+
+#include "lib_tar.h"
+#include "tar_internal.h"
+
+/**
+ * Benchmarks for the indexed archive handle.
+ *
+ * Synthetic archives are generated in a temporary file, then the average latency of
+ * tar_exists() is measured on random hits and misses for a growing number of entries,
+ * along with the time to check the archive, to open it with and without a sidecar index and
+ * to run a prefix query and a full glob.
+ * The header checksum kernel is compared to the scalar loop beforehand, and the query
+ * throughput of a single handle shared by a growing number of threads is measured, then cold
+ * reads through the mapping are compared to asynchronous reads at several queue depths.
+ * The time, page faults and resident memory of opening and reading an archive are compared
+ * between whole mappings, populated or not, and sliding windows. Last, the throughput of the
+ * archive writer is measured for small and large files.
+ *
+ * With --json, a suite is run instead on archives shaped by the options below, one per entry count,
+ * printing the p50/p99 latency and throughput of check_archive(), tar_open(), tar_exists(), tar_list(),
+ * tar_read_file() and their one-shot file descriptor counterparts, with a cold and a warm page cache,
+ * as a JSON array to compare runs with:
+ *
+ *   --entries=10,1000,...  files and symlinks of each archive (default 10,1000,100000,1000000), going
+ *                          up to 10M entries best with small files, as --sizes=fixed:0 gives
+ *   --sizes=DIST           file sizes, fixed:N, uniform:MIN:MAX or log:MIN:MAX (default log:1:65536),
+ *                          the latter spreading sizes evenly across powers of two
+ *   --depth=N              directories above each file (default 3)
+ *   --fanout=N             subdirectories of each directory (default 16)
+ *   --files-per-dir=N      entries of each leaf directory (default 100)
+ *   --symlinks=RATIO       share of entries being symlinks to their previous sibling (default 0.05)
+ *   --queries=N            random queries per operation (default 100000)
+ *   --seed=N               seed of the generator and of the queries
+ */
+
+#define LOOKUPS 1000000
+#define FILES_PER_DIR 1000
+#define CHECKSUM_HEADERS 65536
+#define CHECKSUM_ROUNDS 32
+#define QUERIES_PER_THREAD 1000000
+#define ASYNC_FILES 16384
+#define ASYNC_FILE_SIZE 4096
+#define WRITER_FILES 100000
+#define MAPPING_FILES 4096
+#define MAPPING_FILE_SIZE (64 * 1024)
+#define SUITE_SCANS 5
+#define SUITE_ONE_SHOT_CALLS 20
+#define SUITE_PATH_MAX 256
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void entry_path(char *dest, size_t size, size_t i) {
+    snprintf(dest, size, "dir%05zu/file%08zu.txt", i / FILES_PER_DIR, i);
+}
+
+/**
+ * Fills a ustar header for a regular file of `size` bytes, checksum included
+ */
+static void fill_header(tar_header_t *header, const char *name, size_t size) {
+    memset(header, 0, sizeof(tar_header_t));
+    strncpy(header->name, name, sizeof(header->name));
+    snprintf(header->mode, sizeof(header->mode), "%07o", 0644);
+    snprintf(header->uid, sizeof(header->uid), "%07o", 0);
+    snprintf(header->gid, sizeof(header->gid), "%07o", 0);
+    snprintf(header->size, sizeof(header->size), "%011zo", size);
+    snprintf(header->mtime, sizeof(header->mtime), "%011o", 0);
+    header->typeflag = REGTYPE;
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    unsigned int sum = 0;
+    for (size_t i = 0; i < sizeof(tar_header_t); i++)
+        sum += ((unsigned char *)header)[i];
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", sum);
+}
+
+/**
+ * Writes an archive of `no_entries` files of `file_size` bytes into a fresh temporary file
+ * @return a file descriptor on the archive, or -1 on error
+ */
+static int generate_archive(size_t no_entries, size_t file_size) {
+    char template[] = "/tmp/lib_tar_benchXXXXXX";
+    int fd = mkstemp(template);
+    if (fd == -1) {
+        perror("mkstemp");
+        return -1;
+    }
+    unlink(template);
+
+    FILE *out = fdopen(dup(fd), "w");
+    tar_header_t header;
+    char name[64];
+    size_t padded_size = (file_size + BLK_SIZE - 1) / BLK_SIZE * BLK_SIZE;
+    uint8_t *payload = calloc(1, padded_size + 1);
+    for (size_t i = 0; i < no_entries; i++) {
+        entry_path(name, sizeof(name), i);
+        fill_header(&header, name, file_size);
+        fwrite(&header, sizeof(header), 1, out);
+        memset(payload, 'a' + i % 26, file_size);
+        fwrite(payload, padded_size, 1, out);
+    }
+    free(payload);
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(&header, sizeof(header), 1, out);
+    fclose(out);
+    return fd;
+}
+
+static void bench_lookups(size_t no_entries) {
+    int fd = generate_archive(no_entries, 0);
+    if (fd == -1)
+        return;
+
+    double start = now_ns();
+    int checked = check_archive(fd);
+    double check_ms = (now_ns() - start) / 1e6;
+    start = now_ns();
+    checked -= tar_check_archive_parallel(fd, 0);
+    double parallel_check_ms = (now_ns() - start) / 1e6;
+    printf("%10zu entries: check_archive %9.2f ms, parallel %9.2f ms (%s)\n", no_entries, check_ms,
+           parallel_check_ms, checked == 0 ? "same result" : "results differ");
+
+    start = now_ns();
+    tar_archive_t *tar = tar_open(fd);
+    double open_ms = (now_ns() - start) / 1e6;
+    if (tar == NULL) {
+        printf("tar_open failed for %zu entries\n", no_entries);
+        close(fd);
+        return;
+    }
+
+    char (*paths)[64] = malloc(LOOKUPS * sizeof(*paths));
+    unsigned int seed = 42;
+    for (size_t i = 0; i < LOOKUPS; i++)
+        entry_path(paths[i], sizeof(paths[i]), rand_r(&seed) % no_entries);
+
+    int found = 0;
+    start = now_ns();
+    for (size_t i = 0; i < LOOKUPS; i++)
+        found += tar_exists(tar, paths[i]);
+    double hit_ns = (now_ns() - start) / LOOKUPS;
+
+    for (size_t i = 0; i < LOOKUPS; i++)
+        paths[i][0] = 'x';
+    start = now_ns();
+    for (size_t i = 0; i < LOOKUPS; i++)
+        found += tar_exists(tar, paths[i]);
+    double miss_ns = (now_ns() - start) / LOOKUPS;
+
+    // a prefix query over one directory, then a pattern every path has to be matched against
+    const char *page[256];
+    size_t matched[2] = {0, 0};
+    double glob_ms[2];
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "dir%05zu/**", (no_entries - 1) / FILES_PER_DIR / 2);
+    const char *patterns[2] = {prefix, "**7.txt"};
+    for (int p = 0; p < 2; p++) {
+        size_t cursor = 0;
+        int more = 1;
+        start = now_ns();
+        while (more) {
+            size_t no_paths = sizeof(page) / sizeof(page[0]);
+            more = tar_glob(tar, patterns[p], &cursor, page, &no_paths);
+            matched[p] += no_paths;
+        }
+        glob_ms[p] = (now_ns() - start) / 1e6;
+    }
+
+    free(paths);
+    tar_close(tar);
+
+    tar_options_t options = {.index_path = "/tmp/lib_tar_bench.tarindex"};
+    tar = tar_open_with(fd, &options);
+    tar_close(tar);
+    start = now_ns();
+    tar = tar_open_with(fd, &options);
+    double reopen_ms = (now_ns() - start) / 1e6;
+    found += tar_exists(tar, "dir00000/file00000000.txt");
+    tar_close(tar);
+    unlink(options.index_path);
+
+    printf("%10zu entries: open %9.2f ms, reopen with sidecar %7.2f ms, hit %7.1f ns/lookup, miss %7.1f ns/lookup (%d found)\n",
+           no_entries, open_ms, reopen_ms, hit_ns, miss_ns, found);
+    printf("%10zu entries: glob %s %7.3f ms (%zu paths), glob %s %9.2f ms (%zu paths)\n", no_entries, patterns[0],
+           glob_ms[0], matched[0], patterns[1], glob_ms[1], matched[1]);
+    close(fd);
+}
+
+static void bench_checksum(void) {
+    tar_header_t *headers = malloc(CHECKSUM_HEADERS * sizeof(tar_header_t));
+    unsigned int seed = 42;
+    for (size_t i = 0; i < CHECKSUM_HEADERS * sizeof(tar_header_t); i++)
+        ((uint8_t *)headers)[i] = rand_r(&seed);
+
+    int mismatches = 0;
+    for (size_t i = 0; i < CHECKSUM_HEADERS; i++)
+        mismatches += checksum(&headers[i]) != checksum_scalar(&headers[i]);
+
+    volatile int sink = 0;
+    double start = now_ns();
+    for (int round = 0; round < CHECKSUM_ROUNDS; round++)
+        for (size_t i = 0; i < CHECKSUM_HEADERS; i++)
+            sink += checksum_scalar(&headers[i]);
+    double scalar_ns = (now_ns() - start) / (CHECKSUM_ROUNDS * CHECKSUM_HEADERS);
+
+    start = now_ns();
+    for (int round = 0; round < CHECKSUM_ROUNDS; round++)
+        for (size_t i = 0; i < CHECKSUM_HEADERS; i++)
+            sink += checksum(&headers[i]);
+    double kernel_ns = (now_ns() - start) / (CHECKSUM_ROUNDS * CHECKSUM_HEADERS);
+
+    printf("checksum: scalar %6.1f ns/header, kernel %6.1f ns/header (%d mismatches)\n",
+           scalar_ns, kernel_ns, mismatches);
+    free(headers);
+}
+
+/**
+ * Compares `queries` individual exists() calls on the fd, the same lookups through a handle, and a single batch
+ */
+static void bench_batch(size_t no_entries, size_t queries) {
+    int fd = generate_archive(no_entries, 0);
+    if (fd == -1)
+        return;
+
+    char (*paths)[64] = malloc(queries * sizeof(*paths));
+    const char **path_ptrs = malloc(queries * sizeof(char *));
+    tar_lookup_t *results = malloc(queries * sizeof(tar_lookup_t));
+    unsigned int seed = 7;
+    for (size_t i = 0; i < queries; i++) {
+        entry_path(paths[i], sizeof(paths[i]), rand_r(&seed) % no_entries);
+        path_ptrs[i] = paths[i];
+    }
+
+    size_t fd_found = 0, handle_found = 0, batch_found = 0;
+    double start = now_ns();
+    for (size_t i = 0; i < queries; i++)
+        fd_found += exists(fd, paths[i]) != 0;
+    double fd_ms = (now_ns() - start) / 1e6;
+
+    start = now_ns();
+    tar_archive_t *tar = tar_open(fd);
+    for (size_t i = 0; i < queries; i++)
+        handle_found += tar_exists(tar, paths[i]);
+    double handle_ms = (now_ns() - start) / 1e6;
+
+    start = now_ns();
+    batch_found = tar_lookup_batch(tar, path_ptrs, queries, results);
+    double batch_ms = (now_ns() - start) / 1e6;
+    tar_close(tar);
+
+    printf("%10zu entries, %zu queries: exists() %9.2f ms, open + tar_exists() %7.2f ms, tar_lookup_batch() %7.3f ms (%zu/%zu/%zu found)\n",
+           no_entries, queries, fd_ms, handle_ms, batch_ms, fd_found, handle_found, batch_found);
+
+    free(results);
+    free(path_ptrs);
+    free(paths);
+    close(fd);
+}
+
+/* Random queries run by one thread of bench_threads() on the shared handle */
+typedef struct query_job {
+    const tar_archive_t *tar;
+    size_t no_entries;
+    unsigned int seed;
+    size_t found;
+} query_job_t;
+
+static void *query_worker(void *arg) {
+    query_job_t *job = arg;
+    char path[64];
+    uint8_t buffer[64];
+    for (size_t i = 0; i < QUERIES_PER_THREAD; i++) {
+        entry_path(path, sizeof(path), rand_r(&job->seed) % job->no_entries);
+        size_t len = sizeof(buffer);
+        job->found += i % 2 == 0 ? tar_is_file(job->tar, path) != 0 : tar_read_file(job->tar, path, 0, buffer, &len) == 0;
+    }
+    return NULL;
+}
+
+/**
+ * Measures how the queries per second of a single shared handle scale from 1 to `max_threads` threads
+ */
+static void bench_threads(size_t no_entries, int max_threads) {
+    int fd = generate_archive(no_entries, 0);
+    if (fd == -1)
+        return;
+    tar_archive_t *tar = tar_open(fd);
+    if (tar == NULL) {
+        printf("tar_open failed for %zu entries\n", no_entries);
+        close(fd);
+        return;
+    }
+
+    pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+    query_job_t *jobs = malloc(max_threads * sizeof(query_job_t));
+    double single_qps = 0;
+    for (int nthreads = 1;; nthreads *= 2) {
+        if (nthreads > max_threads)
+            nthreads = max_threads;
+        double start = now_ns();
+        for (int i = 0; i < nthreads; i++) {
+            jobs[i] = (query_job_t){.tar = tar, .no_entries = no_entries, .seed = i + 1};
+            pthread_create(&threads[i], NULL, query_worker, &jobs[i]);
+        }
+        size_t found = 0;
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+            found += jobs[i].found;
+        }
+        double qps = (double)nthreads * QUERIES_PER_THREAD / ((now_ns() - start) / 1e9);
+        if (nthreads == 1)
+            single_qps = qps;
+        printf("%10zu entries, %3d threads: %8.2f M queries/s, %5.2fx a single thread (%zu found)\n", no_entries,
+               nthreads, qps / 1e6, qps / single_qps, found);
+        if (nthreads == max_threads)
+            break;
+    }
+
+    free(jobs);
+    free(threads);
+    tar_close(tar);
+    close(fd);
+}
+
+/**
+ * Reads every file of the archive once, in random order, with a queue of the given backend and depth,
+ * or with tar_read_file() when `queue_depth` is zero. The archive is evicted from the page cache beforehand.
+ */
+static void bench_async_run(const tar_archive_t *tar, int fd, char (*paths)[64], tar_async_backend_t backend,
+                            unsigned int queue_depth) {
+    uint8_t *buffers = malloc((size_t)ASYNC_FILES * ASYNC_FILE_SIZE);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    size_t bytes = 0;
+    double start = now_ns();
+    const char *name = "tar_read_file()";
+    if (queue_depth == 0) {
+        for (size_t i = 0; i < ASYNC_FILES; i++) {
+            size_t len = ASYNC_FILE_SIZE;
+            if (tar_read_file(tar, paths[i], 0, buffers + i * ASYNC_FILE_SIZE, &len) == 0)
+                bytes += len;
+        }
+    } else {
+        tar_async_t *async = tar_async_open(tar, queue_depth, backend);
+        if (async == NULL) {
+            printf("tar_async_open failed for depth %u\n", queue_depth);
+            free(buffers);
+            return;
+        }
+        name = tar_async_backend(async) == TAR_ASYNC_IO_URING ? "io_uring" : "threads";
+        tar_async_read_t read;
+        tar_async_completion_t completions[64];
+        size_t submitted = 0, completed = 0;
+        while (completed < ASYNC_FILES) {
+            while (submitted < ASYNC_FILES) {
+                read = (tar_async_read_t){.path = paths[submitted], .dest = buffers + submitted * ASYNC_FILE_SIZE,
+                                          .len = ASYNC_FILE_SIZE};
+                if (tar_async_submit(async, &read, 1) == 0)
+                    break;
+                submitted++;
+            }
+            size_t got = tar_async_complete(async, completions, 64, 1);
+            for (size_t i = 0; i < got; i++)
+                bytes += completions[i].ret == 0 ? completions[i].len : 0;
+            completed += got;
+        }
+        tar_async_close(async);
+    }
+    double ms = (now_ns() - start) / 1e6;
+    printf("%16s, depth %3u: %8.2f ms, %8.0f reads/s, %7.1f MiB/s\n", name, queue_depth, ms,
+           ASYNC_FILES / (ms / 1e3), bytes / (ms / 1e3) / (1 << 20));
+    free(buffers);
+}
+
+/**
+ * Compares cold reads through the mapping to asynchronous reads at growing queue depths
+ */
+static void bench_async(void) {
+    int fd = generate_archive(ASYNC_FILES, ASYNC_FILE_SIZE);
+    if (fd == -1)
+        return;
+    tar_archive_t *tar = tar_open(fd);
+    char (*paths)[64] = malloc(ASYNC_FILES * sizeof(*paths));
+    unsigned int seed = 3;
+    for (size_t i = 0; i < ASYNC_FILES; i++)
+        entry_path(paths[i], sizeof(paths[i]), rand_r(&seed) % ASYNC_FILES);
+
+    bench_async_run(tar, fd, paths, TAR_ASYNC_AUTO, 0);
+    for (unsigned int depth = 1; depth <= 64; depth *= 8) {
+        bench_async_run(tar, fd, paths, TAR_ASYNC_IO_URING, depth);
+        bench_async_run(tar, fd, paths, TAR_ASYNC_THREADS, depth);
+    }
+
+    free(paths);
+    tar_close(tar);
+    close(fd);
+}
+
+/* Resident memory and page faults of the process at some point */
+typedef struct usage {
+    double ns;
+    long rss_kib;
+    long minor_faults;
+    long major_faults;
+} usage_t;
+
+static usage_t get_usage(void) {
+    usage_t usage = {.ns = now_ns()};
+    struct rusage rusage;
+    getrusage(RUSAGE_SELF, &rusage);
+    usage.minor_faults = rusage.ru_minflt;
+    usage.major_faults = rusage.ru_majflt;
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%*d %ld", &pages) != 1)
+            pages = 0;
+        fclose(statm);
+    }
+    usage.rss_kib = pages * (sysconf(_SC_PAGESIZE) / 1024);
+    return usage;
+}
+
+static void print_usage(const char *name, const char *step, usage_t before, usage_t after) {
+    printf("%24s, %5s: %8.2f ms, %7ld minor faults, %6ld major faults, RSS %+8ld KiB\n", name, step,
+           (after.ns - before.ns) / 1e6, after.minor_faults - before.minor_faults,
+           after.major_faults - before.major_faults, after.rss_kib - before.rss_kib);
+}
+
+/**
+ * Opens the archive with `options` from a cold page cache, then reads every file once in random order
+ */
+static void bench_mapping_run(int fd, char (*paths)[64], const char *name, const tar_options_t *options) {
+    uint8_t *buffer = malloc(MAPPING_FILE_SIZE);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    usage_t start = get_usage();
+    tar_archive_t *tar = tar_open_with(fd, options);
+    usage_t opened = get_usage();
+    if (tar == NULL) {
+        printf("tar_open_with failed for %s\n", name);
+        free(buffer);
+        return;
+    }
+    for (size_t i = 0; i < MAPPING_FILES; i++) {
+        size_t len = MAPPING_FILE_SIZE;
+        tar_read_file(tar, paths[i], 0, buffer, &len);
+    }
+    usage_t read = get_usage();
+    print_usage(name, "open", start, opened);
+    print_usage(name, "read", opened, read);
+    tar_close(tar);
+    free(buffer);
+}
+
+/**
+ * Compares the cost in time, page faults and resident memory of the ways the archive can be mapped
+ */
+static void bench_mapping(void) {
+    int fd = generate_archive(MAPPING_FILES, MAPPING_FILE_SIZE);
+    if (fd == -1)
+        return;
+    char (*paths)[64] = malloc(MAPPING_FILES * sizeof(*paths));
+    unsigned int seed = 5;
+    for (size_t i = 0; i < MAPPING_FILES; i++)
+        entry_path(paths[i], sizeof(paths[i]), rand_r(&seed) % MAPPING_FILES);
+
+    bench_mapping_run(fd, paths, "whole mapping", NULL);
+    bench_mapping_run(fd, paths, "populated, huge pages",
+                      &(tar_options_t){.map_flags = TAR_MAP_POPULATE | TAR_MAP_HUGEPAGES});
+    bench_mapping_run(fd, paths, "8 MiB window", &(tar_options_t){.map_window = 8 << 20});
+
+    free(paths);
+    close(fd);
+}
+
+/**
+ * Opens the archive through a backend from a cold page cache, then reads every file twice in random order,
+ * first cold then warm. Archives in memory are read into their buffer as part of opening them.
+ */
+static void bench_backend_run(int fd, char (*paths)[64], const char *name, tar_options_t options) {
+    uint8_t *buffer = malloc(MAPPING_FILE_SIZE);
+    uint8_t *archive = NULL;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    usage_t start = get_usage();
+    if (options.backend == TAR_BACKEND_MEMORY) {
+        struct stat statbuf;
+        fstat(fd, &statbuf);
+        archive = malloc(statbuf.st_size);
+        if (archive == NULL || pread(fd, archive, statbuf.st_size, 0) != statbuf.st_size) {
+            printf("reading the archive failed for %s\n", name);
+            free(archive);
+            free(buffer);
+            return;
+        }
+        options.buffer = archive;
+        options.buffer_size = statbuf.st_size;
+    }
+    tar_archive_t *tar = tar_open_with(fd, &options);
+    usage_t opened = get_usage();
+    if (tar == NULL) {
+        printf("tar_open_with failed for %s\n", name);
+        free(archive);
+        free(buffer);
+        return;
+    }
+    print_usage(name, "open", start, opened);
+    usage_t before = opened;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < MAPPING_FILES; i++) {
+            size_t len = MAPPING_FILE_SIZE;
+            tar_read_file(tar, paths[i], 0, buffer, &len);
+        }
+        usage_t after = get_usage();
+        print_usage(name, pass == 0 ? "cold" : "warm", before, after);
+        before = after;
+    }
+    tar_close(tar);
+    free(archive);
+    free(buffer);
+}
+
+/**
+ * Compares the backends an archive can be read through, on cold and warm reads
+ */
+static void bench_backends(void) {
+    int fd = generate_archive(MAPPING_FILES, MAPPING_FILE_SIZE);
+    if (fd == -1)
+        return;
+    char (*paths)[64] = malloc(MAPPING_FILES * sizeof(*paths));
+    unsigned int seed = 7;
+    for (size_t i = 0; i < MAPPING_FILES; i++)
+        entry_path(paths[i], sizeof(paths[i]), rand_r(&seed) % MAPPING_FILES);
+
+    bench_backend_run(fd, paths, "mmap backend", (tar_options_t){.backend = TAR_BACKEND_MMAP});
+    bench_backend_run(fd, paths, "pread backend", (tar_options_t){.backend = TAR_BACKEND_PREAD});
+    bench_backend_run(fd, paths, "memory backend", (tar_options_t){.backend = TAR_BACKEND_MEMORY});
+
+    free(paths);
+    close(fd);
+}
+
+/**
+ * Measures the time to write WRITER_FILES files of `file_size` bytes with the archive writer
+ */
+static void bench_writer_run(size_t file_size) {
+    char template[] = "/tmp/lib_tar_benchXXXXXX";
+    int fd = mkstemp(template);
+    if (fd == -1) {
+        perror("mkstemp");
+        return;
+    }
+    unlink(template);
+    size_t no_files = file_size > 65536 ? WRITER_FILES / 1000 : WRITER_FILES;
+    uint8_t *payload = malloc(file_size);
+    memset(payload, 'a', file_size);
+    char name[64];
+
+    double start = now_ns();
+    tar_writer_t *writer = tar_writer_open(fd, 0);
+    int ret = 0;
+    for (size_t i = 0; i < no_files; i++) {
+        entry_path(name, sizeof(name), i);
+        ret |= tar_writer_add_buffer(writer, name, payload, file_size, 0644, 0);
+    }
+    ret |= tar_writer_close(writer);
+    double elapsed = now_ns() - start;
+    double bytes = (double) no_files * file_size;
+    printf("writer: %7zu files of %8zu bytes in %8.1f ms, %10.0f files/s, %8.1f MiB/s%s\n", no_files, file_size,
+           elapsed / 1e6, no_files / (elapsed / 1e9), bytes / (1 << 20) / (elapsed / 1e9), ret != 0 ? " (failed)" : "");
+    free(payload);
+    close(fd);
+}
+
+static void bench_writer(void) {
+    bench_writer_run(0);
+    bench_writer_run(4096);
+    bench_writer_run(1 << 20);
+}
+
+/* Shape of the archives of the suite, entries being a pure function of their index and of the seed */
+typedef struct suite_spec {
+    size_t no_entries;    /* files and symlinks, directories coming on top */
+    size_t files_per_dir;
+    int depth;
+    size_t fanout;
+    double symlink_ratio;
+    const char *sizes;
+    char size_kind;       /* 'f'ixed, 'u'niform or 'l'og */
+    uint64_t min_size;
+    uint64_t max_size;
+    size_t queries;
+    uint64_t seed;
+} suite_spec_t;
+
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static int parse_sizes(suite_spec_t *spec) {
+    unsigned long long min, max;
+    if (sscanf(spec->sizes, "fixed:%llu", &min) == 1)
+        max = min;
+    else if (sscanf(spec->sizes, "uniform:%llu:%llu", &min, &max) != 2 &&
+             sscanf(spec->sizes, "log:%llu:%llu", &min, &max) != 2)
+        return -1;
+    if (min > max || (spec->sizes[0] == 'l' && min == 0))
+        return -1;
+    spec->size_kind = spec->sizes[0];
+    spec->min_size = min;
+    spec->max_size = max;
+    return 0;
+}
+
+static uint64_t suite_size(const suite_spec_t *spec, size_t i) {
+    uint64_t random = mix(spec->seed ^ (i * 2 + 1));
+    if (spec->size_kind == 'f')
+        return spec->min_size;
+    if (spec->size_kind == 'u')
+        return spec->min_size + random % (spec->max_size - spec->min_size + 1);
+    // a power of two first, then a size within it
+    int low_bit = 63 - __builtin_clzll(spec->min_size);
+    int high_bit = 63 - __builtin_clzll(spec->max_size);
+    int bit = low_bit + random % (high_bit - low_bit + 1);
+    uint64_t low = (1ULL << bit) > spec->min_size ? 1ULL << bit : spec->min_size;
+    uint64_t high = bit < 63 && (2ULL << bit) - 1 < spec->max_size ? (2ULL << bit) - 1 : spec->max_size;
+    return low + (random >> 8) % (high - low + 1);
+}
+
+static int suite_is_symlink(const suite_spec_t *spec, size_t i) {
+    // the first entry of a directory is always a file, for the symlinks to point to their previous sibling
+    return i % spec->files_per_dir != 0 && mix(spec->seed ^ (i * 2)) % 1000000 < spec->symlink_ratio * 1000000;
+}
+
+/**
+ * Writes the directories holding the leaf directory `leaf`, each one ending with a '/'.
+ * The deepest levels cycle through `fanout` directories, the top level taking what is left.
+ */
+static void suite_dir(const suite_spec_t *spec, size_t leaf, char *dest, size_t size) {
+    size_t len = 0;
+    size_t divisor = 1;
+    for (int level = 1; level < spec->depth; level++)
+        divisor *= spec->fanout;
+    dest[0] = '\0';
+    for (int level = 0; level < spec->depth; level++, divisor /= spec->fanout) {
+        size_t component = level == 0 ? leaf / divisor : leaf / divisor % spec->fanout;
+        len += snprintf(dest + len, size - len, "d%zu/", component);
+    }
+}
+
+static void suite_name(const suite_spec_t *spec, size_t i, char *dest, size_t size) {
+    snprintf(dest, size, suite_is_symlink(spec, i) ? "link%zu" : "file%zu.dat", i);
+}
+
+static void suite_path(const suite_spec_t *spec, size_t i, char *dest, size_t size) {
+    suite_dir(spec, i / spec->files_per_dir, dest, size);
+    size_t len = strlen(dest);
+    suite_name(spec, i, dest + len, size - len);
+}
+
+/**
+ * Writes the archive of a suite into a fresh temporary file, with the archive writer
+ * @return a file descriptor on the archive, or -1 on error
+ */
+static int generate_suite_archive(const suite_spec_t *spec) {
+    char template[] = "/tmp/lib_tar_benchXXXXXX";
+    int fd = mkstemp(template);
+    if (fd == -1) {
+        perror("mkstemp");
+        return -1;
+    }
+    unlink(template);
+
+    tar_writer_t *writer = tar_writer_open(fd, 0);
+    uint8_t *payload = malloc(spec->max_size + 1);
+    memset(payload, 'x', spec->max_size + 1);
+    char dir[SUITE_PATH_MAX] = "", previous_dir[SUITE_PATH_MAX] = "", path[SUITE_PATH_MAX], target[64];
+    int ret = writer == NULL ? -1 : 0;
+    for (size_t i = 0; i < spec->no_entries && ret == 0; i++) {
+        if (i % spec->files_per_dir == 0) {
+            // directories not shared with the previous leaf come first, as tar lists them
+            suite_dir(spec, i / spec->files_per_dir, dir, sizeof(dir));
+            for (char *slash = strchr(dir, '/'); slash != NULL && ret == 0; slash = strchr(slash + 1, '/')) {
+                size_t len = slash - dir + 1;
+                if (strncmp(dir, previous_dir, len) == 0)
+                    continue;
+                memcpy(path, dir, len);
+                path[len] = '\0';
+                ret = tar_writer_add_directory(writer, path, 0755, 0);
+            }
+            strcpy(previous_dir, dir);
+        }
+        suite_path(spec, i, path, sizeof(path));
+        if (suite_is_symlink(spec, i)) {
+            suite_name(spec, i - 1, target, sizeof(target));
+            ret = tar_writer_add_symlink(writer, path, target, 0);
+        } else {
+            ret = tar_writer_add_buffer(writer, path, payload, suite_size(spec, i), 0644, 0);
+        }
+    }
+    free(payload);
+    if (tar_writer_close(writer) != 0 || ret != 0) {
+        fprintf(stderr, "failed to write the archive of %zu entries\n", spec->no_entries);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Prints the latency percentiles and throughput of `count` timed calls as a JSON object
+ * @param bytes Bytes the calls produced, for a throughput in MiB/s, zero for none.
+ */
+static void print_result(int *first, const char *op, const char *cache, double *samples, size_t count,
+                         uint64_t bytes) {
+    if (count == 0)
+        return;
+    qsort(samples, count, sizeof(double), compare_doubles);
+    double total = 0;
+    for (size_t i = 0; i < count; i++)
+        total += samples[i];
+    printf("%s\n    {\"op\": \"%s\", \"cache\": \"%s\", \"calls\": %zu, \"p50_ns\": %.0f, \"p99_ns\": %.0f, "
+           "\"mean_ns\": %.0f, \"ops_per_s\": %.1f",
+           *first ? "" : ",", op, cache, count, samples[(count - 1) / 2], samples[(count - 1) * 99 / 100],
+           total / count, count / (total / 1e9));
+    if (bytes > 0)
+        printf(", \"mib_per_s\": %.1f", bytes / (total / 1e9) / (1 << 20));
+    printf("}");
+    *first = 0;
+}
+
+/* The queries of one operation, run on a handle or on the file descriptor of the archive */
+typedef enum suite_op { SUITE_EXISTS, SUITE_LIST, SUITE_READ } suite_op_t;
+
+/**
+ * Times queries of one operation on random entries, or random leaf directories for listings
+ * @return the bytes read
+ */
+static uint64_t run_queries(const suite_spec_t *spec, const tar_archive_t *tar, int fd, suite_op_t op,
+                            double *samples, size_t count, uint8_t *buffer, char **entries, size_t max_entries) {
+    char path[SUITE_PATH_MAX];
+    uint64_t bytes = 0;
+    size_t no_leaves = (spec->no_entries + spec->files_per_dir - 1) / spec->files_per_dir;
+    for (size_t q = 0; q < count; q++) {
+        uint64_t random = mix(spec->seed + q + op * spec->queries);
+        if (op == SUITE_LIST)
+            suite_dir(spec, random % no_leaves, path, sizeof(path));
+        else
+            suite_path(spec, random % spec->no_entries, path, sizeof(path));
+        size_t len = spec->max_size;
+        size_t no_entries = max_entries;
+        double start = now_ns();
+        if (op == SUITE_EXISTS)
+            tar != NULL ? tar_exists(tar, path) : exists(fd, path);
+        else if (op == SUITE_LIST)
+            tar != NULL ? tar_list(tar, path, entries, &no_entries) : list(fd, path, entries, &no_entries);
+        else if ((tar != NULL ? tar_read_file(tar, path, 0, buffer, &len) : read_file(fd, path, 0, buffer, &len)) >= 0)
+            bytes += len;
+        samples[q] = now_ns() - start;
+    }
+    return bytes;
+}
+
+/**
+ * Generates the archive of a suite, then prints its shape and the results of its runs as a JSON object
+ */
+static void run_suite(const suite_spec_t *spec, int first_archive) {
+    int fd = generate_suite_archive(spec);
+    if (fd == -1)
+        return;
+    struct stat statbuf;
+    fstat(fd, &statbuf);
+    printf("%s{\"archive\": {\"entries\": %zu, \"bytes\": %lld, \"sizes\": \"%s\", \"depth\": %d, \"fanout\": %zu, "
+           "\"files_per_dir\": %zu, \"symlink_ratio\": %g, \"seed\": %llu},\n  \"results\": [",
+           first_archive ? "" : ",\n", spec->no_entries, (long long) statbuf.st_size, spec->sizes, spec->depth,
+           spec->fanout, spec->files_per_dir, spec->symlink_ratio, (unsigned long long) spec->seed);
+
+    size_t count = spec->queries > SUITE_SCANS ? spec->queries : SUITE_SCANS;
+    double *samples = malloc(count * sizeof(double));
+    int first = 1;
+
+    // whole-archive scans, evicting the archive from the page cache before each cold one
+    for (int cold = 1; cold >= 0; cold--) {
+        const char *cache = cold ? "cold" : "warm";
+        for (int i = 0; i < SUITE_SCANS; i++) {
+            if (cold)
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            double start = now_ns();
+            check_archive(fd);
+            samples[i] = now_ns() - start;
+        }
+        print_result(&first, "check_archive", cache, samples, SUITE_SCANS, statbuf.st_size);
+        for (int i = 0; i < SUITE_SCANS; i++) {
+            if (cold)
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            double start = now_ns();
+            tar_close(tar_open(fd));
+            samples[i] = now_ns() - start;
+        }
+        print_result(&first, "tar_open", cache, samples, SUITE_SCANS, statbuf.st_size);
+    }
+
+    // queries on a handle, whose index comes from a sidecar so that opening leaves the archive cold
+    uint8_t *buffer = malloc(spec->max_size + 1);
+    size_t max_entries = spec->files_per_dir + spec->fanout;
+    char **entries = malloc(max_entries * sizeof(char *));
+    for (size_t i = 0; i < max_entries; i++)
+        entries[i] = malloc(SUITE_PATH_MAX);
+    tar_options_t options = {.index_path = "/tmp/lib_tar_bench_suite.tarindex"};
+    tar_close(tar_open_with(fd, &options));
+    static const char *names[] = {"tar_exists", "tar_list", "tar_read_file"};
+    for (suite_op_t op = SUITE_EXISTS; op <= SUITE_READ; op++) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        tar_archive_t *tar = tar_open_with(fd, &options);
+        for (int cold = 1; cold >= 0; cold--) {
+            uint64_t bytes = run_queries(spec, tar, fd, op, samples, spec->queries, buffer, entries, max_entries);
+            print_result(&first, names[op], cold ? "cold" : "warm", samples, spec->queries, bytes);
+        }
+        tar_close(tar);
+    }
+    unlink(options.index_path);
+
+    // one-shot calls on the file descriptor, which index the archive again every time
+    static const char *one_shot_names[] = {"exists", "list", "read_file"};
+    size_t calls = spec->queries < SUITE_ONE_SHOT_CALLS ? spec->queries : SUITE_ONE_SHOT_CALLS;
+    for (suite_op_t op = SUITE_EXISTS; op <= SUITE_READ; op++) {
+        uint64_t bytes = run_queries(spec, NULL, fd, op, samples, calls, buffer, entries, max_entries);
+        print_result(&first, one_shot_names[op], "warm", samples, calls, bytes);
+    }
+
+    printf("\n  ]}");
+    for (size_t i = 0; i < max_entries; i++)
+        free(entries[i]);
+    free(entries);
+    free(buffer);
+    free(samples);
+    close(fd);
+}
+
+/**
+ * Runs the suite on an archive per entry count given on the command line
+ * @return the exit status of the program
+ */
+static int bench_suite(int argc, char **argv) {
+    suite_spec_t spec = {
+        .files_per_dir = 100,
+        .depth = 3,
+        .fanout = 16,
+        .symlink_ratio = 0.05,
+        .sizes = "log:1:65536",
+        .queries = 100000,
+        .seed = 1,
+    };
+    const char *counts = "10,1000,100000,1000000";
+    static const struct option long_options[] = {
+        {"json", no_argument, NULL, 'j'},
+        {"entries", required_argument, NULL, 'n'},
+        {"sizes", required_argument, NULL, 's'},
+        {"depth", required_argument, NULL, 'd'},
+        {"fanout", required_argument, NULL, 'f'},
+        {"files-per-dir", required_argument, NULL, 'p'},
+        {"symlinks", required_argument, NULL, 'l'},
+        {"queries", required_argument, NULL, 'q'},
+        {"seed", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'j':
+            break;
+        case 'n':
+            counts = optarg;
+            break;
+        case 's':
+            spec.sizes = optarg;
+            break;
+        case 'd':
+            spec.depth = atoi(optarg);
+            break;
+        case 'f':
+            spec.fanout = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            spec.files_per_dir = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            spec.symlink_ratio = strtod(optarg, NULL);
+            break;
+        case 'q':
+            spec.queries = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            spec.seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (parse_sizes(&spec) != 0 || spec.depth < 0 || spec.fanout == 0 || spec.files_per_dir == 0 ||
+        spec.queries == 0) {
+        fprintf(stderr, "invalid suite options, see the top of bench.c\n");
+        return 1;
+    }
+
+    printf("[");
+    int first = 1;
+    for (const char *count = counts; *count != '\0'; count += *count == ',') {
+        char *end;
+        spec.no_entries = strtoul(count, &end, 10);
+        if (end == count) {
+            fprintf(stderr, "invalid entry count in %s\n", counts);
+            return 1;
+        }
+        count = end;
+        if (spec.no_entries == 0)
+            continue;
+        run_suite(&spec, first);
+        first = 0;
+        fflush(stdout);
+    }
+    printf("\n]\n");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--json") == 0)
+        return bench_suite(argc, argv);
+    size_t max_entries = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+    bench_checksum();
+    for (size_t no_entries = 1000; no_entries <= max_entries; no_entries *= 10)
+        bench_lookups(no_entries);
+    bench_batch(10000, 1000);
+    long max_threads = argc > 2 ? strtol(argv[2], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    bench_threads(max_entries < 1000000 ? max_entries : 1000000, max_threads > 0 ? max_threads : 1);
+    bench_async();
+    bench_mapping();
+    bench_backends();
+    bench_writer();
+    return 0;
+}
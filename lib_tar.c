@@ -1,161 +1,2703 @@
-#include "lib_tar.h"
+#define _GNU_SOURCE
+#include "tar_internal.h"
 #include <stdio.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <fcntl.h>
 #include <string.h>
-#include <math.h>
 #include <stdlib.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define INDEX_INITIAL_CAPACITY 64
+#define NAMES_INITIAL_CAPACITY 4096
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/* below this many headers, validating in the calling thread is faster than spawning workers */
+#define PARALLEL_CHECK_MIN_HEADERS 4096
+
+/* files claimed at once by a worker of tar_extract_all(), small enough to balance uneven file sizes */
+#define EXTRACT_CHUNK_FILES 16
+
+/* ranges of tar_read_file_ranges() read with a single preadv(2) when this close, and how many buffers it fills */
+#define RANGES_GAP_MAX (16 * 1024)
+#define RANGES_IOV_MAX 64
+
+/* how many paths ahead tar_lookup_batch() hashes and prefetches */
+#define LOOKUP_PREFETCH_DISTANCE 8
+
+#define SIDECAR_MAGIC "TARINDEX"
+#define SIDECAR_VERSION 6
+
+/* longest chain of links followed before giving up, as the kernel's ELOOP limit */
+#define LINK_MAX_HOPS 40
+
+/* header_off of directories that only appear as a prefix of other paths */
+#define NO_HEADER UINT64_MAX
+
+/* One indexed member of the archive, extension headers are folded into the member they describe */
+typedef struct tar_entry
+{
+    uint64_t header_off; /* offset of the header block, the payload starts right after it */
+    uint64_t size;       /* payload size in bytes */
+    uint64_t name_off;   /* full path, NUL-terminated, in the names arena */
+    uint64_t link_off;   /* link target, NUL-terminated, in the names arena */
+    uint64_t hash;       /* hash of the full path */
+    uint32_t name_len;
+    uint32_t link_len;
+    uint32_t parent;      /* index + 1 of the parent directory, zero for top-level entries */
+    uint32_t child_start; /* children of a directory, sorted by name, in the children array */
+    uint32_t child_count;
+    uint32_t target;      /* index + 1 of the final target of links, zero when dangling or cyclic */
+    char typeflag;
+} tar_entry_t;
+
+/* Filled once by tar_open_with(), then only read, which lets threads share a handle without locks */
+struct tar_archive
+{
+    backend_t backend; /* where the bytes of the archive are read from */
+    tar_entry_t *entries;
+    size_t no_entries;
+    size_t capacity;
+    char *names;       /* arena holding the full path and link target of every entry */
+    size_t names_len;
+    size_t names_capacity;
+    uint32_t *slots;   /* open-addressing table of entry index + 1, zero when empty */
+    size_t slot_mask;
+    size_t used_slots;
+    uint32_t *children; /* entry indexes grouped by parent directory */
+    uint32_t *sorted;   /* indexes of the entries not shadowed by a later one, sorted by path */
+    size_t no_sorted;
+    uint8_t *index_map; /* sidecar index the arrays above point into, NULL when built in memory */
+    gz_index_t *gz;     /* checkpoints of gzip-compressed archives, the map then being compressed and the offsets
+                           of the entries being offsets in the decompressed archive */
+    size_t index_map_size;
+    int check_result;  /* what check_archive() returns for this archive */
+    uint64_t walked_end; /* end of the last member indexed, where the members appended since then start */
+    int walked_headers;  /* headers counted and first error met before walked_end, resumed by tar_refresh() */
+    int walked_error;
+    block_cache_t *cache; /* chunks of payloads read, NULL when files are copied straight from the mapping */
+#ifdef TAR_STATS
+    stats_t *stats;    /* counters updated by every thread using the handle, NULL if they could not be allocated */
+#endif
+};
+
+/**
+ * Layout of a sidecar index file.
+ *
+ * The header is followed by the entries, names, hash table slots and children arrays,
+ * each one 8-byte aligned at the offset recorded here, in the exact in-memory layout of
+ * the index so that a mapping of the file can be queried directly. Integers are stored in
+ * the byte order of the machine that wrote the file.
+ */
+typedef struct sidecar_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;   /* sizeof(tar_entry_t), guards against layout changes */
+    uint64_t archive_size; /* the archive the index was built from */
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    int64_t check_result;
+    uint64_t no_entries;
+    uint64_t names_len;
+    uint64_t no_slots;
+    uint64_t entries_off;
+    uint64_t names_off;
+    uint64_t slots_off;
+    uint64_t children_off;
+    uint64_t no_sorted;
+    uint64_t sorted_off;
+    uint64_t walked_end;
+    int64_t walked_headers;
+    int64_t walked_error;
+} sidecar_header_t;
+
+/**
+ * Computes checksum for a given header, summing its bytes as unsigned as POSIX specifies
+ * @param header pointer to the header to compute checksum for
+ * @return computed checksum
+ *
+ */
+int checksum_scalar(tar_header_t *header)
+{
+    int sum = 0;
+    for (int i = 0; i < 512; i++)
+    {
+        if (i >= 148 && i < 156)
+            continue;
+        sum += (uint8_t)header->name[i];
+    }
+    sum += 256; // checksum initally 8 bytes of spaces (32 in ascii)
+    return sum;
+}
+
+/**
+ * Computes the checksum some historic tars wrote, summing the bytes of the header as signed
+ * @return computed checksum, the same as checksum() for headers holding only ASCII
+ */
+static int checksum_signed(tar_header_t *header)
+{
+    int sum = 256;
+    for (int i = 0; i < 512; i++)
+    {
+        if (i < 148 || i >= 156)
+            sum += (signed char)header->name[i];
+    }
+    return sum;
+}
+
+/**
+ * Checks the checksum of a header, accepting the signed sum too as GNU tar does.
+ * Only headers with bytes above 127, such as base-256 sizes, can have a signed sum that differs.
+ */
+static int checksum_matches(tar_header_t *header)
+{
+    int64_t stored = TAR_INT(header->chksum);
+    return stored == checksum(header) || stored == checksum_signed(header);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/*
+ * The vector kernels sum all 512 bytes at once with psadbw, 8 unsigned bytes at a time,
+ * then take the chksum field back out.
+ */
+
+static int fix_vector_sum(tar_header_t *header, int raw_sum)
+{
+    int sum = raw_sum;
+    for (size_t i = 0; i < sizeof(header->chksum); i++)
+        sum -= (uint8_t)header->chksum[i];
+    return sum + 256;
+}
+
+__attribute__((target("sse2"))) static int checksum_sse2(tar_header_t *header)
+{
+    const __m128i *blocks = (const __m128i *)header;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (size_t i = 0; i < sizeof(tar_header_t) / sizeof(__m128i); i++)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128(blocks + i), zero));
+    return fix_vector_sum(header, _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+}
+
+__attribute__((target("avx2"))) static int checksum_avx2(tar_header_t *header)
+{
+    const __m256i *blocks = (const __m256i *)header;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    for (size_t i = 0; i < sizeof(tar_header_t) / sizeof(__m256i); i++)
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256(blocks + i), zero));
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return fix_vector_sum(header, _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8)));
+}
+
+#endif
+
+static int checksum_detect(tar_header_t *header);
+
+/* Checksum kernel for this CPU, picked on first use */
+static int (*checksum_kernel)(tar_header_t *header) = checksum_detect;
+
+static int checksum_detect(tar_header_t *header)
+{
+    int (*kernel)(tar_header_t *) = checksum_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernel = checksum_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        kernel = checksum_sse2;
+#endif
+    __atomic_store_n(&checksum_kernel, kernel, __ATOMIC_RELAXED);
+    return kernel(header);
+}
+
+/**
+ * Computes checksum for a given header, with the fastest kernel the CPU supports
+ * @param header pointer to the header to compute checksum for
+ * @return computed checksum
+ */
+int checksum(tar_header_t *header)
+{
+    return __atomic_load_n(&checksum_kernel, __ATOMIC_RELAXED)(header);
+}
+
+int validate_header(tar_header_t *header)
+{
+    // magic and version are contiguous: "ustar\0" then "00", checked as a single word
+    static const char expected[TMAGLEN + TVERSLEN] = {'u', 's', 't', 'a', 'r', '\0', '0', '0'};
+    uint64_t magic_version, expected_word;
+    memcpy(&magic_version, header->magic, sizeof(magic_version));
+    memcpy(&expected_word, expected, sizeof(expected_word));
+    if (magic_version != expected_word)
+    {
+        return memcmp(header->magic, TMAGIC, TMAGLEN) != 0 ? -1 : -2;
+    }
+    if (!checksum_matches(header))
+    {
+        return -3;
+    }
+
+    return 0;
+}
+
+#define SWAR_ONES 0x0101010101010101ULL
+
+/**
+ * Decodes the octal digits at the start of an 8-byte little-endian word
+ * @param digits set to the number of leading octal digits, up to 8
+ * @return the value of those digits
+ */
+static uint64_t swar_octal(uint64_t word, size_t *digits)
+{
+    // a byte is an octal digit when it is 0x30 to 0x37, i.e. its top 5 bits are 00110
+    uint64_t not_digit = (word & (0xf8 * SWAR_ONES)) ^ (0x30 * SWAR_ONES);
+    uint64_t high = (((not_digit & (0x7f * SWAR_ONES)) + (0x7f * SWAR_ONES)) | not_digit) & (0x80 * SWAR_ONES);
+    size_t count = high == 0 ? 8 : __builtin_ctzll(high) / 8;
+    *digits = count;
+    if (count == 0)
+        return 0;
+
+    // keep the digits, then shift them to the most significant end so that missing digits act as leading zeros
+    uint64_t value = word & (0x07 * SWAR_ONES);
+    value <<= (8 - count) * 8;
+    // merge neighbouring digits: 8 x 3 bits -> 4 x 6 bits -> 2 x 12 bits -> 24 bits
+    value = ((value & 0x00ff00ff00ff00ffULL) << 3) + ((value >> 8) & 0x00ff00ff00ff00ffULL);
+    value = ((value & 0x0000ffff0000ffffULL) << 6) + ((value >> 16) & 0x0000ffff0000ffffULL);
+    value = ((value & 0x00000000ffffffffULL) << 12) + (value >> 32);
+    return value;
+}
+
+uint64_t tar_parse_number(const char *field, size_t len)
+{
+    const uint8_t *bytes = (const uint8_t *)field;
+    if (len > 0 && bytes[0] & 0x80)
+    {
+        if (bytes[0] == 0xff)
+            return 0; // negative
+        uint64_t value = bytes[0] & 0x7f;
+        for (size_t i = 1; i < len; i++)
+            value = value << 8 | bytes[i];
+        return value;
+    }
+
+    size_t i = 0;
+    while (i < len && bytes[i] == ' ')
+        i++;
+    uint64_t value = 0;
+    while (i < len)
+    {
+        uint8_t chunk[8] = {0};
+        size_t chunk_len = len - i < sizeof(chunk) ? len - i : sizeof(chunk);
+        memcpy(chunk, bytes + i, chunk_len);
+        uint64_t word;
+        memcpy(&word, chunk, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        size_t digits;
+        uint64_t chunk_value = swar_octal(word, &digits);
+        value = (value << (3 * digits)) | chunk_value;
+        if (digits < sizeof(chunk))
+            break;
+        i += digits;
+    }
+    return value;
+}
+
+/**
+ * Number of blocks following a header to hold its payload
+ */
+static uint64_t payload_blocks(uint64_t size)
+{
+    return (size + BLK_SIZE - 1) / BLK_SIZE;
+}
+
+/**
+ * @return the payload of an entry in the mapping, NULL if the archive is not mapped whole
+ */
+static const uint8_t *entry_data(const tar_archive_t *tar, const tar_entry_t *entry)
+{
+    return tar->backend.data != NULL ? tar->backend.data + entry->header_off + BLK_SIZE : NULL;
+}
+
+static const char *entry_name(const tar_archive_t *tar, const tar_entry_t *entry)
+{
+    return tar->names + entry->name_off;
+}
+
+static const char *entry_link(const tar_archive_t *tar, const tar_entry_t *entry)
+{
+    return tar->names + entry->link_off;
+}
+
+/**
+ * FNV-1a hash of the `len` first bytes of `str`
+ */
+static uint64_t hash_path(const char *str, size_t len)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)str[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * Reserves `len` bytes at the end of the names arena
+ * @return the offset of the reserved bytes, or -1 if the arena could not grow
+ */
+static int64_t reserve_name(tar_archive_t *tar, size_t len)
+{
+    if (tar->names_len + len > tar->names_capacity)
+    {
+        size_t capacity = tar->names_capacity == 0 ? NAMES_INITIAL_CAPACITY : tar->names_capacity;
+        while (tar->names_len + len > capacity)
+            capacity *= 2;
+        char *names = realloc(tar->names, capacity);
+        if (names == NULL)
+            return -1;
+        tar->names = names;
+        tar->names_capacity = capacity;
+    }
+    int64_t off = tar->names_len;
+    tar->names_len += len;
+    return off;
+}
+
+/**
+ * Stores a copy of the `len` first bytes of `str`, NUL-terminated, in the names arena
+ * @return the offset of the copy, or -1 if the arena could not grow
+ */
+static int64_t store_string(tar_archive_t *tar, const char *str, size_t len)
+{
+    int64_t off = reserve_name(tar, len + 1);
+    if (off < 0)
+        return -1;
+    memcpy(tar->names + off, str, len);
+    tar->names[off + len] = '\0';
+    return off;
+}
+
+/**
+ * Stores the full path of a header, that is the ustar prefix, a '/' and the name
+ * @return the offset of the path in the names arena, or -1 if the arena could not grow
+ */
+static int64_t store_name(tar_archive_t *tar, tar_header_t *header, uint32_t *name_len)
+{
+    size_t prefix_len = strnlen(header->prefix, sizeof(header->prefix));
+    size_t len = strnlen(header->name, sizeof(header->name));
+    if (prefix_len == 0)
+    {
+        *name_len = len;
+        return store_string(tar, header->name, len);
+    }
+
+    size_t full_len = prefix_len + 1 + len;
+    int64_t off = reserve_name(tar, full_len + 1);
+    if (off < 0)
+        return -1;
+    char *dest = tar->names + off;
+    memcpy(dest, header->prefix, prefix_len);
+    dest[prefix_len] = '/';
+    memcpy(dest + prefix_len + 1, header->name, len);
+    dest[full_len] = '\0';
+    *name_len = full_len;
+    return off;
+}
+
+/**
+ * Appends a blank entry to the index
+ * @return the new entry, or NULL if the index could not grow
+ */
+static tar_entry_t *new_entry(tar_archive_t *tar)
+{
+    if (tar->no_entries == tar->capacity)
+    {
+        size_t capacity = tar->capacity == 0 ? INDEX_INITIAL_CAPACITY : tar->capacity * 2;
+        tar_entry_t *entries = realloc(tar->entries, capacity * sizeof(tar_entry_t));
+        if (entries == NULL)
+            return NULL;
+        tar->entries = entries;
+        tar->capacity = capacity;
+    }
+    tar_entry_t *entry = &tar->entries[tar->no_entries++];
+    memset(entry, 0, sizeof(tar_entry_t));
+    return entry;
+}
+
+int is_extension_type(char typeflag)
+{
+    return typeflag == XHDTYPE || typeflag == XGLTYPE || typeflag == GNUTYPE_LONGNAME || typeflag == GNUTYPE_LONGLINK;
+}
+
+/**
+ * Parses the "<length> <key>=<value>\n" records of a PAX extended header, keeping the keys the index uses.
+ * Parsing stops at the first malformed record.
+ */
+static void parse_pax_records(const char *data, size_t size, header_ext_t *ext)
+{
+    size_t pos = 0;
+    while (pos < size)
+    {
+        size_t record_len = 0;
+        size_t i = pos;
+        while (i < size && data[i] >= '0' && data[i] <= '9' && record_len <= size)
+            record_len = record_len * 10 + (data[i++] - '0');
+        if (i >= size || data[i] != ' ' || record_len <= i - pos + 1 || record_len > size - pos)
+            return;
+        const char *key = data + i + 1;
+        const char *end = data + pos + record_len - 1;
+        const char *equal = memchr(key, '=', end - key);
+        if (*end != '\n' || equal == NULL)
+            return;
+        const char *value = equal + 1;
+        size_t key_len = equal - key;
+        size_t value_len = end - value;
+
+        if (key_len == 4 && memcmp(key, "path", 4) == 0)
+        {
+            ext->path = value;
+            ext->path_len = value_len;
+        }
+        else if (key_len == 8 && memcmp(key, "linkpath", 8) == 0)
+        {
+            ext->linkpath = value;
+            ext->linkpath_len = value_len;
+        }
+        else if (key_len == 4 && memcmp(key, "size", 4) == 0)
+        {
+            ext->size = 0;
+            for (size_t j = 0; j < value_len && value[j] >= '0' && value[j] <= '9'; j++)
+                ext->size = ext->size * 10 + (value[j] - '0');
+            ext->has_size = 1;
+        }
+        pos += record_len;
+    }
+}
+
+void apply_extension(const tar_header_t *header, const char *payload, uint64_t size, header_ext_t *ext)
+{
+    switch (header->typeflag)
+    {
+    case XHDTYPE:
+        parse_pax_records(payload, size, ext);
+        break;
+    case GNUTYPE_LONGNAME:
+        ext->path = payload;
+        ext->path_len = strnlen(payload, size);
+        break;
+    case GNUTYPE_LONGLINK:
+        ext->linkpath = payload;
+        ext->linkpath_len = strnlen(payload, size);
+        break;
+    default:
+        break; // global headers only carry metadata the index does not keep
+    }
+}
+
+uint64_t member_size(const tar_header_t *header, const header_ext_t *ext)
+{
+    if (ext->has_size && !is_extension_type(header->typeflag))
+        return ext->size;
+    return TAR_INT(header->size);
+}
+
+static int append_entry(tar_archive_t *tar, uint64_t header_off, tar_header_t *header, uint64_t size,
+                        const header_ext_t *ext)
+{
+    uint32_t name_len;
+    int64_t name_off;
+    if (ext->path != NULL)
+    {
+        name_len = ext->path_len;
+        name_off = store_string(tar, ext->path, ext->path_len);
+    }
+    else
+    {
+        name_off = store_name(tar, header, &name_len);
+    }
+    // some archivers write directories without the trailing '/' the tree and the sorted order rely on: the name
+    // is the last string of the arena, so the '/' replaces its NUL and the NUL moves one byte on
+    if (name_off >= 0 && header->typeflag == DIRTYPE && name_len > 0 && tar->names[name_off + name_len - 1] != '/')
+    {
+        if (reserve_name(tar, 1) < 0)
+            return -1;
+        tar->names[name_off + name_len++] = '/';
+        tar->names[name_off + name_len] = '\0';
+    }
+    const char *link = ext->linkpath != NULL ? ext->linkpath : header->linkname;
+    size_t link_len = ext->linkpath != NULL ? ext->linkpath_len : strnlen(header->linkname, sizeof(header->linkname));
+    int64_t link_off = store_string(tar, link, link_len);
+    if (name_off < 0 || link_off < 0)
+        return -1;
+    tar_entry_t *entry = new_entry(tar);
+    if (entry == NULL)
+        return -1;
+
+    entry->header_off = header_off;
+    entry->size = size;
+    entry->name_off = name_off;
+    entry->name_len = name_len;
+    entry->link_off = link_off;
+    entry->link_len = link_len;
+    entry->hash = hash_path(tar->names + name_off, name_len);
+    entry->typeflag = header->typeflag;
+    return 0;
+}
+
+/**
+ * Finds the entry named `path` (of length `len` and hash `hash`), followed by a '/' when `dir` is set,
+ * in the hash table
+ * @return the entry, or NULL if there is none
+ */
+static const tar_entry_t *probe_name(const tar_archive_t *tar, const char *path, size_t len, int dir, uint64_t hash)
+{
+    if (tar->slots == NULL)
+        return NULL;
+    for (size_t slot = hash & tar->slot_mask;; slot = (slot + 1) & tar->slot_mask)
+    {
+        STATS_ADD(tar, STAT_PROBES, 1);
+        uint32_t index = tar->slots[slot];
+        if (index == 0)
+            return NULL;
+        const tar_entry_t *entry = &tar->entries[index - 1];
+        if (entry->hash != hash || entry->name_len != len + dir)
+            continue;
+        STATS_ADD(tar, STAT_NAME_COMPARES, 1);
+        const char *name = entry_name(tar, entry);
+        if (memcmp(name, path, len) == 0 && (!dir || name[len] == '/'))
+            return entry;
+    }
+}
+
+/**
+ * Finds the entry named `path` (of length `len` and hash `hash`) in the hash table
+ * @return the entry, or NULL if there is none
+ */
+static const tar_entry_t *probe_entry(const tar_archive_t *tar, const char *path, size_t len, uint64_t hash)
+{
+    return probe_name(tar, path, len, 0, hash);
+}
+
+/**
+ * Inserts the entry at `index` in the hash table, in place of the earlier entry with the same path if any
+ */
+static void insert_slot(tar_archive_t *tar, size_t index)
+{
+    const tar_entry_t *entry = &tar->entries[index];
+    size_t slot = entry->hash & tar->slot_mask;
+    while (tar->slots[slot] != 0)
+    {
+        const tar_entry_t *other = &tar->entries[tar->slots[slot] - 1];
+        if (other->hash == entry->hash && other->name_len == entry->name_len &&
+            memcmp(entry_name(tar, other), entry_name(tar, entry), entry->name_len) == 0)
+        {
+            tar->slots[slot] = index + 1;
+            return;
+        }
+        slot = (slot + 1) & tar->slot_mask;
+    }
+    tar->slots[slot] = index + 1;
+    tar->used_slots++;
+}
+
+/**
+ * (Re)builds the path-keyed hash table over the `no_entries` first entries.
+ * The table is kept at most half full so that probe sequences stay short.
+ * When a path appears several times, the last entry wins, as its extraction would overwrite the others.
+ *
+ * @return zero on success, -1 if the table could not be allocated
+ */
+static int build_hash_table(tar_archive_t *tar, size_t no_entries)
+{
+    size_t no_slots = 16;
+    while (no_slots < no_entries * 2)
+        no_slots *= 2;
+    uint32_t *slots = calloc(no_slots, sizeof(uint32_t));
+    if (slots == NULL)
+        return -1;
+    free(tar->slots);
+    tar->slots = slots;
+    tar->slot_mask = no_slots - 1;
+    tar->used_slots = 0;
+
+    for (size_t i = 0; i < no_entries; i++)
+        insert_slot(tar, i);
+    return 0;
+}
+
+/**
+ * Appends the last entry of the index to the hash table, growing the table when it gets half full
+ * @return zero on success, -1 if the table could not grow
+ */
+static int insert_last_entry(tar_archive_t *tar)
+{
+    if ((tar->used_slots + 1) * 2 > tar->slot_mask + 1)
+        return build_hash_table(tar, tar->no_entries);
+    insert_slot(tar, tar->no_entries - 1);
+    return 0;
+}
+
+/**
+ * Length of the path of the parent directory of `name`, trailing '/' included,
+ * zero if `name` is a top-level entry
+ */
+static size_t parent_len(const char *name, size_t len)
+{
+    if (len > 0 && name[len - 1] == '/')
+        len--;
+    while (len > 0 && name[len - 1] != '/')
+        len--;
+    return len;
+}
+
+/**
+ * Links every entry to its parent directory, creating the directories that only
+ * appear as a prefix of other paths on the way.
+ *
+ * @return zero on success, -1 if the index could not grow
+ */
+static int link_parents(tar_archive_t *tar)
+{
+    for (size_t i = 0; i < tar->no_entries; i++)
+    {
+        const char *name = entry_name(tar, &tar->entries[i]);
+        size_t len = parent_len(name, tar->entries[i].name_len);
+        if (len == 0)
+            continue;
+
+        uint64_t hash = hash_path(name, len);
+        const tar_entry_t *parent = probe_entry(tar, name, len, hash);
+        if (parent == NULL)
+        {
+            int64_t name_off = reserve_name(tar, len + 1);
+            if (name_off < 0)
+                return -1;
+            name = entry_name(tar, &tar->entries[i]); // the arena may have moved
+            memcpy(tar->names + name_off, name, len);
+            tar->names[name_off + len] = '\0';
+
+            tar_entry_t *dir = new_entry(tar);
+            if (dir == NULL)
+                return -1;
+            dir->header_off = NO_HEADER;
+            dir->name_off = name_off;
+            dir->name_len = len;
+            dir->link_off = name_off + len; // an empty link target, as for the directories of the archive
+            dir->hash = hash;
+            dir->typeflag = DIRTYPE;
+            if (insert_last_entry(tar) != 0)
+                return -1;
+            parent = dir;
+        }
+        tar->entries[i].parent = parent - tar->entries + 1;
+    }
+    return 0;
+}
+
+/**
+ * Normalizes a path in place: drops leading, repeated and trailing '/', "." components,
+ * and ".." components along with the component they cancel
+ *
+ * @return the length of the normalized path, or (size_t)-1 if it climbs above the root
+ */
+static size_t normalize_path(char *path)
+{
+    size_t out = 0;
+    const char *in = path;
+    while (*in != '\0')
+    {
+        while (*in == '/')
+            in++;
+        const char *end = strchrnul(in, '/');
+        size_t len = end - in;
+        if (len == 2 && in[0] == '.' && in[1] == '.')
+        {
+            if (out == 0)
+                return (size_t)-1;
+            while (out > 0 && path[out - 1] != '/')
+                out--;
+            if (out > 0)
+                out--;
+        }
+        else if (len > 0 && !(len == 1 && in[0] == '.'))
+        {
+            if (out > 0)
+                path[out++] = '/';
+            memmove(path + out, in, len);
+            out += len;
+        }
+        in = end;
+    }
+    path[out] = '\0';
+    return out;
+}
+
+/* State of the resolution of the links of an archive while it is indexed */
+typedef struct link_resolver
+{
+    uint8_t *state;    /* LINK_UNVISITED, LINK_IN_PROGRESS or LINK_DONE for each entry */
+    uint32_t *targets; /* resolved target index + 1 of each link entry, zero when dangling */
+    uint8_t *depths;   /* links followed to resolve each link entry, itself included */
+    int reached;       /* links followed when the last non-link entry was reached */
+    int too_deep;      /* set when a resolution stopped at LINK_MAX_HOPS */
+    int failed;        /* set when memory ran out while following a link */
+} link_resolver_t;
+
+enum
+{
+    LINK_UNVISITED,
+    LINK_IN_PROGRESS,
+    LINK_DONE
+};
+
+static int is_link_type(char typeflag)
+{
+    return typeflag == SYMTYPE || typeflag == LNKTYPE;
+}
+
+static const tar_entry_t *lookup_path(const tar_archive_t *tar, link_resolver_t *resolver, const char *path,
+                                      size_t len, int hops);
+
+/**
+ * Resolves the link entry at `index`, met after `hops` other links, to its final, non-link, target.
+ * At most LINK_MAX_HOPS links are followed in all, as by path resolution on Linux.
+ * Targets are memoized in the resolver with the number of links they take; a link met again while
+ * its own resolution is in progress belongs to a cycle and is left dangling. A link only found too
+ * deep is not memoized, as it may still resolve when met through fewer links.
+ *
+ * @return the target, or NULL if the link is dangling, part of a cycle or too deep
+ */
+static const tar_entry_t *resolve_link(const tar_archive_t *tar, link_resolver_t *resolver, size_t index, int hops)
+{
+    if (resolver->state[index] == LINK_IN_PROGRESS)
+        return NULL;
+    if (resolver->state[index] == LINK_DONE)
+    {
+        if (resolver->targets[index] == 0)
+            return NULL;
+        if (hops + resolver->depths[index] > LINK_MAX_HOPS)
+        {
+            resolver->too_deep = 1;
+            return NULL;
+        }
+        resolver->reached = hops + resolver->depths[index];
+        return &tar->entries[resolver->targets[index] - 1];
+    }
+    if (hops >= LINK_MAX_HOPS)
+    {
+        resolver->too_deep = 1;
+        return NULL;
+    }
+    resolver->state[index] = LINK_IN_PROGRESS;
+    int outer_too_deep = resolver->too_deep;
+    resolver->too_deep = 0;
+
+    // symlinks are relative to the directory holding them, hard links to the root of the archive
+    const tar_entry_t *entry = &tar->entries[index];
+    const char *link = entry_link(tar, entry);
+    size_t base_len = entry->typeflag == SYMTYPE && link[0] != '/' ? parent_len(entry_name(tar, entry), entry->name_len) : 0;
+    // names have no length limit with PAX records and GNU long names, the joined path is not kept on the stack
+    char *joined = malloc(base_len + entry->link_len + 1);
+    if (joined == NULL)
+    {
+        resolver->failed = 1;
+        return NULL;
+    }
+    memcpy(joined, entry_name(tar, entry), base_len);
+    memcpy(joined + base_len, link, entry->link_len + 1);
+    size_t len = normalize_path(joined);
+
+    const tar_entry_t *target = len == (size_t)-1 ? NULL : lookup_path(tar, resolver, joined, len, hops + 1);
+    free(joined);
+    if (target == NULL && resolver->too_deep)
+    {
+        resolver->state[index] = LINK_UNVISITED; // resolved again when met through fewer links
+    }
+    else
+    {
+        resolver->targets[index] = target == NULL ? 0 : target - tar->entries + 1;
+        resolver->depths[index] = target == NULL ? 0 : resolver->reached - hops;
+        resolver->state[index] = LINK_DONE;
+    }
+    resolver->too_deep |= outer_too_deep;
+    return target;
+}
+
+/**
+ * Follows `entry` if it is a link, through the resolver while indexing or through the memoized target afterwards
+ * @return the final target of the link, `entry` itself if it is not a link
+ */
+static const tar_entry_t *follow_link(const tar_archive_t *tar, link_resolver_t *resolver, const tar_entry_t *entry,
+                                      int hops)
+{
+    if (entry != NULL && !is_link_type(entry->typeflag) && resolver != NULL)
+        resolver->reached = hops;
+    if (entry == NULL || !is_link_type(entry->typeflag))
+        return entry;
+    if (resolver != NULL)
+        return resolve_link(tar, resolver, entry - tar->entries, hops);
+    return entry->target == 0 ? NULL : &tar->entries[entry->target - 1];
+}
+
+/**
+ * Finds the entry at `path`, as a directory if no entry has this exact path
+ */
+static const tar_entry_t *probe_path(const tar_archive_t *tar, const char *path, size_t len)
+{
+    uint64_t hash = hash_path(path, len);
+    const tar_entry_t *entry = probe_entry(tar, path, len, hash);
+    if (entry == NULL && len > 0 && path[len - 1] != '/')
+        entry = probe_name(tar, path, len, 1, (hash ^ '/') * FNV_PRIME);
+    return entry;
+}
+
+/**
+ * Finds the entry at a normalized `path`, following the symlinks met on the way,
+ * including the ones standing for directories in the middle of the path.
+ *
+ * @return the final, non-link, entry, or NULL if there is none or memory ran out, the resolver then being failed
+ */
+static const tar_entry_t *lookup_path(const tar_archive_t *tar, link_resolver_t *resolver, const char *path,
+                                      size_t len, int hops)
+{
+    if (hops > LINK_MAX_HOPS)
+        return NULL;
+    while (len > 0 && path[len - 1] == '/')
+        len--; // probed with and without it below
+    const tar_entry_t *entry = probe_path(tar, path, len);
+    if (entry != NULL)
+        return follow_link(tar, resolver, entry, hops);
+
+    // every directory holding an entry is indexed, so the first missing prefix ends the walk
+    for (const char *slash = memchr(path, '/', len); slash != NULL && slash < path + len - 1;
+         slash = memchr(slash + 1, '/', path + len - slash - 1))
+    {
+        const tar_entry_t *prefix = probe_path(tar, path, slash - path);
+        if (prefix == NULL)
+            return NULL;
+        if (!is_link_type(prefix->typeflag))
+            continue;
+
+        const tar_entry_t *dir = follow_link(tar, resolver, prefix, hops);
+        if (dir == NULL || dir->typeflag != DIRTYPE)
+            return NULL;
+        const char *rest = slash + 1;
+        size_t rest_len = path + len - rest;
+        const char *dir_name = entry_name(tar, dir);
+        size_t dir_len = dir->name_len;
+        if (dir_len > 0 && dir_name[dir_len - 1] == '/')
+            dir_len--;
+        char *substituted = malloc(dir_len + 1 + rest_len + 1);
+        if (substituted == NULL)
+        {
+            if (resolver != NULL)
+                resolver->failed = 1;
+            return NULL;
+        }
+        memcpy(substituted, dir_name, dir_len);
+        substituted[dir_len] = '/';
+        memcpy(substituted + dir_len + 1, rest, rest_len);
+        substituted[dir_len + 1 + rest_len] = '\0';
+        // the links the directory took are counted while indexing, only the memoized target is known afterwards
+        int dir_hops = resolver != NULL ? resolver->reached : hops + 1;
+        const tar_entry_t *target = lookup_path(tar, resolver, substituted, dir_len + 1 + rest_len, dir_hops);
+        free(substituted);
+        return target;
+    }
+    return NULL;
+}
+
+/**
+ * Resolves every symlink and hard link of the index to its final target
+ * @return zero on success, -1 if memory ran out
+ */
+static int resolve_links(tar_archive_t *tar)
+{
+    link_resolver_t resolver = {0};
+    resolver.state = calloc(tar->no_entries + 1, sizeof(uint8_t));
+    resolver.targets = calloc(tar->no_entries + 1, sizeof(uint32_t));
+    resolver.depths = calloc(tar->no_entries + 1, sizeof(uint8_t));
+    if (resolver.state == NULL || resolver.targets == NULL || resolver.depths == NULL)
+    {
+        free(resolver.state);
+        free(resolver.targets);
+        free(resolver.depths);
+        return -1;
+    }
+    for (size_t i = 0; i < tar->no_entries; i++)
+    {
+        if (is_link_type(tar->entries[i].typeflag))
+            resolve_link(tar, &resolver, i, 0);
+    }
+    for (size_t i = 0; i < tar->no_entries; i++)
+        tar->entries[i].target = resolver.targets[i];
+    free(resolver.state);
+    free(resolver.targets);
+    free(resolver.depths);
+    return resolver.failed ? -1 : 0;
+}
+
+/**
+ * The entry the hash table resolves the path of `entry` to
+ */
+static const tar_entry_t *find_slot_entry(const tar_archive_t *tar, const tar_entry_t *entry)
+{
+    return probe_entry(tar, entry_name(tar, entry), entry->name_len, entry->hash);
+}
+
+static int compare_children(const void *a, const void *b, void *arg)
+{
+    const tar_archive_t *tar = arg;
+    return strcmp(entry_name(tar, &tar->entries[*(const uint32_t *)a]),
+                  entry_name(tar, &tar->entries[*(const uint32_t *)b]));
+}
+
+/**
+ * Groups the entries by parent directory in the children array, each group sorted by name.
+ * Entries shadowed by a later entry with the same path are left out.
+ *
+ * @return zero on success, -1 if the array could not be allocated
+ */
+static int build_children(tar_archive_t *tar)
+{
+    tar->children = malloc((tar->no_entries + 1) * sizeof(uint32_t));
+    if (tar->children == NULL)
+        return -1;
+
+    for (size_t i = 0; i < tar->no_entries; i++)
+    {
+        tar_entry_t *entry = &tar->entries[i];
+        if (entry->parent != 0 && find_slot_entry(tar, entry) == entry)
+            tar->entries[entry->parent - 1].child_count++;
+    }
+    uint32_t start = 0;
+    for (size_t i = 0; i < tar->no_entries; i++)
+    {
+        tar->entries[i].child_start = start;
+        start += tar->entries[i].child_count;
+        tar->entries[i].child_count = 0;
+    }
+    for (size_t i = 0; i < tar->no_entries; i++)
+    {
+        tar_entry_t *entry = &tar->entries[i];
+        if (entry->parent != 0 && find_slot_entry(tar, entry) == entry)
+        {
+            tar_entry_t *parent = &tar->entries[entry->parent - 1];
+            tar->children[parent->child_start + parent->child_count++] = i;
+        }
+    }
+    for (size_t i = 0; i < tar->no_entries; i++)
+    {
+        tar_entry_t *dir = &tar->entries[i];
+        if (dir->child_count > 1)
+            qsort_r(&tar->children[dir->child_start], dir->child_count, sizeof(uint32_t), compare_children, tar);
+    }
+    return 0;
+}
+
+/**
+ * Lists the entries left in the children array in the order of their paths, by walking the directory tree
+ * depth-first with the children of each directory in order. A directory path being a prefix of every path
+ * below it and ending with a '/', this order is the order of strcmp() on the full paths.
+ *
+ * @return zero on success, -1 if the arrays could not be allocated
+ */
+static int build_sorted(tar_archive_t *tar)
+{
+    tar->sorted = malloc((tar->no_entries + 1) * sizeof(uint32_t));
+    uint32_t *stack = malloc((tar->no_entries + 1) * sizeof(uint32_t));
+    if (tar->sorted == NULL || stack == NULL)
+    {
+        free(stack);
+        return -1;
+    }
+
+    // top-level entries are popped first, so they are pushed from the last one
+    size_t top = 0;
+    for (size_t i = 0; i < tar->no_entries; i++)
+    {
+        if (tar->entries[i].parent == 0 && find_slot_entry(tar, &tar->entries[i]) == &tar->entries[i])
+            stack[top++] = i;
+    }
+    qsort_r(stack, top, sizeof(uint32_t), compare_children, tar);
+    for (size_t i = 0; i < top / 2; i++)
+    {
+        uint32_t swap = stack[i];
+        stack[i] = stack[top - 1 - i];
+        stack[top - 1 - i] = swap;
+    }
+
+    size_t count = 0;
+    while (top > 0)
+    {
+        const tar_entry_t *entry = &tar->entries[stack[--top]];
+        tar->sorted[count++] = entry - tar->entries;
+        for (uint32_t child = entry->child_count; child > 0; child--)
+            stack[top++] = tar->children[entry->child_start + child - 1];
+    }
+    tar->no_sorted = count;
+    free(stack);
+    return 0;
+}
+
+/**
+ * Checks whether a header is in GNU tar's own format, with a "ustar  \0" magic and version.
+ * check_archive() rejects such headers, but they are indexed so that GNU archives can be queried.
+ */
+int is_gnu_header(tar_header_t *header)
+{
+    return memcmp(header->magic, "ustar  ", TMAGLEN + TVERSLEN) == 0 && checksum_matches(header);
+}
+
+/* State of the walk over the headers of an archive being indexed */
+typedef struct index_walk
+{
+    int header_amount;
+    int error;
+    header_ext_t ext;  /* overrides of the next member, pointing into extension payloads still around */
+    uint64_t end;      /* end of the last regular member, and header_amount and error right after it */
+    int end_headers;
+    int end_error;
+} index_walk_t;
+
+/**
+ * Validates a header block met while walking the archive
+ * @return the payload size of its member, or -1 if the block is a null or invalid one, to step over alone
+ */
+static int64_t walk_header(const tar_archive_t *tar, index_walk_t *walk, tar_header_t *header)
+{
+    if (header->name[0] == '\0')
+        return -1;
+    STATS_START(start);
+    int ret = validate_header(header);
+    STATS_SINCE(tar, STAT_VALIDATE_NS, start);
+    STATS_ADD(tar, STAT_HEADERS, 1);
+    if (ret != 0 && walk->error == 0)
+        walk->error = ret;
+    if (ret != 0 && !is_gnu_header(header))
+    {
+        memset(&walk->ext, 0, sizeof(walk->ext));
+        return -1;
+    }
+    return member_size(header, &walk->ext);
+}
+
+/**
+ * Indexes a member whose whole payload is in the archive, folding extension headers into the next member
+ * @param payload The payload of the member, only read for extension headers, NULL for the ones skipped
+ *                past EXTENSION_MAX_SIZE.
+ * @return zero on success, -1 if the index could not grow
+ */
+static int walk_member(tar_archive_t *tar, index_walk_t *walk, uint64_t header_off, tar_header_t *header,
+                       const char *payload, uint64_t size)
+{
+    if (is_extension_type(header->typeflag))
+    {
+        if (payload != NULL)
+            apply_extension(header, payload, size, &walk->ext);
+    }
+    else
+    {
+        if (append_entry(tar, header_off, header, size, &walk->ext) != 0)
+            return -1;
+        memset(&walk->ext, 0, sizeof(walk->ext));
+        walk->end = header_off + BLK_SIZE + payload_blocks(size) * BLK_SIZE;
+        walk->end_headers = walk->header_amount + 1;
+        walk->end_error = walk->error;
+    }
+    walk->header_amount += 1;
+    return 0;
+}
+
+/**
+ * Builds the lookup structures once every member is indexed
+ * @return zero on success, -1 if they could not be allocated
+ */
+static int finish_index(tar_archive_t *tar, const index_walk_t *walk)
+{
+    tar->check_result = walk->error != 0 ? walk->error : walk->header_amount;
+    tar->walked_end = walk->end;
+    tar->walked_headers = walk->end_headers;
+    tar->walked_error = walk->end_error;
+    if (build_hash_table(tar, tar->no_entries) != 0 || link_parents(tar) != 0 || resolve_links(tar) != 0)
+        return -1;
+    if (build_children(tar) != 0)
+        return -1;
+    return build_sorted(tar);
+}
+
+/**
+ * Walks every header of the archive from `off` on once, filling the index.
+ *
+ * Invalid headers are skipped one block at a time, as lookups always did, while the first
+ * validation error is kept aside for check_archive(). PAX and GNU extension headers are
+ * folded into the member that follows them. The headers are read through a window, either
+ * preset to the whole mapping or slid along them, never touching the payloads of regular members.
+ *
+ * @return zero on success, -1 if memory ran out or the archive could not be mapped
+ */
+static int walk_archive(tar_archive_t *tar, map_window_t *window, index_walk_t *walk, uint64_t off)
+{
+    char **kept = NULL; /* extension payloads walk->ext may point into, once the window moved on */
+    size_t no_kept = 0;
+    uint64_t ext_size = 0; /* payload bytes of the extension headers read since the last member */
+    int ret = 0;
+
+    while (ret == 0 && window->file_size - off >= BLK_SIZE)
+    {
+        tar_header_t *header = (tar_header_t *)window_at(window, off, BLK_SIZE);
+        if (header == NULL)
+        {
+            ret = -1;
+            break;
+        }
+        int64_t size = walk_header(tar, walk, header);
+        if (size < 0)
+        {
+            off += BLK_SIZE;
+            continue;
+        }
+        if ((uint64_t)size > window->file_size - off - BLK_SIZE)
+            break; // truncated payload
+
+        int extension = is_extension_type(header->typeflag);
+        const char *payload = NULL;
+        if (extension && (uint64_t)size <= EXTENSION_MAX_SIZE - ext_size)
+        {
+            ext_size += size;
+            header = (tar_header_t *)window_at(window, off, BLK_SIZE + size);
+            payload = header != NULL ? (const char *)(header + 1) : NULL;
+            if (payload != NULL && window->len < window->file_size)
+            {
+                char **grown = realloc(kept, (no_kept + 1) * sizeof(char *));
+                char *copy = grown != NULL ? malloc(size + 1) : NULL;
+                if (grown != NULL)
+                    kept = grown;
+                if (copy != NULL)
+                    kept[no_kept++] = memcpy(copy, payload, size);
+                payload = copy;
+            }
+            if (payload == NULL)
+            {
+                ret = -1;
+                break;
+            }
+        }
+        ret = walk_member(tar, walk, off, header, payload, size);
+        if (!extension)
+        {
+            for (; no_kept > 0; no_kept--)
+                free(kept[no_kept - 1]); // folded into the member just indexed, which copied what it keeps
+            ext_size = 0;
+        }
+        off += BLK_SIZE + payload_blocks(size) * BLK_SIZE;
+    }
+    for (size_t i = 0; i < no_kept; i++)
+        free(kept[i]);
+    free(kept);
+    return ret != 0 ? -1 : 0;
+}
+
+/**
+ * Indexes a whole archive through a window, see walk_archive()
+ * @return zero on success, -1 if memory ran out or the archive could not be mapped
+ */
+static int build_index(tar_archive_t *tar, map_window_t *window)
+{
+    index_walk_t walk = {0};
+    return walk_archive(tar, window, &walk, 0) != 0 ? -1 : finish_index(tar, &walk);
+}
+
+/* Indexer fed with the decompressed bytes of a compressed archive, in order */
+typedef struct stream_indexer
+{
+    tar_archive_t *tar;
+    index_walk_t walk;
+    uint64_t offset;       /* decompressed bytes received so far */
+    tar_header_t header;   /* header being received */
+    size_t header_fill;
+    uint64_t header_off;
+    uint64_t size;         /* payload size of the current member */
+    uint64_t received;     /* payload bytes of the current member received so far */
+    char *payload;         /* payload of the current extension header, NULL for other members */
+    char **kept;           /* extension payloads walk.ext may point into */
+    size_t no_kept;
+    uint64_t ext_size;     /* bytes of these payloads */
+} stream_indexer_t;
+
+static void release_kept(stream_indexer_t *indexer)
+{
+    for (size_t i = 0; i < indexer->no_kept; i++)
+        free(indexer->kept[i]);
+    indexer->no_kept = 0;
+    indexer->ext_size = 0;
+}
+
+/**
+ * Indexes the member whose payload was just received in full
+ * @return zero on success, -1 if the index could not grow
+ */
+static int stream_member(stream_indexer_t *indexer)
+{
+    int extension = is_extension_type(indexer->header.typeflag);
+    if (walk_member(indexer->tar, &indexer->walk, indexer->header_off, &indexer->header, indexer->payload,
+                    indexer->size) != 0)
+        return -1;
+    indexer->payload = NULL;
+    if (!extension)
+        release_kept(indexer);
+    return 0;
+}
+
+/**
+ * Handles a header once all of its bytes were received
+ * @return zero on success, -1 if memory ran out
+ */
+static int stream_header(stream_indexer_t *indexer)
+{
+    indexer->header_fill = 0;
+    int64_t size = walk_header(indexer->tar, &indexer->walk, &indexer->header);
+    if (size < 0)
+    {
+        if (indexer->walk.ext.path == NULL && indexer->walk.ext.linkpath == NULL)
+            release_kept(indexer);
+        return 0;
+    }
+    indexer->size = size;
+    indexer->received = 0;
+    if (is_extension_type(indexer->header.typeflag) && (uint64_t)size <= EXTENSION_MAX_SIZE - indexer->ext_size)
+    {
+        char **kept = realloc(indexer->kept, (indexer->no_kept + 1) * sizeof(char *));
+        if (kept == NULL)
+            return -1;
+        indexer->kept = kept;
+        indexer->payload = malloc(size + 1);
+        if (indexer->payload == NULL)
+            return -1;
+        indexer->kept[indexer->no_kept++] = indexer->payload;
+        indexer->ext_size += size;
+    }
+    return size == 0 ? stream_member(indexer) : 0;
+}
+
+static int stream_consume(void *arg, const uint8_t *data, size_t len)
+{
+    stream_indexer_t *indexer = arg;
+    while (len > 0)
+    {
+        // blocks are either part of a header, or of a payload and its padding
+        uint64_t payload_end = indexer->header_off + BLK_SIZE + indexer->size;
+        uint64_t member_end = indexer->header_off + BLK_SIZE + payload_blocks(indexer->size) * BLK_SIZE;
+        size_t step;
+        if (indexer->header_fill > 0 || indexer->offset >= member_end)
+        {
+            if (indexer->header_fill == 0)
+            {
+                indexer->header_off = indexer->offset;
+                indexer->size = 0;
+            }
+            step = BLK_SIZE - indexer->header_fill < len ? BLK_SIZE - indexer->header_fill : len;
+            memcpy((uint8_t *)&indexer->header + indexer->header_fill, data, step);
+            indexer->header_fill += step;
+            if (indexer->header_fill == BLK_SIZE && stream_header(indexer) != 0)
+                return -1;
+        }
+        else
+        {
+            uint64_t left = indexer->offset < payload_end ? payload_end - indexer->offset : member_end - indexer->offset;
+            step = left < len ? left : len;
+            if (indexer->offset < payload_end)
+            {
+                if (indexer->payload != NULL)
+                    memcpy(indexer->payload + indexer->received, data, step);
+                indexer->received += step;
+                if (indexer->received == indexer->size && stream_member(indexer) != 0)
+                    return -1;
+            }
+        }
+        indexer->offset += step;
+        data += step;
+        len -= step;
+    }
+    return 0;
+}
+
+/**
+ * Indexes a gzip-compressed archive, recording the checkpoints its files are then read from
+ * @return zero on success, -1 if the archive is corrupted or memory ran out
+ */
+static int build_gzip_index(tar_archive_t *tar, uint64_t interval)
+{
+    stream_indexer_t indexer;
+    memset(&indexer, 0, sizeof(indexer));
+    indexer.tar = tar;
+    // the first header starts right away, as if an empty member ended at offset zero
+    indexer.header_off = -(uint64_t)BLK_SIZE;
+    tar->gz = gz_build_index(tar->backend.data, tar->backend.size, interval, stream_consume, &indexer);
+    release_kept(&indexer);
+    free(indexer.kept);
+    if (tar->gz == NULL)
+        return -1;
+    return finish_index(tar, &indexer.walk);
+}
+
+static size_t align8(size_t off)
+{
+    return (off + 7) & ~(size_t)7;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *ptr = buf;
+    while (len > 0)
+    {
+        ssize_t written = write(fd, ptr, len);
+        if (written <= 0)
+            return -1;
+        ptr += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/**
+ * Writes the index of `tar` to `index_path`.
+ *
+ * The file is written next to its final location then renamed over it, so that a
+ * concurrent reader never maps a partially written index.
+ *
+ * @return zero on success, -1 otherwise
+ */
+static int write_sidecar(const tar_archive_t *tar, const struct stat *statbuf, const char *index_path)
+{
+    sidecar_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+    header.version = SIDECAR_VERSION;
+    header.entry_size = sizeof(tar_entry_t);
+    header.archive_size = statbuf->st_size;
+    header.archive_mtime_sec = statbuf->st_mtim.tv_sec;
+    header.archive_mtime_nsec = statbuf->st_mtim.tv_nsec;
+    header.check_result = tar->check_result;
+    header.walked_end = tar->walked_end;
+    header.walked_headers = tar->walked_headers;
+    header.walked_error = tar->walked_error;
+    header.no_entries = tar->no_entries;
+    header.names_len = tar->names_len;
+    header.no_slots = tar->slot_mask + 1;
+    header.entries_off = align8(sizeof(header));
+    header.names_off = align8(header.entries_off + tar->no_entries * sizeof(tar_entry_t));
+    header.slots_off = align8(header.names_off + tar->names_len);
+    header.children_off = align8(header.slots_off + header.no_slots * sizeof(uint32_t));
+    header.no_sorted = tar->no_sorted;
+    header.sorted_off = align8(header.children_off + tar->no_entries * sizeof(uint32_t));
+
+    char tmp_path[strlen(index_path) + 5];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+
+    static const uint8_t padding[8];
+    struct
+    {
+        const void *data;
+        size_t len;
+        uint64_t off;
+    } sections[] = {
+        {&header, sizeof(header), 0},
+        {tar->entries, tar->no_entries * sizeof(tar_entry_t), header.entries_off},
+        {tar->names, tar->names_len, header.names_off},
+        {tar->slots, header.no_slots * sizeof(uint32_t), header.slots_off},
+        {tar->children, tar->no_entries * sizeof(uint32_t), header.children_off},
+        {tar->sorted, tar->no_sorted * sizeof(uint32_t), header.sorted_off},
+    };
+    uint64_t pos = 0;
+    int ret = 0;
+    for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]) && ret == 0; i++)
+    {
+        ret = write_all(fd, padding, sections[i].off - pos);
+        if (ret == 0)
+            ret = write_all(fd, sections[i].data, sections[i].len);
+        pos = sections[i].off + sections[i].len;
+    }
+    if (close(fd) != 0 || ret != 0 || rename(tmp_path, index_path) != 0)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int section_fits(uint64_t off, uint64_t len, size_t file_size)
+{
+    return off % 8 == 0 && off <= file_size && len <= file_size - off;
+}
+
+static int name_fits(const char *names, uint64_t names_len, uint64_t off, uint64_t len)
+{
+    return off < names_len && len < names_len - off && names[off + len] == '\0';
+}
+
+/**
+ * Checks that every offset and index stored in the sections of a sidecar stays within
+ * them, as the file is only a cache anyone may have written over.
+ *
+ * Payloads are checked against the archive size unless it is compressed, since its
+ * files are then read through the checkpoints, which stop at the end of the stream.
+ *
+ * @return non-zero if the sections can be trusted
+ */
+static int sidecar_sections_valid(const uint8_t *map, const sidecar_header_t *header, int compressed)
+{
+    const tar_entry_t *entries = (const tar_entry_t *)(map + header->entries_off);
+    const char *names = (const char *)(map + header->names_off);
+    const uint32_t *slots = (const uint32_t *)(map + header->slots_off);
+    const uint32_t *children = (const uint32_t *)(map + header->children_off);
+    const uint32_t *sorted = (const uint32_t *)(map + header->sorted_off);
+    uint64_t no_entries = header->no_entries;
+    uint64_t archive_size = header->archive_size;
+    uint64_t no_children = 0;
+    for (uint64_t i = 0; i < no_entries; i++)
+    {
+        const tar_entry_t *entry = &entries[i];
+        if (!name_fits(names, header->names_len, entry->name_off, entry->name_len) ||
+            !name_fits(names, header->names_len, entry->link_off, entry->link_len) ||
+            entry->parent > no_entries || entry->target > no_entries ||
+            entry->child_start > no_entries || entry->child_count > no_entries - entry->child_start)
+            return 0;
+        if (!compressed && entry->header_off != NO_HEADER &&
+            (archive_size < BLK_SIZE || entry->header_off > archive_size - BLK_SIZE ||
+             entry->size > archive_size - BLK_SIZE - entry->header_off))
+            return 0;
+        // the ranges of directories are disjoint, only their children are ever written
+        no_children += entry->child_count;
+        if (no_children > no_entries)
+            return 0;
+        for (uint32_t child = 0; child < entry->child_count; child++)
+            if (children[entry->child_start + child] >= no_entries)
+                return 0;
+    }
+    for (uint64_t i = 0; i < header->no_sorted; i++)
+        if (sorted[i] >= no_entries)
+            return 0;
+    // probes stop at the first empty slot, a full table would make them loop forever
+    int empty = 0;
+    for (uint64_t i = 0; i < header->no_slots; i++)
+    {
+        if (slots[i] > no_entries)
+            return 0;
+        empty |= slots[i] == 0;
+    }
+    return empty;
+}
+
+/**
+ * Maps the sidecar index at `index_path` and points the index of `tar` into it.
+ *
+ * @return zero if the sidecar was loaded, -1 if it is missing, malformed, points outside
+ *         its own sections or was built from another version of the archive
+ */
+static int load_sidecar(tar_archive_t *tar, const struct stat *statbuf, const char *index_path)
+{
+    int fd = open(index_path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    struct stat index_stat;
+    if (fstat(fd, &index_stat) == -1 || index_stat.st_size < (off_t)sizeof(sidecar_header_t))
+    {
+        close(fd);
+        return -1;
+    }
+    size_t size = index_stat.st_size;
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const sidecar_header_t *header = (const sidecar_header_t *)map;
+    uint64_t no_slots = header->no_slots;
+    int valid = memcmp(header->magic, SIDECAR_MAGIC, sizeof(header->magic)) == 0 &&
+                header->version == SIDECAR_VERSION &&
+                header->entry_size == sizeof(tar_entry_t) &&
+                header->archive_size == (uint64_t)statbuf->st_size &&
+                header->archive_mtime_sec == statbuf->st_mtim.tv_sec &&
+                header->archive_mtime_nsec == statbuf->st_mtim.tv_nsec &&
+                no_slots >= 16 && (no_slots & (no_slots - 1)) == 0 &&
+                header->no_entries < UINT32_MAX &&
+                section_fits(header->entries_off, header->no_entries * sizeof(tar_entry_t), size) &&
+                section_fits(header->names_off, header->names_len, size) &&
+                section_fits(header->slots_off, no_slots * sizeof(uint32_t), size) &&
+                section_fits(header->children_off, header->no_entries * sizeof(uint32_t), size) &&
+                header->no_sorted <= header->no_entries &&
+                section_fits(header->sorted_off, header->no_sorted * sizeof(uint32_t), size) &&
+                sidecar_sections_valid(map, header, tar->gz != NULL);
+    if (!valid)
+    {
+        munmap(map, size);
+        return -1;
+    }
+
+    tar->index_map = map;
+    tar->index_map_size = size;
+    tar->check_result = header->check_result;
+    tar->walked_end = header->walked_end;
+    tar->walked_headers = header->walked_headers;
+    tar->walked_error = header->walked_error;
+    tar->entries = (tar_entry_t *)(map + header->entries_off);
+    tar->no_entries = header->no_entries;
+    tar->names = (char *)(map + header->names_off);
+    tar->names_len = header->names_len;
+    tar->slots = (uint32_t *)(map + header->slots_off);
+    tar->slot_mask = no_slots - 1;
+    tar->children = (uint32_t *)(map + header->children_off);
+    tar->sorted = (uint32_t *)(map + header->sorted_off);
+    tar->no_sorted = header->no_sorted;
+    return 0;
+}
+
+tar_archive_t *tar_open(int tar_fd)
+{
+    return tar_open_with(tar_fd, NULL);
+}
+
+tar_archive_t *tar_open_with(int tar_fd, const tar_options_t *options)
+{
+    tar_backend_t kind = options != NULL ? options->backend : TAR_BACKEND_MMAP;
+    struct stat statbuf;
+    if (kind == TAR_BACKEND_MEMORY)
+    {
+        memset(&statbuf, 0, sizeof(statbuf));
+        statbuf.st_size = options->buffer_size;
+        tar_fd = -1;
+    }
+    else if (fstat(tar_fd, &statbuf) == -1)
+    {
+        return NULL;
+    }
+
+    tar_archive_t *tar = calloc(1, sizeof(tar_archive_t));
+    if (tar == NULL)
+        return NULL;
+#ifdef TAR_STATS
+    tar->stats = stats_create();
+#endif
+
+    uint64_t window = options != NULL ? options->map_window : 0;
+    int windowed = kind == TAR_BACKEND_PREAD;
+    if (kind == TAR_BACKEND_MMAP && window > 0 && (uint64_t)statbuf.st_size > window)
+        windowed = 1;
+    if (windowed)
+    {
+        uint8_t magic[2];
+        windowed = !(pread(tar_fd, magic, sizeof(magic), 0) == sizeof(magic) && is_gzip(magic, sizeof(magic)));
+    }
+    tar->backend.fd = tar_fd;
+    tar->backend.size = statbuf.st_size;
+    tar->backend.ops = kind == TAR_BACKEND_MEMORY ? &memory_backend : windowed ? &pread_backend : &mmap_backend;
+    STATS_START(start);
+    int ret = tar->backend.ops->open(&tar->backend, options);
+    if (tar->backend.ops == &mmap_backend)
+    {
+        STATS_SINCE(tar, STAT_MAP_NS, start);
+        STATS_ADD(tar, STAT_MAPS, 1);
+    }
+    if (ret != 0)
+    {
+        tar_close(tar);
+        return NULL;
+    }
+
+    // a buffer has no size and modification time telling which version of the archive the files were built from
+    int cached = kind != TAR_BACKEND_MEMORY && options != NULL;
+    const char *index_path = cached ? options->index_path : NULL;
+    const char *checkpoint_path = cached ? options->checkpoint_path : NULL;
+    const uint8_t *data = tar->backend.data;
+    int compressed = data != NULL && is_gzip(data, tar->backend.size);
+    if ((compressed || data == NULL) && options != NULL && options->cache_size > 0)
+        tar->cache = cache_create(options->cache_size, options->cache_chunk); // reads go around a missing cache
+    if (compressed && checkpoint_path != NULL)
+        tar->gz = gz_load_index(checkpoint_path, &statbuf);
+    // the index of a compressed archive is of no use without the checkpoints its files are read from
+    if (index_path != NULL && (!compressed || tar->gz != NULL) && load_sidecar(tar, &statbuf, index_path) == 0)
+    {
+        if (!compressed)
+            tar->backend.ops->advise(&tar->backend, 0, tar->backend.size, MADV_RANDOM);
+        return tar;
+    }
+    gz_free_index(tar->gz);
+    tar->gz = NULL;
+
+    if (compressed)
+    {
+        ret = build_gzip_index(tar, options != NULL ? options->checkpoint_interval : 0);
+    }
+    else
+    {
+        // headers are walked in order, files are then read wherever queries lead
+        map_window_t headers = {.fd = tar_fd, .file_size = statbuf.st_size, .size = window};
+        if (kind == TAR_BACKEND_PREAD)
+            headers = (map_window_t){.fd = tar_fd, .file_size = statbuf.st_size, .size = tar->backend.readahead,
+                                     .buffered = 1};
+        if (data != NULL)
+            headers = (map_window_t){.file_size = tar->backend.size, .base = (uint8_t *)data, .len = tar->backend.size};
+        tar->backend.ops->advise(&tar->backend, 0, tar->backend.size, MADV_SEQUENTIAL);
+        ret = build_index(tar, &headers);
+        if (data == NULL)
+            window_release(&headers);
+        STATS_ADD(tar, STAT_MAPS, headers.no_maps);
+        STATS_ADD(tar, STAT_MAP_NS, headers.map_ns);
+        tar->backend.ops->advise(&tar->backend, 0, tar->backend.size, MADV_RANDOM);
+    }
+    if (ret != 0)
+    {
+        tar_close(tar);
+        return NULL;
+    }
+    if (compressed && checkpoint_path != NULL)
+        gz_save_index(tar->gz, checkpoint_path, &statbuf); // best effort too
+    if (index_path != NULL)
+        write_sidecar(tar, &statbuf, index_path); // best effort, the index is only a cache
+    return tar;
+}
+
+/**
+ * Copies an index mapped from a sidecar file to memory the index can grow in, unmapping the file
+ * @return zero on success, -1 if memory ran out
+ */
+static int own_index(tar_archive_t *tar)
+{
+    if (tar->index_map == NULL)
+        return 0;
+    size_t no_slots = tar->slot_mask + 1;
+    tar_entry_t *entries = malloc((tar->no_entries + 1) * sizeof(tar_entry_t));
+    char *names = malloc(tar->names_len + 1);
+    uint32_t *slots = malloc(no_slots * sizeof(uint32_t));
+    if (entries == NULL || names == NULL || slots == NULL)
+    {
+        free(entries);
+        free(names);
+        free(slots);
+        return -1;
+    }
+    tar->entries = memcpy(entries, tar->entries, tar->no_entries * sizeof(tar_entry_t));
+    tar->capacity = tar->no_entries + 1;
+    tar->names = memcpy(names, tar->names, tar->names_len);
+    tar->names_capacity = tar->names_len + 1;
+    tar->slots = memcpy(slots, tar->slots, no_slots * sizeof(uint32_t));
+    tar->used_slots = 0;
+    for (size_t slot = 0; slot < no_slots; slot++)
+        tar->used_slots += tar->slots[slot] != 0;
+    tar->children = NULL; // rebuilt along with the sorted array
+    tar->sorted = NULL;
+    munmap(tar->index_map, tar->index_map_size);
+    tar->index_map = NULL;
+    return 0;
+}
+
+int tar_refresh(tar_archive_t *tar)
+{
+    struct stat statbuf;
+    if (tar->gz != NULL || tar->backend.fd == -1 || fstat(tar->backend.fd, &statbuf) == -1)
+        return -1;
+    if ((uint64_t)statbuf.st_size < tar->backend.size)
+        return -1; // rewritten rather than appended to
+    if (tar->walked_end + BLK_SIZE > (uint64_t)statbuf.st_size)
+        return 0;
+    if ((uint64_t)statbuf.st_size == tar->backend.size)
+    {
+        // GNU tar appends into the zero padding of its last record, which may leave the size as it was
+        uint8_t block[BLK_SIZE];
+        if (tar->backend.ops->read(&tar->backend, tar->walked_end, block, BLK_SIZE) != 0)
+            return -1;
+        size_t i = 0;
+        while (i < BLK_SIZE && block[i] == 0)
+            i++;
+        if (i == BLK_SIZE)
+            return 0;
+    }
+    if (own_index(tar) != 0)
+        return -1;
+    if ((uint64_t)statbuf.st_size != tar->backend.size &&
+        tar->backend.ops->resize(&tar->backend, statbuf.st_size) != 0)
+        return -1;
+
+    // appended members overwrite the end-of-archive blocks, which follow the last member indexed
+    size_t first_new = tar->no_entries;
+    index_walk_t walk = {.header_amount = tar->walked_headers, .error = tar->walked_error, .end = tar->walked_end,
+                         .end_headers = tar->walked_headers, .end_error = tar->walked_error};
+    map_window_t headers = {.fd = tar->backend.fd, .file_size = statbuf.st_size, .size = tar->backend.readahead,
+                            .buffered = 1};
+    if (tar->backend.data != NULL)
+        headers = (map_window_t){.file_size = statbuf.st_size, .base = (uint8_t *)tar->backend.data,
+                                 .len = statbuf.st_size};
+    int ret = walk_archive(tar, &headers, &walk, tar->walked_end);
+    if (tar->backend.data == NULL)
+        window_release(&headers);
+    if (ret != 0)
+        return -1;
+    size_t no_new = tar->no_entries - first_new;
+
+    // only the new entries are hashed, the arrays derived from the whole tree are rebuilt in memory
+    if ((tar->used_slots + no_new) * 2 > tar->slot_mask + 1)
+    {
+        ret = build_hash_table(tar, tar->no_entries);
+    }
+    else
+    {
+        for (size_t i = first_new; i < tar->no_entries; i++)
+            insert_slot(tar, i);
+    }
+    for (size_t i = 0; i < tar->no_entries; i++)
+        tar->entries[i].child_count = 0;
+    free(tar->children);
+    free(tar->sorted);
+    tar->children = NULL;
+    tar->sorted = NULL;
+    tar->check_result = walk.error != 0 ? walk.error : walk.header_amount;
+    tar->walked_end = walk.end;
+    tar->walked_headers = walk.end_headers;
+    tar->walked_error = walk.end_error;
+    if (ret != 0 || link_parents(tar) != 0 || resolve_links(tar) != 0 || build_children(tar) != 0 ||
+        build_sorted(tar) != 0)
+        return -1;
+    return no_new;
+}
+
+void tar_close(tar_archive_t *tar)
+{
+    if (tar == NULL)
+        return;
+    if (tar->backend.ops != NULL)
+        tar->backend.ops->close(&tar->backend);
+    gz_free_index(tar->gz);
+    cache_free(tar->cache);
+    if (tar->index_map != NULL)
+    {
+        munmap(tar->index_map, tar->index_map_size);
+    }
+    else
+    {
+        free(tar->entries);
+        free(tar->names);
+        free(tar->slots);
+        free(tar->children);
+        free(tar->sorted);
+    }
+#ifdef TAR_STATS
+    stats_free(tar->stats);
+#endif
+    free(tar);
+}
+
+/**
+ * Finds the entry named `path` in the index
+ * @return the entry, or NULL if there is none
+ */
+static const tar_entry_t *find_entry(const tar_archive_t *tar, const char *path)
+{
+    size_t len = strlen(path);
+    return probe_entry(tar, path, len, hash_path(path, len));
+}
+
+static int is_file_type(char typeflag)
+{
+    return typeflag == REGTYPE || typeflag == AREGTYPE;
+}
+
+size_t tar_lookup_batch(const tar_archive_t *tar, const char *const *paths, size_t count, tar_lookup_t *results)
+{
+    // paths are hashed and their home slot prefetched a few iterations before being probed,
+    // so that the cache misses of consecutive lookups overlap instead of adding up
+    size_t lens[LOOKUP_PREFETCH_DISTANCE];
+    uint64_t hashes[LOOKUP_PREFETCH_DISTANCE];
+    size_t found = 0;
+
+    for (size_t i = 0; i < count + LOOKUP_PREFETCH_DISTANCE; i++)
+    {
+        size_t ahead = i % LOOKUP_PREFETCH_DISTANCE;
+        if (i >= LOOKUP_PREFETCH_DISTANCE)
+        {
+            size_t current = i - LOOKUP_PREFETCH_DISTANCE;
+            const tar_entry_t *entry = probe_entry(tar, paths[current], lens[ahead], hashes[ahead]);
+            tar_lookup_t *result = &results[current];
+            memset(result, 0, sizeof(tar_lookup_t));
+            if (entry != NULL)
+            {
+                result->found = 1;
+                result->typeflag = entry->typeflag;
+                result->size = entry->size;
+                result->offset = entry->header_off == NO_HEADER ? 0 : entry->header_off + BLK_SIZE;
+                found++;
+            }
+        }
+        if (i < count)
+        {
+            lens[ahead] = strlen(paths[i]);
+            hashes[ahead] = hash_path(paths[i], lens[ahead]);
+            if (tar->slots != NULL)
+                __builtin_prefetch(&tar->slots[hashes[ahead] & tar->slot_mask]);
+        }
+    }
+    return found;
+}
+
+int tar_check_archive(const tar_archive_t *tar)
+{
+    return tar->check_result;
+}
+
+#ifdef TAR_STATS
+stats_t *archive_stats(const tar_archive_t *tar)
+{
+    return tar->stats;
+}
+#endif
+
+/**
+ * find_entry() for the tar_exists() family, timed as a check
+ */
+static const tar_entry_t *check_entry(const tar_archive_t *tar, const char *path)
+{
+    STATS_START(start);
+    const tar_entry_t *entry = find_entry(tar, path);
+    STATS_OP(tar, TAR_STATS_CHECK, start);
+    return entry;
+}
+
+int tar_exists(const tar_archive_t *tar, const char *path)
+{
+    return check_entry(tar, path) != NULL;
+}
+
+int tar_is_dir(const tar_archive_t *tar, const char *path)
+{
+    const tar_entry_t *entry = check_entry(tar, path);
+    return entry != NULL && entry->typeflag == DIRTYPE;
+}
+
+int tar_is_file(const tar_archive_t *tar, const char *path)
+{
+    const tar_entry_t *entry = check_entry(tar, path);
+    return entry != NULL && is_file_type(entry->typeflag);
+}
+
+int tar_is_symlink(const tar_archive_t *tar, const char *path)
+{
+    const tar_entry_t *entry = check_entry(tar, path);
+    return entry != NULL && entry->typeflag == SYMTYPE;
+}
+
+static int list_entries(const tar_archive_t *tar, const char *path, char **entries, size_t *no_entries)
+{
+    size_t len = strlen(path);
+    const tar_entry_t *dir = find_entry(tar, path);
+    if (dir != NULL && dir->typeflag == SYMTYPE)
+        dir = follow_link(tar, NULL, dir, 0);
+    else if (len == 0 || path[len - 1] != '/')
+        return 0;
+    else if (dir == NULL)
+        dir = lookup_path(tar, NULL, path, len, 0); // below a symlink to a directory
+
+    if (dir == NULL || dir->typeflag != DIRTYPE)
+        return 0;
+
+    size_t entry = 0;
+    for (; entry < dir->child_count && entry < *no_entries; entry++)
+        strcpy(entries[entry], entry_name(tar, &tar->entries[tar->children[dir->child_start + entry]]));
+    *no_entries = entry;
+    return 1;
+}
+
+int tar_list(const tar_archive_t *tar, const char *path, char **entries, size_t *no_entries)
+{
+    STATS_START(start);
+    int ret = list_entries(tar, path, entries, no_entries);
+    STATS_OP(tar, TAR_STATS_LIST, start);
+    return ret;
+}
+
+/**
+ * Matches `c` against the set of a glob pattern, `*pattern` pointing right after its '['
+ * and being moved past its ']'
+ * @return whether `c` is in the set, or -1 if the set is not closed, the '[' then being a literal
+ */
+static int match_set(const char **pattern, const char *pattern_end, char c)
+{
+    const char *p = *pattern;
+    int negate = p < pattern_end && (*p == '!' || *p == '^');
+    if (negate)
+        p++;
+    int found = 0;
+    for (const char *first = p; p < pattern_end && (*p != ']' || p == first); p++)
+    {
+        if (*p == '\\' && p + 1 < pattern_end)
+            p++;
+        unsigned char low = *p;
+        unsigned char high = low;
+        if (p + 2 < pattern_end && p[1] == '-' && p[2] != ']')
+        {
+            p += p[2] == '\\' && p + 3 < pattern_end ? 3 : 2;
+            high = *p;
+        }
+        if ((unsigned char)c >= low && (unsigned char)c <= high)
+            found = 1;
+    }
+    if (p == pattern_end)
+        return -1;
+    *pattern = p + 1;
+    return found != negate;
+}
+
+/**
+ * @return whether the pattern between `pattern` and `pattern_end` has no wildcard nor escape
+ */
+static int is_literal(const char *pattern, const char *pattern_end)
+{
+    for (; pattern < pattern_end; pattern++)
+    {
+        if (*pattern == '*' || *pattern == '?' || *pattern == '[' || *pattern == '\\')
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Matches a path against a glob pattern, as described for tar_glob(), both given by their bounds
+ */
+static int glob_match(const char *pattern, const char *pattern_end, const char *path, const char *path_end)
+{
+    while (pattern < pattern_end)
+    {
+        if (*pattern == '*' && pattern + 1 < pattern_end && pattern[1] == '*')
+        {
+            while (pattern < pattern_end && *pattern == '*')
+                pattern++;
+            if (pattern < pattern_end && *pattern == '/')
+            {
+                // any number of leading directories, none included
+                for (const char *dir = path; dir != NULL; dir = memchr(dir, '/', path_end - dir))
+                {
+                    dir += dir < path_end && *dir == '/';
+                    if (glob_match(pattern + 1, pattern_end, dir, path_end))
+                        return 1;
+                }
+                return 0;
+            }
+            // a literal rest, as the extension of "**.json", can only match the end of the path
+            size_t rest_len = pattern_end - pattern;
+            if (is_literal(pattern, pattern_end))
+                return (size_t)(path_end - path) >= rest_len && memcmp(path_end - rest_len, pattern, rest_len) == 0;
+            for (const char *rest = path;; rest++)
+            {
+                if (glob_match(pattern, pattern_end, rest, path_end))
+                    return 1;
+                if (rest == path_end)
+                    return 0;
+            }
+        }
+        if (*pattern == '*')
+        {
+            size_t rest_len = pattern_end - pattern - 1;
+            if (is_literal(pattern + 1, pattern_end))
+                return (size_t)(path_end - path) >= rest_len &&
+                       memchr(path, '/', path_end - rest_len - path) == NULL &&
+                       memcmp(path_end - rest_len, pattern + 1, rest_len) == 0;
+            for (const char *rest = path;; rest++)
+            {
+                if (glob_match(pattern + 1, pattern_end, rest, path_end))
+                    return 1;
+                if (rest == path_end || *rest == '/')
+                    return 0;
+            }
+        }
+
+        if (path == path_end)
+            return 0;
+        if (*pattern == '?' && *path != '/')
+        {
+            pattern++;
+            path++;
+            continue;
+        }
+        if (*pattern == '[')
+        {
+            const char *set_end = pattern + 1;
+            int in = match_set(&set_end, pattern_end, *path);
+            if (in == 0 || (in == 1 && *path == '/'))
+                return 0;
+            if (in == 1)
+            {
+                pattern = set_end;
+                path++;
+                continue;
+            }
+        }
+        if (*pattern == '\\' && pattern + 1 < pattern_end)
+            pattern++;
+        if (*pattern != *path)
+            return 0;
+        pattern++;
+        path++;
+    }
+    return path == path_end;
+}
+
+static int glob_paths(const tar_archive_t *tar, const char *pattern, size_t *cursor, const char **paths,
+                      size_t *no_paths)
+{
+    // directories are matched without their trailing '/', which a pattern may end with to only match them
+    size_t pattern_len = strlen(pattern);
+    int only_dirs = pattern_len > 1 && pattern[pattern_len - 1] == '/';
+    pattern_len -= only_dirs;
+    const char *pattern_end = pattern + pattern_len;
+
+    // the paths starting with the part of the pattern before its first wildcard are contiguous
+    size_t prefix_len = strcspn(pattern, "*?[\\");
+    if (prefix_len > pattern_len)
+        prefix_len = pattern_len;
+    size_t low = 0;
+    size_t high = tar->no_sorted;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (strncmp(entry_name(tar, &tar->entries[tar->sorted[mid]]), pattern, prefix_len) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    size_t found = 0;
+    for (size_t i = low > *cursor ? low : *cursor; i < tar->no_sorted; i++)
+    {
+        const tar_entry_t *entry = &tar->entries[tar->sorted[i]];
+        const char *name = entry_name(tar, entry);
+        if (strncmp(name, pattern, prefix_len) != 0)
+            break;
+        int dir = entry->name_len > 1 && name[entry->name_len - 1] == '/';
+        size_t name_len = entry->name_len - dir;
+        if ((only_dirs && !dir) || name_len < prefix_len ||
+            !glob_match(pattern + prefix_len, pattern_end, name + prefix_len, name + name_len))
+            continue;
+        if (found == *no_paths)
+        {
+            *cursor = i; // the next page starts at the next match
+            return 1;
+        }
+        paths[found++] = name;
+    }
+    *cursor = tar->no_sorted;
+    *no_paths = found;
+    return 0;
+}
+
+int tar_glob(const tar_archive_t *tar, const char *pattern, size_t *cursor, const char **paths, size_t *no_paths)
+{
+    STATS_START(start);
+    int ret = glob_paths(tar, pattern, cursor, paths, no_paths);
+    STATS_OP(tar, TAR_STATS_LIST, start);
+    return ret;
+}
+
+/**
+ * Finds the regular file at `path`, following symlinks and hard links
+ * @return the file entry, or NULL if there is none
+ */
+static const tar_entry_t *resolve_file(const tar_archive_t *tar, const char *path)
+{
+    const tar_entry_t *entry = find_entry(tar, path);
+    if (entry != NULL)
+        entry = follow_link(tar, NULL, entry, 0);
+    else
+        entry = lookup_path(tar, NULL, path, strlen(path), 0); // below a symlink to a directory
+    if (entry == NULL || !is_file_type(entry->typeflag))
+        return NULL;
+    return entry;
+}
+
+int archive_locate_file(const tar_archive_t *tar, const char *path, uint64_t *offset, uint64_t *size)
+{
+    const tar_entry_t *entry = resolve_file(tar, path);
+    if (entry == NULL)
+        return -1;
+    *offset = entry->header_off + BLK_SIZE;
+    *size = entry->size;
+    return 0;
+}
+
+int archive_fd(const tar_archive_t *tar)
+{
+    return tar->backend.fd;
+}
+
+/* Appends decompressed bytes to the buffer `*arg` points to, for gz_copy() */
+static int copy_to_buffer(void *arg, const uint8_t *data, size_t len)
+{
+    uint8_t **cursor = arg;
+    memcpy(*cursor, data, len);
+    *cursor += len;
+    return 0;
+}
+
+int archive_read(const tar_archive_t *tar, uint64_t offset, void *dest, size_t len)
+{
+    if (tar->gz != NULL)
+    {
+        uint8_t *cursor = dest;
+        ssize_t copied = gz_copy(tar->gz, tar->backend.data, tar->backend.size, offset, len, copy_to_buffer, &cursor);
+        return copied == (ssize_t)len ? 0 : -1;
+    }
+    return tar->backend.ops->read(&tar->backend, offset, dest, len);
+}
+
+int archive_is_compressed(const tar_archive_t *tar)
+{
+    return tar->gz != NULL;
+}
+
+/**
+ * Clamps a read of `*len` bytes from `offset` in a file to the end of the file
+ * @return the bytes of the file left after the read, or -2 if the offset is outside the file
+ */
+static ssize_t clamp_read(const tar_entry_t *entry, size_t offset, size_t *len)
+{
+    if (offset > entry->size)
+    {
+        *len = 0;
+        return -2;
+    }
+    size_t available = entry->size - offset;
+    if (*len > available)
+        *len = available;
+    return available - *len;
+}
+
+ssize_t tar_read_view(const tar_archive_t *tar, const char *path, size_t offset, const uint8_t **data, size_t *len)
+{
+    const tar_entry_t *entry = resolve_file(tar, path);
+    if (entry == NULL)
+        return -1;
+    if (tar->gz != NULL || tar->backend.data == NULL)
+        return -3;
+    ssize_t ret = clamp_read(entry, offset, len);
+    if (ret >= 0)
+    {
+        *data = entry_data(tar, entry) + offset;
+        if (*len >= READ_WILLNEED_MIN)
+            tar->backend.ops->advise(&tar->backend, *data - tar->backend.data, *len, MADV_WILLNEED);
+    }
+    return ret;
+}
+
+ssize_t tar_read_file(const tar_archive_t *tar, const char *path, size_t offset, uint8_t *dest, size_t *len)
+{
+    STATS_START(start);
+    const tar_entry_t *entry = resolve_file(tar, path);
+    ssize_t ret = entry != NULL ? clamp_read(entry, offset, len) : -1;
+    uint64_t data_off = entry != NULL ? entry->header_off + BLK_SIZE : 0;
+    int failed = 0;
+    if (ret >= 0 && tar->cache != NULL)
+        failed = cache_read(tar->cache, tar, entry - tar->entries, data_off, entry->size, offset, dest, *len);
+    else if (ret >= 0)
+        failed = archive_read(tar, data_off + offset, dest, *len);
+    if (failed)
+    {
+        *len = 0;
+        ret = -1; // the compressed data is corrupted past the index
+    }
+    if (ret >= 0)
+        STATS_ADD(tar, STAT_BYTES_COPIED, *len);
+    STATS_OP(tar, TAR_STATS_READ, start);
+    return ret;
+}
+
+static int compare_ranges(const void *a, const void *b, void *arg)
+{
+    const tar_range_t *ranges = arg;
+    size_t x = ranges[*(const size_t *)a].offset;
+    size_t y = ranges[*(const size_t *)b].offset;
+    return x < y ? -1 : x > y;
+}
 
 /**
- * Computes checksum for a given header
- * @param header pointer to the header to compute checksum for
- * @return computed checksum
- *
+ * Reads ranges of the payload found at `data_off` with few vectored reads: ranges following each other
+ * in the file less than RANGES_GAP_MAX bytes apart are read at once, the bytes between them into a scratch buffer
+ * @return zero on success, -1 if the archive could not be read
  */
-int checksum(tar_header_t *header)
+static int read_ranges_vectored(const tar_archive_t *tar, uint64_t data_off, tar_range_t *ranges, size_t count)
 {
-    int sum = 0;
-    for (int i = 0; i < 512; i++)
+    size_t *order = malloc(count * sizeof(size_t));
+    if (order == NULL)
+        return -1;
+    for (size_t i = 0; i < count; i++)
+        order[i] = i;
+    qsort_r(order, count, sizeof(size_t), compare_ranges, ranges);
+
+    uint8_t gap[RANGES_GAP_MAX]; // only written to, gaps of a read may share it
+    struct iovec iov[RANGES_IOV_MAX];
+    int ret = 0;
+    for (size_t i = 0; i < count && ret == 0;)
     {
-        if (i >= 148 && i < 156)
-            continue;
-        sum += header->name[i];
+        uint64_t start = 0;
+        uint64_t end = 0;
+        int no_iov = 0;
+        for (; i < count && no_iov + 2 <= RANGES_IOV_MAX; i++)
+        {
+            tar_range_t *range = &ranges[order[i]];
+            if (range->len == 0)
+                continue;
+            if (no_iov == 0)
+                start = end = range->offset;
+            else if (range->offset < end || range->offset - end > RANGES_GAP_MAX)
+                break; // overlapping ranges would need the same bytes twice, far ones would read too much
+            if (range->offset > end)
+                iov[no_iov++] = (struct iovec){gap, range->offset - end};
+            iov[no_iov++] = (struct iovec){range->dest, range->len};
+            end = range->offset + range->len;
+        }
+        if (no_iov > 0)
+            ret = tar->backend.ops->readv(&tar->backend, data_off + start, iov, no_iov);
     }
-    sum += 256; // checksum initally 8 bytes of spaces (32 in ascii)
-    return sum;
+    free(order);
+    return ret;
 }
 
-int validate_header(tar_header_t *header)
+int tar_read_file_ranges(const tar_archive_t *tar, const char *path, tar_range_t *ranges, size_t count)
 {
-    if (strlen(header->magic) + 1 != TMAGLEN || strncmp(header->magic, TMAGIC, strlen(header->magic)) != 0)
+    STATS_START(start);
+    const tar_entry_t *entry = resolve_file(tar, path);
+    if (entry == NULL)
     {
+        STATS_OP(tar, TAR_STATS_READ, start);
         return -1;
     }
-    char version[2];
-    version[0] = header->version[0];
-    version[1] = header->version[1];
-    if (strncmp(version, TVERSION, 2) != 0)
+    int ret = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        return -2;
+        if (clamp_read(entry, ranges[i].offset, &ranges[i].len) < 0)
+            ret = -2;
+    }
+
+    uint64_t data_off = entry->header_off + BLK_SIZE;
+    int failed = 0;
+    if (tar->cache == NULL && tar->gz == NULL && tar->backend.data == NULL)
+    {
+        failed = read_ranges_vectored(tar, data_off, ranges, count);
     }
-    if (TAR_INT(header->chksum) != checksum(header))
+    else
     {
-        return -3;
+        for (size_t i = 0; i < count && !failed; i++)
+        {
+            if (ranges[i].len == 0)
+                continue; // possibly past the end of the archive
+            if (tar->cache != NULL)
+                failed = cache_read(tar->cache, tar, entry - tar->entries, data_off, entry->size, ranges[i].offset,
+                                    ranges[i].dest, ranges[i].len);
+            else
+                failed = archive_read(tar, data_off + ranges[i].offset, ranges[i].dest, ranges[i].len);
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (failed)
+            ranges[i].len = 0;
+        STATS_ADD(tar, STAT_BYTES_COPIED, ranges[i].len);
     }
+    STATS_OP(tar, TAR_STATS_READ, start);
+    return failed ? -3 : ret;
+}
+
+/* Regular files written by the workers of tar_extract_all() */
+typedef struct extract_job
+{
+    const tar_archive_t *tar;
+    int dir_fd;
+    const uint32_t *files; /* indexes of the entries to write */
+    size_t no_files;
+    size_t next;           /* first file not claimed by a worker yet */
+    size_t extracted;
+    int failed;
+} extract_job_t;
+
+/**
+ * Finds the header of an entry of the archive, reading it into `copy` for archives not mapped whole
+ * @return the header, or NULL if it could not be decompressed
+ */
+static const tar_header_t *entry_header(const tar_archive_t *tar, const tar_entry_t *entry, tar_header_t *copy)
+{
+    if (tar->gz == NULL && tar->backend.data != NULL)
+        return (const tar_header_t *)(tar->backend.data + entry->header_off);
+    return archive_read(tar, entry->header_off, copy, sizeof(tar_header_t)) == 0 ? copy : NULL;
+}
+
+/* Writes decompressed bytes to the file descriptor `*arg` points to, for gz_copy() */
+static int write_to_fd(void *arg, const uint8_t *data, size_t len)
+{
+    return write_all(*(int *)arg, data, len);
+}
 
+/**
+ * Writes the file entry at `index` below the destination directory of `job`
+ * @return zero on success, -1 otherwise
+ */
+static int extract_file(extract_job_t *job, uint32_t index)
+{
+    const tar_archive_t *tar = job->tar;
+    const tar_entry_t *entry = &tar->entries[index];
+    tar_header_t copy;
+    const tar_header_t *header = entry_header(tar, entry, &copy);
+    const char *path = extract_relative_path(entry_name(tar, entry));
+    int fd = header == NULL ? -1 : extract_open_file(job->dir_fd, path, TAR_INT(header->mode));
+    if (fd == -1)
+        return -1;
+    int err;
+    if (tar->gz != NULL)
+        err = gz_copy(tar->gz, tar->backend.data, tar->backend.size, entry->header_off + BLK_SIZE, entry->size, write_to_fd, &fd)
+              != (ssize_t)entry->size;
+    else
+        err = extract_payload(fd, tar->backend.fd, entry->header_off + BLK_SIZE, entry_data(tar, entry), entry->size);
+    if (close(fd) != 0 || err != 0)
+        return -1;
+    extract_mtime(job->dir_fd, path, TAR_INT(header->mtime));
     return 0;
 }
 
+static void *extract_worker(void *arg)
+{
+    extract_job_t *job = arg;
+    size_t extracted = 0;
+    while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+    {
+        size_t start = __atomic_fetch_add(&job->next, EXTRACT_CHUNK_FILES, __ATOMIC_RELAXED);
+        if (start >= job->no_files)
+            break;
+        size_t end = start + EXTRACT_CHUNK_FILES < job->no_files ? start + EXTRACT_CHUNK_FILES : job->no_files;
+        for (size_t i = start; i < end; i++)
+        {
+            if (extract_file(job, job->files[i]) != 0)
+            {
+                __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            extracted++;
+        }
+    }
+    __atomic_fetch_add(&job->extracted, extracted, __ATOMIC_RELAXED);
+    return NULL;
+}
+
 /**
- * Checks whether the archive is valid.
- *
- * Each non-null header of a valid archive has:
- *  - a magic value of "ustar" and a null,
- *  - a version value of "00" and no null,
- *  - a correct checksum
- *
- * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * Tells whether the entry at `index` is the one extracted for its path, that is the last one of the archive,
+ * and has a path that can be extracted
  *
- * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
- *         -1 if the archive contains a header with an invalid magic value,
- *         -2 if the archive contains a header with an invalid version value,
- *         -3 if the archive contains a header with an invalid checksum value
+ * @param last The index of the last entry of every path, at the index of the first one.
  */
-int check_archive(int tar_fd)
+static int is_extracted(const tar_archive_t *tar, const uint32_t *last, uint32_t index)
 {
-    struct stat statbuf;
-    if (fstat(tar_fd, &statbuf) == -1)
+    const tar_entry_t *entry = &tar->entries[index];
+    return entry->header_off != NO_HEADER && last[find_slot_entry(tar, entry) - tar->entries] == index
+           && extract_relative_path(entry_name(tar, entry)) != NULL;
+}
+
+int tar_extract_all(const tar_archive_t *tar, const char *dest_dir, int nthreads)
+{
+    if (mkdir(dest_dir, 0777) == -1 && errno != EEXIST)
+        return -4;
+    int dir_fd = open(dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+        return -4;
+    uint32_t *last = malloc((tar->no_entries + 1) * sizeof(uint32_t));
+    uint32_t *files = malloc((tar->no_entries + 1) * sizeof(uint32_t));
+    if (last == NULL || files == NULL)
     {
-        close(tar_fd);
-        return -1;
+        free(last);
+        free(files);
+        close(dir_fd);
+        return -4;
     }
-    if (statbuf.st_size <= 0)
+    for (uint32_t i = 0; i < tar->no_entries; i++)
+        last[find_slot_entry(tar, &tar->entries[i]) - tar->entries] = i;
+
+    // directories first, so that the workers only create files
+    extract_job_t job = {.tar = tar, .dir_fd = dir_fd, .files = files};
+    size_t extracted = 0;
+    int failed = 0;
+    for (uint32_t i = 0; i < tar->no_entries && !failed; i++)
     {
-        close(tar_fd);
-        return 0;
+        const tar_entry_t *entry = &tar->entries[i];
+        if (!is_extracted(tar, last, i))
+            continue;
+        if (is_file_type(entry->typeflag))
+        {
+            files[job.no_files++] = i;
+        }
+        else if (entry->typeflag == DIRTYPE)
+        {
+            tar_header_t copy;
+            const tar_header_t *header = entry_header(tar, entry, &copy);
+            failed = header == NULL ||
+                     extract_directory(dir_fd, extract_relative_path(entry_name(tar, entry)), TAR_INT(header->mode)) != 0;
+            extracted++;
+        }
     }
-    tar_header_t *fileptr = (tar_header_t *)mmap(NULL, statbuf.st_atime, PROT_READ, MAP_SHARED, tar_fd, 0);
-    int header_amount = 0;
-    int i = 0;
-    while (i < statbuf.st_size / sizeof(tar_header_t))
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > (int)(job.no_files / EXTRACT_CHUNK_FILES) + 1)
+        nthreads = job.no_files / EXTRACT_CHUNK_FILES + 1;
+    if (nthreads < 1)
+        nthreads = 1;
+    pthread_t threads[nthreads];
+    int spawned = 1;
+    for (; !failed && spawned < nthreads; spawned++)
     {
-        tar_header_t header = fileptr[i];
-        if (strlen(header.name) == 0)
-        {
-            i++;
+        if (pthread_create(&threads[spawned], NULL, extract_worker, &job) != 0)
+            break;
+    }
+    if (!failed)
+        extract_worker(&job);
+    for (int t = 1; t < spawned; t++)
+        pthread_join(threads[t], NULL);
+    failed |= job.failed;
+    extracted += job.extracted;
+
+    // links last, as hard links need their target and symlinks could be followed by the files created above
+    for (uint32_t i = 0; i < tar->no_entries && !failed; i++)
+    {
+        const tar_entry_t *entry = &tar->entries[i];
+        if (!is_link_type(entry->typeflag) || !is_extracted(tar, last, i))
             continue;
-        }
-        int ret = validate_header(&header);
+        tar_header_t copy;
+        const tar_header_t *header = entry_header(tar, entry, &copy);
+        const char *path = extract_relative_path(entry_name(tar, entry));
+        if (header == NULL)
+            failed = 1;
+        else if (entry->typeflag == SYMTYPE)
+            failed = extract_symlink(dir_fd, path, entry_link(tar, entry)) != 0;
+        else
+            failed = extract_hardlink(dir_fd, path, entry_link(tar, entry)) != 0;
+        if (!failed)
+            extract_mtime(dir_fd, path, TAR_INT(header->mtime));
+        extracted++;
+    }
+
+    // directories were created writable and their children changed their times, fix both once all is written
+    for (uint32_t i = 0; i < tar->no_entries && !failed; i++)
+    {
+        const tar_entry_t *entry = &tar->entries[i];
+        if (entry->typeflag != DIRTYPE || !is_extracted(tar, last, i))
+            continue;
+        tar_header_t copy;
+        const tar_header_t *header = entry_header(tar, entry, &copy);
+        if (header != NULL)
+                extract_finish_directory(dir_fd, extract_relative_path(entry_name(tar, entry)), TAR_INT(header->mode),
+                                     TAR_INT(header->mtime));
+    }
 
+    free(last);
+    free(files);
+    close(dir_fd);
+    if (failed)
+        return -4;
+    return tar->check_result < 0 ? tar->check_result : (int)extracted;
+}
+
+/* A slice of the headers validated by one worker of tar_check_archive_parallel() */
+typedef struct check_job
+{
+    const uint8_t *map;
+    const uint64_t *offsets;
+    size_t start;
+    size_t end;
+    size_t *first_error; /* lowest index of an invalid header found so far, shared by all workers */
+    int error;           /* code of the first invalid header of the slice */
+    size_t error_index;
+} check_job_t;
+
+static void *check_worker(void *arg)
+{
+    check_job_t *job = arg;
+    for (size_t i = job->start; i < job->end; i++)
+    {
+        // an earlier slice already failed, nothing found past it can be reported
+        if (__atomic_load_n(job->first_error, __ATOMIC_RELAXED) < i)
+            break;
+        int ret = validate_header((tar_header_t *)(job->map + job->offsets[i]));
         if (ret != 0)
         {
-            munmap(fileptr, statbuf.st_size);
-            return ret;
+            job->error = ret;
+            job->error_index = i;
+            size_t current = __atomic_load_n(job->first_error, __ATOMIC_RELAXED);
+            while (i < current && !__atomic_compare_exchange_n(job->first_error, &current, i, 0,
+                                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+            break;
         }
-        header_amount += 1;
-        i += 1 + ceil(TAR_INT(header.size) / (float)sizeof(tar_header_t));
     }
-
-    munmap(fileptr, statbuf.st_size);
-    return header_amount;
+    return NULL;
 }
 
-int array_contains(char *array, int len, char item)
+/**
+ * Chains the offsets of the headers of a mapped archive, reading only their name and size fields
+ *
+ * @param truncated Set when the payload of the last header runs past the end of the archive.
+ * @return the number of offsets stored in `*offsets`, or -1 if they could not be allocated
+ */
+static ssize_t chain_headers(const uint8_t *map, size_t map_size, uint64_t **offsets, int *truncated)
 {
-    if (len == 0)
-        return 1;
-    for (int i = 0; i < len; i++)
+    size_t blocks = map_size / sizeof(tar_header_t);
+    size_t count = 0, capacity = INDEX_INITIAL_CAPACITY;
+    header_ext_t ext = {0};
+    *offsets = malloc(capacity * sizeof(uint64_t));
+    *truncated = 0;
+    if (*offsets == NULL)
+        return -1;
+
+    size_t i = 0;
+    while (i < blocks)
     {
-        if (array[i] == item)
-            return 1;
+        tar_header_t *header = (tar_header_t *)(map + i * sizeof(tar_header_t));
+        if (header->name[0] == '\0')
+        {
+            i++;
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity *= 2;
+            uint64_t *grown = realloc(*offsets, capacity * sizeof(uint64_t));
+            if (grown == NULL)
+            {
+                free(*offsets);
+                return -1;
+            }
+            *offsets = grown;
+        }
+        (*offsets)[count++] = i * sizeof(tar_header_t);
+        uint64_t size = member_size(header, &ext);
+        if (size > map_size - i * sizeof(tar_header_t) - BLK_SIZE)
+        {
+            *truncated = 1;
+            break;
+        }
+        if (header->typeflag == XHDTYPE)
+            parse_pax_records((const char *)(header + 1), size, &ext); // may carry the size of the next member
+        else
+            memset(&ext, 0, sizeof(ext));
+        i += 1 + payload_blocks(size);
     }
-    return 0;
+    return count;
 }
 
-int check_entry(int tar_fd, char *path, char *flags, int flags_len, tar_header_t* found_header)
+int tar_check_archive_parallel(int tar_fd, int nthreads)
 {
     struct stat statbuf;
     if (fstat(tar_fd, &statbuf) == -1)
+        return -1;
+    if (!S_ISREG(statbuf.st_mode))
+        return tar_stream_check(tar_fd);
+    if (statbuf.st_size == 0)
+        return 0;
+    uint8_t *map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, tar_fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    map_advise(map, statbuf.st_size, 0, statbuf.st_size, MADV_SEQUENTIAL);
+    if (is_gzip(map, statbuf.st_size))
+    {
+        // compressed headers can only be reached by inflating the archive, which indexing does anyway
+        munmap(map, statbuf.st_size);
+        tar_archive_t *tar = tar_open(tar_fd);
+        int ret = tar != NULL ? tar_check_archive(tar) : -1;
+        tar_close(tar);
+        return ret;
+    }
+
+    uint64_t *offsets;
+    int truncated;
+    ssize_t count = chain_headers(map, statbuf.st_size, &offsets, &truncated);
+    if (count < 0)
     {
-        close(tar_fd);
+        munmap(map, statbuf.st_size);
         return -1;
     }
-    if (statbuf.st_size <= 0)
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < PARALLEL_CHECK_MIN_HEADERS || nthreads < 1)
+        nthreads = 1;
+    if (nthreads > count / (PARALLEL_CHECK_MIN_HEADERS / 4) + 1)
+        nthreads = count / (PARALLEL_CHECK_MIN_HEADERS / 4) + 1;
+
+    size_t first_error = SIZE_MAX;
+    check_job_t jobs[nthreads];
+    pthread_t threads[nthreads];
+    for (int t = 0; t < nthreads; t++)
+    {
+        jobs[t] = (check_job_t){
+            .map = map,
+            .offsets = offsets,
+            .start = count * t / nthreads,
+            .end = count * (t + 1) / nthreads,
+            .first_error = &first_error,
+        };
+    }
+    int spawned = 1;
+    for (; spawned < nthreads; spawned++)
     {
-        close(tar_fd);
-        return 0;
+        if (pthread_create(&threads[spawned], NULL, check_worker, &jobs[spawned]) != 0)
+            break;
     }
-    tar_header_t *fileptr = (tar_header_t *)mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, tar_fd, 0);
+    for (int t = spawned; t < nthreads; t++)
+        check_worker(&jobs[t]); // thread creation failed, validate the rest here
+    check_worker(&jobs[0]);
+    for (int t = 1; t < spawned; t++)
+        pthread_join(threads[t], NULL);
 
-    int i = 0;
-    while (i < statbuf.st_size / sizeof(tar_header_t))
+    int ret = count - truncated;
+    size_t error_index = SIZE_MAX;
+    for (int t = 0; t < nthreads; t++)
     {
-        tar_header_t header = fileptr[i];
-        if (strlen(header.name) == 0)
+        if (jobs[t].error != 0 && jobs[t].error_index < error_index)
         {
-            i++;
-            continue;
-        }
-        int ret = validate_header(&header);
-        if (ret != 0)
-        {
-            i++;
-            continue;
-        }
-        if (strncmp(header.name, path, fmax(strlen(header.name), strlen(path))) == 0 && array_contains(flags, flags_len, header.typeflag))
-        {
-            if(found_header != NULL)
-                *found_header = header;
-            munmap(fileptr, statbuf.st_size);
-            return 1;
+            error_index = jobs[t].error_index;
+            ret = jobs[t].error;
         }
-
-        i += 1 + ceil(TAR_INT(header.size) / (float)sizeof(tar_header_t));
     }
 
-    munmap(fileptr, statbuf.st_size);
+    free(offsets);
+    munmap(map, statbuf.st_size);
+    return ret;
+}
 
-    return 0;
+/**
+ * Checks whether the archive is valid.
+ *
+ * Each non-null header of a valid archive has:
+ *  - a magic value of "ustar" and a null,
+ *  - a version value of "00" and no null,
+ *  - a correct checksum
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ *
+ * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
+ *         -1 if the archive contains a header with an invalid magic value,
+ *         -2 if the archive contains a header with an invalid version value,
+ *         -3 if the archive contains a header with an invalid checksum value
+ */
+int check_archive(int tar_fd)
+{
+    return tar_check_archive_parallel(tar_fd, 1);
 }
 
 /**
@@ -169,7 +2711,12 @@ int check_entry(int tar_fd, char *path, char *flags, int flags_len, tar_header_t
  */
 int exists(int tar_fd, char *path)
 {
-    return check_entry(tar_fd, path, NULL, 0, NULL);
+    tar_archive_t *tar = tar_open(tar_fd);
+    if (tar == NULL)
+        return 0;
+    int ret = tar_exists(tar, path);
+    tar_close(tar);
+    return ret;
 }
 
 /**
@@ -183,8 +2730,12 @@ int exists(int tar_fd, char *path)
  */
 int is_dir(int tar_fd, char *path)
 {
-    char flags[] = {DIRTYPE};
-    return check_entry(tar_fd, path, flags, 1, NULL);
+    tar_archive_t *tar = tar_open(tar_fd);
+    if (tar == NULL)
+        return 0;
+    int ret = tar_is_dir(tar, path);
+    tar_close(tar);
+    return ret;
 }
 
 /**
@@ -198,8 +2749,12 @@ int is_dir(int tar_fd, char *path)
  */
 int is_file(int tar_fd, char *path)
 {
-    char flags[] = {REGTYPE, AREGTYPE};
-    return check_entry(tar_fd, path, flags, 2, NULL);
+    tar_archive_t *tar = tar_open(tar_fd);
+    if (tar == NULL)
+        return 0;
+    int ret = tar_is_file(tar, path);
+    tar_close(tar);
+    return ret;
 }
 
 /**
@@ -212,26 +2767,12 @@ int is_file(int tar_fd, char *path)
  */
 int is_symlink(int tar_fd, char *path)
 {
-    char flags[] = {SYMTYPE};
-    return check_entry(tar_fd, path, flags, 1, NULL);
-}
-
-int count_backslash(char *str)
-{
-    int count = 0;
-    for (int i = 0; i < strlen(str); i++)
-    {
-        if (str[i] == '/')
-        {
-            count++;
-        }
-    }
-    return count;
-}
-
-int get_symlink(int tar_fd, char *path, tar_header_t* found_header) {
-    char flags[] = {SYMTYPE};
-    return check_entry(tar_fd, path, flags, 1, found_header);
+    tar_archive_t *tar = tar_open(tar_fd);
+    if (tar == NULL)
+        return 0;
+    int ret = tar_is_symlink(tar, path);
+    tar_close(tar);
+    return ret;
 }
 
 /**
@@ -258,62 +2799,12 @@ int get_symlink(int tar_fd, char *path, tar_header_t* found_header) {
  */
 int list(int tar_fd, char *path, char **entries, size_t *no_entries)
 {
-    tar_header_t* symheader = (tar_header_t*)malloc(sizeof(tar_header_t));
-    if(get_symlink(tar_fd, path, symheader)) {
-        char name[100];
-        strcpy(name, symheader->linkname);
-        strcat(name, "/");
-        free(symheader);
-        return list(tar_fd, name, entries, no_entries);
-    }
-
-    if (is_dir(tar_fd, path) == 0 || path[strlen(path) - 1] != '/')
-        return 0;
-
-    struct stat statbuf;
-    if (fstat(tar_fd, &statbuf) == -1)
-    {
-        close(tar_fd);
-        return -1;
-    }
-    if (statbuf.st_size <= 0)
-    {
-        close(tar_fd);
+    tar_archive_t *tar = tar_open(tar_fd);
+    if (tar == NULL)
         return 0;
-    }
-    tar_header_t *fileptr = (tar_header_t *)mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, tar_fd, 0);
-
-    int i = 0;
-    int entry = 0;
-    while (i < statbuf.st_size / sizeof(tar_header_t))
-    {
-        if (entry >= *no_entries)
-        {
-            break;
-        }
-        tar_header_t header = fileptr[i];
-        if (strlen(header.name) == 0)
-        {
-            i++;
-            continue;
-        }
-        int ret = validate_header(&header);
-        if (ret != 0)
-        {
-            i++;
-            continue;
-        }
-        int backslash_amount = count_backslash(header.name);
-        if (strncmp(header.name, path, strlen(path)) == 0 && strlen(header.name) != strlen(path) && backslash_amount <= 2 && (backslash_amount == 1 || header.name[strlen(header.name) - 1] == '/'))
-        {
-            strcpy(entries[entry++], header.name);
-        }
-
-        i += 1 + ceil(TAR_INT(header.size) / (float)sizeof(tar_header_t));
-    }
-    *no_entries = entry;
-    munmap(fileptr, statbuf.st_size);
-    return 1;
+    int ret = tar_list(tar, path, entries, no_entries);
+    tar_close(tar);
+    return ret;
 }
 
 /**
@@ -336,69 +2827,10 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries)
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len)
 {
-    if (is_file(tar_fd, path) == 0 && is_symlink(tar_fd, path) == 0)
-        return -1;
-    struct stat statbuf;
-    if (fstat(tar_fd, &statbuf) == -1)
-    {
-        close(tar_fd);
-        return -1;
-    }
-    if (statbuf.st_size <= 0)
-    {
-        close(tar_fd);
+    tar_archive_t *tar = tar_open(tar_fd);
+    if (tar == NULL)
         return -1;
-    }
-    tar_header_t *fileptr = (tar_header_t *)mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, tar_fd, 0);
-
-    int i = 0;
-
-    while (i < statbuf.st_size / sizeof(tar_header_t))
-    {
-        tar_header_t header = fileptr[i];
-        if (strlen(header.name) == 0)
-        {
-            i++;
-            continue;
-        }
-        int ret = validate_header(&header);
-        if (ret != 0)
-        {
-            i++;
-            continue;
-        }
-        if ((strncmp(header.name, path, fmax(strlen(header.name), strlen(path))) == 0))
-        {
-            if (header.typeflag == SYMTYPE)
-            {
-                munmap(fileptr, statbuf.st_size);
-                return read_file(tar_fd, header.linkname, offset, dest, len);
-            }
-
-            if (offset > TAR_INT(header.size) || offset > *len)
-            {
-                *len = 0;
-                return -2;
-            }
-            int remainder = 0;
-            if (*len < TAR_INT(header.size))
-            {
-                remainder = TAR_INT(header.size) - *len - offset;
-            }
-
-            char *src = ((char *)fileptr) + (i + 1) * 512 + offset;
-
-            *len = fmin(*len, TAR_INT(header.size) - offset);
-
-            memcpy(dest, src, *len);
-
-            munmap(fileptr, statbuf.st_size);
-            return remainder;
-        }
-
-        i += 1 + ceil(TAR_INT(header.size) / (float)sizeof(tar_header_t));
-    }
-
-    munmap(fileptr, statbuf.st_size);
-    return -1;
-}
\ No newline at end of file
+    ssize_t ret = tar_read_file(tar, path, offset, dest, len);
+    tar_close(tar);
+    return ret;
+}
@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/types.h>
 
 typedef struct posix_header
 {                              /* byte offset */
@@ -38,11 +39,119 @@ typedef struct posix_header
 #define LNKTYPE  '1'            /* link */
 #define SYMTYPE  '2'            /* reserved */
 #define DIRTYPE  '5'            /* directory */
+#define XHDTYPE  'x'            /* POSIX extended header for the next entry */
+#define XGLTYPE  'g'            /* POSIX global extended header */
+#define GNUTYPE_LONGLINK 'K'    /* GNU long link target of the next entry */
+#define GNUTYPE_LONGNAME 'L'    /* GNU long name of the next entry */
 
 #define BLK_SIZE 512     
 
-/* Converts an ASCII-encoded octal-based number into a regular integer */
-#define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
+/* Converts a numeric header field (an array, not a pointer) into a regular integer */
+#define TAR_INT(field) tar_parse_number(field, sizeof(field))
+
+/**
+ * Decodes a numeric header field.
+ *
+ * Fields are usually ASCII-encoded octal numbers, optionally preceded by spaces and terminated
+ * by a space or a null. GNU tar stores numbers that do not fit in octal, such as the size of
+ * members over 8 GiB, as big-endian binary with the high bit of the first byte set (base-256).
+ *
+ * @param field The field to decode.
+ * @param len The length of the field.
+ *
+ * @return the value of the field, zero for negative base-256 values.
+ */
+uint64_t tar_parse_number(const char *field, size_t len);
+
+/**
+ * An archive opened once and indexed in memory.
+ *
+ * The archive is mapped a single time by tar_open() and all of its headers are
+ * walked once to build an index of the entries. Every tar_*() query then runs
+ * against that index instead of rescanning the archive.
+ *
+ * A handle is never modified after tar_open() returns, so any number of threads may
+ * query the same handle at once without locking, as long as tar_close() is only called
+ * once all of them are done with it.
+ */
+typedef struct tar_archive tar_archive_t;
+
+/* Where the bytes of an archive are read from */
+typedef enum tar_backend
+{
+    TAR_BACKEND_MMAP,   /* the archive is mapped, whole or through the map window */
+    TAR_BACKEND_PREAD,  /* the archive is read with pread(2), for filesystems mmap(2) is slow on (FUSE, NFS) */
+    TAR_BACKEND_MEMORY  /* the archive is already in a buffer of the caller, the file descriptor being unused */
+} tar_backend_t;
+
+/* Options of tar_open_with(), zero-initialise the fields left to their default */
+typedef struct tar_options
+{
+    /*
+     * Backend the archive is read through, TAR_BACKEND_MMAP by default.
+     * Compressed archives are always mapped whole, or read from memory.
+     */
+    tar_backend_t backend;
+
+    /*
+     * Archive read by TAR_BACKEND_MEMORY, which must stay valid until the handle is closed.
+     * Sidecar and checkpoint files are not used for such archives, having no size and modification time to check.
+     */
+    const void *buffer;
+    size_t buffer_size;
+
+    /*
+     * Bytes read at once by TAR_BACKEND_PREAD while indexing, and asked from the kernel past the large reads
+     * of files, zero for 1 MiB.
+     */
+    size_t readahead;
+
+    /*
+     * Path of a sidecar index file, NULL to always index the archive in memory.
+     * When the file holds the index of the current version of the archive (same size and
+     * modification time), it is mapped and queried directly instead of walking the archive.
+     * Otherwise, the archive is indexed and the file is (re)written.
+     */
+    const char *index_path;
+
+    /*
+     * Path of the checkpoint file of a gzip-compressed archive, NULL to keep the checkpoints in memory only.
+     * Compressed archives are decompressed once when opened, recording the state of the decompression
+     * every `checkpoint_interval` bytes, so that files are then read by decompressing from the closest
+     * checkpoint. The file follows the same rules as the sidecar index, which is only used along with it.
+     */
+    const char *checkpoint_path;
+
+    /* Decompressed bytes between two checkpoints, zero for 1 MiB. Each checkpoint takes 32 KiB. */
+    uint64_t checkpoint_interval;
+
+    /*
+     * Largest part of the archive mapped at once by TAR_BACKEND_MMAP, zero to always map the archive whole.
+     * Larger archives are indexed through a mapping slid along their headers, then their files are read
+     * with pread(2), which bounds the address space and the memory the handle keeps resident.
+     * tar_read_view() is not available on such archives. Compressed archives are always mapped whole.
+     */
+    uint64_t map_window;
+
+    /* TAR_MAP_* flags for archives mapped whole */
+    int map_flags;
+
+    /*
+     * Memory kept for chunks of files read by tar_read_file(), zero for none. Only compressed archives and
+     * archives past the map window use it, the others being copied straight from their mapping.
+     * Reads of recently read chunks are then served from memory, the least recently used chunks being
+     * dropped so that the cache never takes more than this. Reads longer than a quarter of it bypass it.
+     */
+    uint64_t cache_size;
+
+    /* Size of the chunks of the cache, zero for 256 KiB, clamped between 64 KiB and 1 MiB */
+    size_t cache_chunk;
+} tar_options_t;
+
+/* Reads the whole archive in when it is opened, for hot archives queried right away */
+#define TAR_MAP_POPULATE 0x1
+/* Asks for transparent huge pages, which only kernels able to back file mappings with them honor */
+#define TAR_MAP_HUGEPAGES 0x2
 
 /**
  * Checks whether the archive is valid.
@@ -150,4 +259,511 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/**
+ * Opens and indexes an archive.
+ *
+ * The file descriptor stays owned by the caller and must remain open until tar_close().
+ * Gzip-compressed archives are decompressed transparently, see tar_options_t.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file.
+ *
+ * @return a handle on the archive, or NULL if the archive could not be mapped or indexed.
+ */
+tar_archive_t *tar_open(int tar_fd);
+
+/**
+ * Same as tar_open(), with options.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file, ignored with TAR_BACKEND_MEMORY.
+ * @param options Options of the handle, NULL for the defaults.
+ *
+ * @return a handle on the archive, or NULL if the archive could not be mapped or indexed.
+ */
+tar_archive_t *tar_open_with(int tar_fd, const tar_options_t *options);
+
+/**
+ * Indexes the members appended to an archive since it was opened or last refreshed, such as by `tar -r`.
+ *
+ * Appended members are looked for past the end of the last member indexed, even when they filled the padding
+ * of the last record without growing the file. Only the headers from there on are walked, the arrays derived
+ * from the whole index being then rebuilt in memory. As when extracting, an appended entry shadows the
+ * earlier entries with the same path. An index loaded from a sidecar file is copied to memory first, and the
+ * sidecar file is left as is, to be rebuilt when the archive is next opened.
+ *
+ * Unlike the queries, a refresh modifies the handle: no other thread may use it meanwhile, and the views,
+ * listed paths and glob matches obtained before are invalidated.
+ *
+ * @param tar A handle returned by tar_open().
+ *
+ * @return the number of entries appended to the index, zero if nothing was appended,
+ *         -1 if the archive is compressed, in memory, shrank or could not be indexed, the handle
+ *         only being fit for tar_close() when memory ran out midway.
+ */
+int tar_refresh(tar_archive_t *tar);
+
+/**
+ * Releases the mapping and the index of an archive opened with tar_open().
+ * Does not close the underlying file descriptor.
+ *
+ * @param tar A handle returned by tar_open(), may be NULL.
+ */
+void tar_close(tar_archive_t *tar);
+
+/**
+ * Same as check_archive(), using the result recorded while indexing the archive.
+ */
+int tar_check_archive(const tar_archive_t *tar);
+
+/**
+ * Same as check_archive(), validating the headers on several threads.
+ *
+ * A first sequential pass only chains the header offsets through their size fields, then the
+ * magic, version and checksum of the headers are validated in parallel. When several headers
+ * are invalid, the first one in archive order determines the result.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param nthreads Number of threads to validate with, zero or less to use every online CPU.
+ *
+ * @return the same values as check_archive().
+ */
+int tar_check_archive_parallel(int tar_fd, int nthreads);
+
+/**
+ * Same as exists(), on an indexed archive.
+ */
+int tar_exists(const tar_archive_t *tar, const char *path);
+
+/**
+ * Same as is_dir(), on an indexed archive.
+ */
+int tar_is_dir(const tar_archive_t *tar, const char *path);
+
+/**
+ * Same as is_file(), on an indexed archive.
+ */
+int tar_is_file(const tar_archive_t *tar, const char *path);
+
+/**
+ * Same as is_symlink(), on an indexed archive.
+ */
+int tar_is_symlink(const tar_archive_t *tar, const char *path);
+
+/* Result of the lookup of one path by tar_lookup_batch() */
+typedef struct tar_lookup
+{
+    int found;      /* zero if no entry at the path exists in the archive, the other fields are then zero too */
+    char typeflag;  /* type of the entry, as in its header */
+    uint64_t offset; /* offset of the payload of the entry in the archive, zero for implicit directories */
+    uint64_t size;   /* payload size in bytes */
+} tar_lookup_t;
+
+/**
+ * Looks many paths up at once.
+ *
+ * Each path costs a single probe of the index. Consecutive probes are pipelined with prefetches
+ * so that their cache misses overlap on large archives. The order of the paths does not matter.
+ *
+ * @param tar An indexed archive.
+ * @param paths The paths to look up.
+ * @param count The number of paths.
+ * @param results An array of `count` results, the i-th one describing the entry at `paths[i]`.
+ *
+ * @return the number of paths that exist in the archive.
+ */
+size_t tar_lookup_batch(const tar_archive_t *tar, const char *const *paths, size_t count, tar_lookup_t *results);
+
+/**
+ * Same as list(), on an indexed archive.
+ */
+int tar_list(const tar_archive_t *tar, const char *path, char **entries, size_t *no_entries);
+
+/**
+ * Finds the paths of the archive matching a glob pattern, in the byte order of the paths, a page at a time.
+ *
+ * In patterns, '*' matches any run of characters but '/', '?' any character but '/', "[...]" any character
+ * of a set, "[!...]" any character outside of it, and a backslash escapes the next character. "**" matches
+ * any run of characters, '/' included, and "**" followed by '/' any number of leading directories, none
+ * included. Paths are the ones stored in the archive, without following symlinks, and directories match with
+ * or without their trailing '/'. For instance, "**.json" matches every JSON file of the archive, and the same
+ * pattern after "truc/superdir/" every JSON file below truc/superdir/, found with a prefix query.
+ *
+ * The paths are sorted, so the part of the pattern before its first wildcard only costs a binary search,
+ * the paths then being matched one after the other until one does not start with that part.
+ *
+ * @param tar An indexed archive.
+ * @param pattern A glob pattern.
+ * @param cursor An in-out argument. The caller sets it to zero to get the first page, then passes it back
+ *               as the callee left it to get the next pages.
+ * @param paths Filled with up to `*no_paths` paths, which stay valid until tar_close() is called on `tar`.
+ * @param no_paths An in-out argument.
+ *                 The caller sets it to the size of paths.
+ *                 The callee sets it to the number of paths stored.
+ *
+ * @return 1 if more paths match, to be fetched with the updated cursor,
+ *         0 once the last page was returned.
+ */
+int tar_glob(const tar_archive_t *tar, const char *pattern, size_t *cursor, const char **paths, size_t *no_paths);
+
+/**
+ * Same as read_file(), on an indexed archive.
+ */
+ssize_t tar_read_file(const tar_archive_t *tar, const char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/* A range of a file read by tar_read_file_ranges() */
+typedef struct tar_range
+{
+    size_t offset; /* offset in the file to start reading from */
+    size_t len;    /* set by the caller to the size of dest, then by the callee to the number of bytes read */
+    uint8_t *dest;
+} tar_range_t;
+
+/**
+ * Reads several ranges of the same file, such as its header and its footer, resolving its path once.
+ *
+ * The ranges may come in any order and overlap. On archives read with pread(2), ranges a few KiB apart
+ * are read together with a single preadv(2).
+ *
+ * @param tar An indexed archive.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param ranges The ranges to read, their `len` being clamped to the end of the file as read_file() does.
+ * @param count The number of ranges.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset of a range is outside the file, the length of that range being set to zero
+ *            and the other ranges being read,
+ *         -3 if reading the archive failed, the length of every range being set to zero.
+ */
+int tar_read_file_ranges(const tar_archive_t *tar, const char *path, tar_range_t *ranges, size_t count);
+
+/**
+ * Reads a file at a given path in the archive without copying it.
+ *
+ * Instead of filling a buffer, points `data` into the mapping of the archive held by the handle,
+ * so the bytes can be handed to write(2) straight from the page cache.
+ * The view is read-only and stays valid until tar_close() is called on `tar`, after which it
+ * must not be dereferenced anymore.
+ *
+ * @param tar An indexed archive.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param data Set to the byte at `offset` in the file, untouched on error.
+ * @param len An in-out argument.
+ *            The caller set it to the maximum number of bytes to view, SIZE_MAX for the whole file.
+ *            The callee set it to the number of bytes readable from `data`.
+ *
+ * @return the same values as read_file(),
+ *         -3 if the archive is compressed or not addressable whole (see tar_options_t.backend and map_window),
+ *         its files then having to be copied with tar_read_file().
+ */
+ssize_t tar_read_view(const tar_archive_t *tar, const char *path, size_t offset, const uint8_t **data, size_t *len);
+
+/**
+ * Extracts every entry of an indexed archive, writing the regular files on several threads.
+ *
+ * Directories are created first, then the regular files are shared between the threads, each one copied
+ * from the archive with copy_file_range(2) or written from the mapping, then links are created in archive order.
+ * Paths, hard link targets included, are resolved without following symlinks: a link below a symlink extracted
+ * before it fails the extraction rather than being created outside of `dest_dir`.
+ * When several entries have the same path, only the last one is extracted, as its extraction would overwrite
+ * the others. Modes, as masked by the umask, and modification times are restored as by tar_stream_extract(),
+ * directories included, and the same paths are skipped.
+ *
+ * @param tar An indexed archive.
+ * @param dest_dir The directory to extract the archive into, created if missing.
+ * @param nthreads Number of threads to write files with, zero or less to use every online CPU.
+ *
+ * @return the number of entries extracted,
+ *         -1, -2 or -3 if the archive has an invalid header, as check_archive(), the valid entries being extracted still,
+ *         -4 on I/O error.
+ */
+int tar_extract_all(const tar_archive_t *tar, const char *dest_dir, int nthreads);
+
+/**
+ * A queue of asynchronous reads of files of an indexed archive.
+ *
+ * Reads are issued with pread-like requests on the archive file descriptor instead of touching
+ * the mapping, so that many cold reads can be in flight at once rather than faulting pages in one
+ * at a time. A queue is used by one thread at a time, while several queues may share a handle.
+ */
+typedef struct tar_async tar_async_t;
+
+/* How the reads of an asynchronous queue are issued */
+typedef enum tar_async_backend
+{
+    TAR_ASYNC_AUTO,     /* io_uring when the kernel allows it, threads otherwise */
+    TAR_ASYNC_IO_URING, /* a single io_uring instance */
+    TAR_ASYNC_THREADS   /* a pool of threads calling pread(2) */
+} tar_async_backend_t;
+
+/* A read submitted with tar_async_submit() */
+typedef struct tar_async_read
+{
+    const char *path;  /* path of the file, symlinks are resolved as by read_file(), only used during the submission */
+    size_t offset;     /* offset in the file to start reading from */
+    uint8_t *dest;     /* destination buffer, must stay valid until the read completes */
+    size_t len;        /* size of dest */
+    void *user_data;   /* handed back with the completion */
+} tar_async_read_t;
+
+/* The result of a read, returned by tar_async_complete() */
+typedef struct tar_async_completion
+{
+    void *user_data;
+    ssize_t ret;       /* as read_file(), or -3 if reading the archive failed */
+    size_t len;        /* number of bytes written to dest */
+} tar_async_completion_t;
+
+/**
+ * Creates a queue of asynchronous reads on an indexed archive.
+ *
+ * @param tar An indexed archive, which must outlive the queue.
+ * @param queue_depth Maximum number of reads in flight or waiting to be collected, zero for 64.
+ * @param backend How to issue the reads. TAR_ASYNC_AUTO falls back to threads when io_uring is not available,
+ *                for instance when seccomp filters it out of containers, and for compressed archives,
+ *                which the threads decompress.
+ *
+ * @return a queue, or NULL if it could not be created or the requested backend is not available.
+ */
+tar_async_t *tar_async_open(const tar_archive_t *tar, unsigned int queue_depth, tar_async_backend_t backend);
+
+/**
+ * Waits for the reads in flight, then releases a queue.
+ *
+ * @param async A queue returned by tar_async_open(), may be NULL.
+ */
+void tar_async_close(tar_async_t *async);
+
+/**
+ * @return the backend of a queue, either TAR_ASYNC_IO_URING or TAR_ASYNC_THREADS.
+ */
+tar_async_backend_t tar_async_backend(const tar_async_t *async);
+
+/**
+ * Starts reads. Paths are resolved right away, so reads of missing files complete immediately.
+ *
+ * @param async A queue.
+ * @param reads The reads to start.
+ * @param count The number of reads.
+ *
+ * @return the number of reads started, fewer than `count` when the queue is full until completions are collected.
+ */
+size_t tar_async_submit(tar_async_t *async, const tar_async_read_t *reads, size_t count);
+
+/**
+ * Collects the completions of finished reads, in no particular order.
+ *
+ * @param async A queue.
+ * @param completions Filled with up to `max` completions.
+ * @param max The size of completions.
+ * @param min Number of completions to wait for, capped to the number of reads submitted and not collected yet.
+ *
+ * @return the number of completions stored.
+ */
+size_t tar_async_complete(tar_async_t *async, tar_async_completion_t *completions, size_t max, size_t min);
+
+/**
+ * A sequential reader over an archive read with plain read() calls.
+ *
+ * Unlike tar_archive_t, a stream needs neither a regular file nor a mapping: it works on pipes,
+ * sockets and standard input, using a single bounded buffer whatever the size of the archive, and at most
+ * 1 MiB more for the extension headers of an entry.
+ */
+typedef struct tar_stream tar_stream_t;
+
+/* Description of the current entry of a stream */
+typedef struct tar_entry_info
+{
+    const char *name;     /* full path, valid until the next call to tar_next_entry() */
+    const char *linkname; /* target of links, valid until the next call to tar_next_entry() */
+    uint64_t size;        /* payload size in bytes */
+    uint32_t mode;
+    int64_t mtime;
+    char typeflag;
+} tar_entry_info_t;
+
+/**
+ * Starts reading an archive sequentially from the current position of a file descriptor.
+ *
+ * @param tar_fd A file descriptor to read the archive from, owned by the caller.
+ * @param buffer_size Size of the read buffer, rounded up to a whole number of blocks, zero for the default of 64 KiB.
+ *
+ * @return a stream, or NULL if it could not be allocated.
+ */
+tar_stream_t *tar_stream_open(int tar_fd, size_t buffer_size);
+
+/**
+ * Releases a stream. Does not close the underlying file descriptor.
+ *
+ * @param stream A stream returned by tar_stream_open(), may be NULL.
+ */
+void tar_stream_close(tar_stream_t *stream);
+
+/**
+ * Moves to the next entry of the archive, skipping whatever is left of the payload of the current one.
+ *
+ * PAX extended headers and GNU long name headers are folded into the entry they precede, whose name, link
+ * target and size they override, as when indexing. Extension headers past 1 MiB in all before an entry are
+ * skipped unread, the entry keeping its ustar fields. GNU headers, whose magic is "ustar  ", are read as the
+ * others, tar_stream_check() and tar_stream_extract() reporting the archive invalid once it is read.
+ *
+ * @param stream A stream.
+ * @param info Filled with the description of the entry.
+ *
+ * @return 1 if an entry was read,
+ *         zero at the end of the archive,
+ *         -1, -2 or -3 if the next header has an invalid magic value, version value or checksum, as check_archive(),
+ *         -4 on read error or if the payload of an extension header could not be allocated.
+ */
+int tar_next_entry(tar_stream_t *stream, tar_entry_info_t *info);
+
+/**
+ * Reads the payload of the current entry.
+ *
+ * @param stream A stream.
+ * @param dest A destination buffer.
+ * @param len The size of dest.
+ *
+ * @return the number of bytes written to dest, zero once the whole payload has been read,
+ *         -1 on read error or if the archive is truncated.
+ */
+ssize_t tar_read_data(tar_stream_t *stream, void *dest, size_t len);
+
+/**
+ * Same as check_archive(), reading the archive sequentially from a file descriptor that may not be seekable.
+ */
+int tar_stream_check(int tar_fd);
+
+/**
+ * Extracts every entry of an archive read sequentially from a file descriptor that may not be seekable.
+ *
+ * Regular files, directories, symlinks and hard links are recreated below `dest_dir` (created if missing)
+ * with their modes, as masked by the umask, and modification times. Leading '/' are stripped from paths and
+ * paths with a ".." component are skipped. Paths are resolved without following symlinks: an entry below a
+ * symlink, such as one extracted before it, fails the extraction rather than being written outside of `dest_dir`.
+ * Directories are created writable and get their mode and time once the whole archive is extracted.
+ *
+ * @param tar_fd A file descriptor to read the archive from.
+ * @param dest_dir The directory to extract the archive into.
+ *
+ * @return the number of entries extracted,
+ *         -1, -2 or -3 if the archive has an invalid header, as check_archive(), the entries before it and the
+ *         ones of GNU headers being extracted still,
+ *         -4 on I/O error.
+ */
+int tar_stream_extract(int tar_fd, const char *dest_dir);
+
+/**
+ * A writer of ustar archives.
+ *
+ * Headers and small files are gathered in a buffer and written in large chunks, large files being written
+ * next to the buffered headers with a single vectored write, or copied by the kernel from their file descriptor.
+ * Paths, link targets and sizes that do not fit in ustar headers are stored in PAX extended headers.
+ * A writer is used by one thread at a time. Once a write failed, every call fails.
+ */
+typedef struct tar_writer tar_writer_t;
+
+/**
+ * Starts writing an archive.
+ *
+ * @param tar_fd A file descriptor open for writing, kept open by tar_writer_close().
+ * @param append Zero to write a new archive from the current offset of tar_fd (which may be a pipe),
+ *               non-zero to add entries to the archive in tar_fd, which must also be open for reading,
+ *               its end-of-archive blocks being overwritten.
+ *
+ * @return a writer, or NULL if memory ran out or the archive to append to is not valid.
+ */
+tar_writer_t *tar_writer_open(int tar_fd, int append);
+
+/**
+ * Adds a regular file holding `size` bytes of `data`.
+ *
+ * @return zero on success, -1 otherwise.
+ */
+int tar_writer_add_buffer(tar_writer_t *writer, const char *path, const void *data, size_t size, mode_t mode,
+                          time_t mtime);
+
+/**
+ * Adds a regular file with the content, mode and modification time of the regular file open as `fd`.
+ *
+ * @return zero on success, -1 if fd is not a regular file or on I/O error.
+ */
+int tar_writer_add_fd(tar_writer_t *writer, const char *path, int fd);
+
+/**
+ * Adds a directory. A '/' is appended to `path` if it does not end with one.
+ *
+ * @return zero on success, -1 otherwise.
+ */
+int tar_writer_add_directory(tar_writer_t *writer, const char *path, mode_t mode, time_t mtime);
+
+/**
+ * Adds a symlink at `path` pointing to `target`.
+ *
+ * @return zero on success, -1 otherwise.
+ */
+int tar_writer_add_symlink(tar_writer_t *writer, const char *path, const char *target, time_t mtime);
+
+/**
+ * Writes the end-of-archive blocks and the buffered data, then releases a writer.
+ *
+ * @param writer A writer returned by tar_writer_open(), may be NULL.
+ *
+ * @return zero if the whole archive was written, -1 otherwise.
+ */
+int tar_writer_close(tar_writer_t *writer);
+
+/* Counters on the operations of a handle, only kept when the library is built with -DTAR_STATS (make STATS=1) */
+
+typedef enum tar_stats_op
+{
+    TAR_STATS_CHECK, /* tar_exists() and tar_is_*() */
+    TAR_STATS_LIST,  /* tar_list() and tar_glob() */
+    TAR_STATS_READ,  /* tar_read_file() and tar_read_file_ranges() */
+    TAR_STATS_OPS
+} tar_stats_op_t;
+
+#define TAR_STATS_BUCKETS 32
+
+typedef struct tar_op_stats
+{
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t histogram[TAR_STATS_BUCKETS]; /* calls taking from 2^i to 2^(i+1) - 1 ns, the last bucket is open */
+} tar_op_stats_t;
+
+typedef struct tar_stats
+{
+    tar_op_stats_t ops[TAR_STATS_OPS];
+    uint64_t headers_scanned; /* headers walked to build the index */
+    uint64_t validate_ns;     /* time spent checking their magic and checksum */
+    uint64_t maps;            /* mmap(2) calls on the archive */
+    uint64_t map_ns;
+    uint64_t probes;          /* hash table slots looked at by path lookups */
+    uint64_t name_compares;   /* paths compared by them */
+    uint64_t bytes_copied;    /* payload bytes copied to callers */
+    uint64_t cache_hits;      /* chunks found in the cache of tar_options_t.cache_size */
+    uint64_t cache_misses;    /* chunks read from the archive for it */
+    long minor_faults;        /* page faults of the whole process since the handle was opened */
+    long major_faults;
+} tar_stats_t;
+
+/**
+ * Sums the counters the threads using a handle updated so far.
+ *
+ * @param tar A handle returned by tar_open().
+ * @param stats Receives the counters, zeroed when they are not kept.
+ *
+ * @return zero on success,
+ *         -1 if the library was built without stats or they could not be allocated when the handle was opened.
+ */
+int tar_stats_get(const tar_archive_t *tar, tar_stats_t *stats);
+
+/**
+ * Writes the counters of a handle in a human-readable form, with latency percentiles estimated from the histograms.
+ *
+ * @return zero on success, -1 if the counters are not kept.
+ */
+int tar_stats_dump(const tar_archive_t *tar, int fd);
+
 #endif
@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+#include "tar_internal.h"
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define ASYNC_DEFAULT_DEPTH 64
+
+/* the thread backend blocks one thread per read in flight, up to this many */
+#define ASYNC_MAX_THREADS 32
+
+/* longest single read, io_uring lengths being 32-bit */
+#define ASYNC_MAX_READ (1U << 30)
+
+/* A read of the queue, from its submission until its completion is collected */
+typedef struct async_slot
+{
+    void *user_data;
+    uint8_t *dest;
+    uint64_t archive_off; /* offset in the archive of dest[0] */
+    size_t len;           /* bytes to read */
+    size_t done;          /* bytes read so far */
+    ssize_t ret;          /* value of the completion, once the read is done */
+} async_slot_t;
+
+/* The rings shared with the kernel, mapped from the io_uring file descriptor */
+typedef struct uring
+{
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;        /* same as sq_ring when the kernel maps both rings at once */
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned int to_submit; /* queued entries not handed to the kernel yet */
+} uring_t;
+
+struct tar_async
+{
+    const tar_archive_t *tar;
+    int fd;
+    tar_async_backend_t backend;
+    unsigned int depth;
+    async_slot_t *slots;
+    unsigned int *free;        /* stack of the slots not in use */
+    unsigned int no_free;
+    unsigned int *ready;       /* ring of the slots whose read is done, waiting to be collected */
+    unsigned int ready_head;
+    unsigned int ready_count;
+    unsigned int outstanding;  /* reads submitted and not done yet */
+
+    uring_t ring;
+
+    /* thread backend, the ready ring and outstanding count are then guarded by the lock */
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;  /* signalled when a read is pending or the queue closes */
+    pthread_cond_t ready_cond; /* signalled when a read is done */
+    unsigned int *pending;     /* ring of the slots waiting for a thread */
+    unsigned int pending_head;
+    unsigned int pending_count;
+    pthread_t *threads;
+    int no_threads;
+    int stopping;
+};
+
+/**
+ * Sets up an io_uring instance with room for `entries` reads in flight
+ * @return zero on success, -1 if io_uring is not available
+ */
+static int uring_setup(uring_t *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1)
+        return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = MAP_FAILED;
+    if (ring->cq_ring != MAP_FAILED)
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sq_ring != MAP_FAILED)
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    uint8_t *sq = ring->sq_ring;
+    uint8_t *cq = ring->cq_ring;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->to_submit = 0;
+    return 0;
+}
+
+static void uring_release(uring_t *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/**
+ * Hands the queued entries to the kernel and waits for `min_complete` completions
+ * @return zero on success, -1 otherwise
+ */
+static int uring_enter(uring_t *ring, unsigned int min_complete)
+{
+    while (1)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete,
+                          min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0)
+        {
+            ring->to_submit -= ret < (int)ring->to_submit ? ret : ring->to_submit;
+            return 0;
+        }
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+/**
+ * Queues the read of the rest of a slot, at most ASYNC_MAX_READ bytes of it
+ */
+static void uring_queue_read(tar_async_t *async, unsigned int index)
+{
+    uring_t *ring = &async->ring;
+    async_slot_t *slot = &async->slots[index];
+    unsigned int tail = *ring->sq_tail;
+    unsigned int sqe_index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[sqe_index];
+    size_t len = slot->len - slot->done;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = async->fd;
+    sqe->off = slot->archive_off + slot->done;
+    sqe->addr = (uint64_t)(uintptr_t)(slot->dest + slot->done);
+    sqe->len = len < ASYNC_MAX_READ ? len : ASYNC_MAX_READ;
+    sqe->user_data = index;
+    ring->sq_array[sqe_index] = sqe_index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+/**
+ * Moves a slot whose read is done to the ready ring, the lock being held by the thread backend
+ */
+static void push_ready(tar_async_t *async, unsigned int index)
+{
+    async->ready[(async->ready_head + async->ready_count) % async->depth] = index;
+    async->ready_count++;
+}
+
+/**
+ * Handles the completions posted by the kernel, requeuing the reads that came back short
+ */
+static void uring_reap(tar_async_t *async)
+{
+    uring_t *ring = &async->ring;
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        unsigned int index = cqe->user_data;
+        async_slot_t *slot = &async->slots[index];
+        if (cqe->res > 0)
+            slot->done += cqe->res;
+        if (cqe->res > 0 && slot->done < slot->len)
+        {
+            uring_queue_read(async, index);
+            continue;
+        }
+        if (slot->done < slot->len)
+            slot->ret = -3; // read error, or the archive shrank since it was indexed
+        async->outstanding--;
+        push_ready(async, index);
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void *async_worker(void *arg)
+{
+    tar_async_t *async = arg;
+    pthread_mutex_lock(&async->lock);
+    while (1)
+    {
+        while (async->pending_count == 0 && !async->stopping)
+            pthread_cond_wait(&async->work_cond, &async->lock);
+        if (async->pending_count == 0)
+            break;
+        unsigned int index = async->pending[async->pending_head];
+        async->pending_head = (async->pending_head + 1) % async->depth;
+        async->pending_count--;
+        pthread_mutex_unlock(&async->lock);
+
+        async_slot_t *slot = &async->slots[index];
+        if (archive_is_compressed(async->tar) || async->fd == -1)
+        {
+            if (archive_read(async->tar, slot->archive_off, slot->dest, slot->len) == 0)
+                slot->done = slot->len;
+            else
+                slot->ret = -3;
+        }
+        while (slot->done < slot->len && slot->ret != -3)
+        {
+            ssize_t got = pread(async->fd, slot->dest + slot->done, slot->len - slot->done,
+                                slot->archive_off + slot->done);
+            if (got == -1 && errno == EINTR)
+                continue;
+            if (got <= 0)
+            {
+                slot->ret = -3;
+                break;
+            }
+            slot->done += got;
+        }
+
+        pthread_mutex_lock(&async->lock);
+        async->outstanding--;
+        push_ready(async, index);
+        pthread_cond_signal(&async->ready_cond);
+    }
+    pthread_mutex_unlock(&async->lock);
+    return NULL;
+}
+
+/**
+ * Starts the pool of the thread backend
+ * @return zero on success, -1 otherwise
+ */
+static int start_threads(tar_async_t *async)
+{
+    int wanted = async->depth < ASYNC_MAX_THREADS ? async->depth : ASYNC_MAX_THREADS;
+    async->pending = malloc(async->depth * sizeof(unsigned int));
+    async->threads = malloc(wanted * sizeof(pthread_t));
+    if (async->pending == NULL || async->threads == NULL)
+        return -1;
+    for (; async->no_threads < wanted; async->no_threads++)
+    {
+        if (pthread_create(&async->threads[async->no_threads], NULL, async_worker, async) != 0)
+            break;
+    }
+    return async->no_threads > 0 ? 0 : -1;
+}
+
+static void stop_threads(tar_async_t *async)
+{
+    pthread_mutex_lock(&async->lock);
+    async->stopping = 1;
+    pthread_cond_broadcast(&async->work_cond);
+    pthread_mutex_unlock(&async->lock);
+    for (int t = 0; t < async->no_threads; t++)
+        pthread_join(async->threads[t], NULL);
+}
+
+tar_async_t *tar_async_open(const tar_archive_t *tar, unsigned int queue_depth, tar_async_backend_t backend)
+{
+    tar_async_t *async = calloc(1, sizeof(tar_async_t));
+    if (async == NULL)
+        return NULL;
+    async->tar = tar;
+    async->fd = archive_fd(tar);
+    async->depth = queue_depth > 0 ? queue_depth : ASYNC_DEFAULT_DEPTH;
+    async->slots = malloc(async->depth * sizeof(async_slot_t));
+    async->free = malloc(async->depth * sizeof(unsigned int));
+    async->ready = malloc(async->depth * sizeof(unsigned int));
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->work_cond, NULL);
+    pthread_cond_init(&async->ready_cond, NULL);
+    if (async->slots == NULL || async->free == NULL || async->ready == NULL)
+    {
+        tar_async_close(async);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < async->depth; i++)
+        async->free[i] = async->depth - 1 - i;
+    async->no_free = async->depth;
+
+    // io_uring reads raw bytes of the archive from its file, the threads decompress those of compressed archives
+    // and copy those of archives in memory
+    int uring_allowed = backend != TAR_ASYNC_THREADS && !archive_is_compressed(tar) && async->fd != -1;
+    if (uring_allowed && uring_setup(&async->ring, async->depth) == 0)
+    {
+        async->backend = TAR_ASYNC_IO_URING;
+        return async;
+    }
+    async->backend = TAR_ASYNC_THREADS;
+    if (backend == TAR_ASYNC_IO_URING || start_threads(async) != 0)
+    {
+        tar_async_close(async);
+        return NULL;
+    }
+    return async;
+}
+
+void tar_async_close(tar_async_t *async)
+{
+    if (async == NULL)
+        return;
+    if (async->backend == TAR_ASYNC_IO_URING)
+    {
+        // the kernel may still write to the buffers of the reads in flight
+        while (async->outstanding > 0 && uring_enter(&async->ring, 1) == 0)
+            uring_reap(async);
+        uring_release(&async->ring);
+    }
+    else
+    {
+        stop_threads(async);
+    }
+    pthread_cond_destroy(&async->ready_cond);
+    pthread_cond_destroy(&async->work_cond);
+    pthread_mutex_destroy(&async->lock);
+    free(async->threads);
+    free(async->pending);
+    free(async->ready);
+    free(async->free);
+    free(async->slots);
+    free(async);
+}
+
+tar_async_backend_t tar_async_backend(const tar_async_t *async)
+{
+    return async->backend;
+}
+
+size_t tar_async_submit(tar_async_t *async, const tar_async_read_t *reads, size_t count)
+{
+    int threads = async->backend == TAR_ASYNC_THREADS;
+    size_t submitted = 0;
+    for (; submitted < count && async->no_free > 0; submitted++)
+    {
+        const tar_async_read_t *read = &reads[submitted];
+        unsigned int index = async->free[--async->no_free];
+        async_slot_t *slot = &async->slots[index];
+        memset(slot, 0, sizeof(async_slot_t));
+        slot->user_data = read->user_data;
+        slot->dest = read->dest;
+
+        // same bounds as tar_read_view()
+        uint64_t offset, size;
+        if (archive_locate_file(async->tar, read->path, &offset, &size) != 0)
+            slot->ret = -1;
+        else if (read->offset > size)
+            slot->ret = -2;
+        else
+        {
+            uint64_t available = size - read->offset;
+            slot->len = read->len < available ? read->len : available;
+            slot->ret = available - slot->len;
+            slot->archive_off = offset + read->offset;
+        }
+
+        if (threads)
+            pthread_mutex_lock(&async->lock);
+        if (slot->len == 0)
+        {
+            push_ready(async, index);
+        }
+        else if (threads)
+        {
+            async->pending[(async->pending_head + async->pending_count) % async->depth] = index;
+            async->pending_count++;
+            async->outstanding++;
+            pthread_cond_signal(&async->work_cond);
+        }
+        else
+        {
+            uring_queue_read(async, index);
+            async->outstanding++;
+        }
+        if (threads)
+            pthread_mutex_unlock(&async->lock);
+    }
+    if (!threads && async->ring.to_submit > 0)
+        uring_enter(&async->ring, 0);
+    return submitted;
+}
+
+size_t tar_async_complete(tar_async_t *async, tar_async_completion_t *completions, size_t max, size_t min)
+{
+    int threads = async->backend == TAR_ASYNC_THREADS;
+    if (threads)
+        pthread_mutex_lock(&async->lock);
+    if (min > max)
+        min = max;
+    while (1)
+    {
+        if (!threads)
+            uring_reap(async);
+        if (async->ready_count >= min || async->outstanding == 0)
+            break;
+        if (threads)
+            pthread_cond_wait(&async->ready_cond, &async->lock);
+        else if (uring_enter(&async->ring, 1) != 0)
+            break;
+    }
+    if (!threads && async->ring.to_submit > 0)
+        uring_enter(&async->ring, 0); // short reads requeued by the last reap
+
+    size_t collected = 0;
+    for (; collected < max && async->ready_count > 0; collected++)
+    {
+        unsigned int index = async->ready[async->ready_head];
+        async->ready_head = (async->ready_head + 1) % async->depth;
+        async->ready_count--;
+        async_slot_t *slot = &async->slots[index];
+        completions[collected].user_data = slot->user_data;
+        completions[collected].ret = slot->ret;
+        completions[collected].len = slot->done;
+        async->free[async->no_free++] = index;
+    }
+    if (threads)
+        pthread_mutex_unlock(&async->lock);
+    return collected;
+}
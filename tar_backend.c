@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include "tar_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define READAHEAD_DEFAULT (1024 * 1024)
+
+/* Archives mapped whole */
+
+static int mmap_open(backend_t *backend, const tar_options_t *options)
+{
+    if (backend->size == 0)
+        return 0;
+    if (backend->size > SIZE_MAX)
+        return -1;
+    backend->data = map_archive(backend->fd, backend->size, options != NULL ? options->map_flags : 0);
+    return backend->data != NULL ? 0 : -1;
+}
+
+static int mapped_read(const backend_t *backend, uint64_t offset, void *dest, size_t len)
+{
+    if (offset > backend->size || len > backend->size - offset)
+        return -1;
+    if (len >= READ_WILLNEED_MIN)
+        backend->ops->advise(backend, offset, len, MADV_WILLNEED);
+    memcpy(dest, backend->data + offset, len);
+    return 0;
+}
+
+static int mapped_readv(const backend_t *backend, uint64_t offset, const struct iovec *iov, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (mapped_read(backend, offset, iov[i].iov_base, iov[i].iov_len) != 0)
+            return -1;
+        offset += iov[i].iov_len;
+    }
+    return 0;
+}
+
+static int mmap_resize(backend_t *backend, uint64_t size)
+{
+    if (size > SIZE_MAX)
+        return -1;
+    uint8_t *data = backend->data == NULL ? map_archive(backend->fd, size, 0)
+                                          : mremap((void *)backend->data, backend->size, size, MREMAP_MAYMOVE);
+    if (data == NULL || data == MAP_FAILED)
+        return -1;
+    backend->data = data;
+    backend->size = size;
+    return 0;
+}
+
+static void mmap_advise(const backend_t *backend, uint64_t offset, uint64_t len, int advice)
+{
+    map_advise(backend->data, backend->size, offset, len, advice);
+}
+
+static void mmap_close(backend_t *backend)
+{
+    if (backend->data != NULL)
+        munmap((void *)backend->data, backend->size);
+}
+
+const backend_ops_t mmap_backend = {mmap_open, mapped_read, mapped_readv, mmap_resize, mmap_advise, mmap_close};
+
+/* Archives read with pread(2), for files mmap(2) is slow on and archives past the map window */
+
+static int pread_open(backend_t *backend, const tar_options_t *options)
+{
+    backend->readahead = options != NULL && options->readahead > 0 ? options->readahead : READAHEAD_DEFAULT;
+    return 0;
+}
+
+static int pread_read(const backend_t *backend, uint64_t offset, void *dest, size_t len)
+{
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t got = pread(backend->fd, (uint8_t *)dest + done, len - done, offset + done);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        done += got;
+    }
+    // large reads are mostly chunks of a file read in order, whose next chunk is then fetched while this one is used
+    if (len >= READ_WILLNEED_MIN)
+        posix_fadvise(backend->fd, offset + len, backend->readahead, POSIX_FADV_WILLNEED);
+    return 0;
+}
+
+static int pread_readv(const backend_t *backend, uint64_t offset, const struct iovec *iov, int count)
+{
+    struct iovec left[count];
+    memcpy(left, iov, count * sizeof(struct iovec));
+    struct iovec *next = left;
+    while (count > 0)
+    {
+        ssize_t got = preadv(backend->fd, next, count, offset);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        offset += got;
+        // a short read stops anywhere, the next one resumes from there
+        for (; count > 0 && (size_t)got >= next->iov_len; next++, count--)
+            got -= next->iov_len;
+        if (count > 0)
+        {
+            next->iov_base = (uint8_t *)next->iov_base + got;
+            next->iov_len -= got;
+        }
+    }
+    return 0;
+}
+
+static int pread_resize(backend_t *backend, uint64_t size)
+{
+    backend->size = size;
+    return 0;
+}
+
+static void pread_advise(const backend_t *backend, uint64_t offset, uint64_t len, int advice)
+{
+    int fadvice = advice == MADV_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL
+                  : advice == MADV_RANDOM   ? POSIX_FADV_RANDOM
+                  : advice == MADV_WILLNEED ? POSIX_FADV_WILLNEED
+                                            : POSIX_FADV_NORMAL;
+    posix_fadvise(backend->fd, offset, len, fadvice);
+}
+
+static void pread_close(backend_t *backend)
+{
+}
+
+const backend_ops_t pread_backend = {pread_open, pread_read, pread_readv, pread_resize, pread_advise, pread_close};
+
+/* Archives already in memory, owned by the caller */
+
+static int memory_open(backend_t *backend, const tar_options_t *options)
+{
+    backend->data = options->buffer;
+    return backend->data != NULL || backend->size == 0 ? 0 : -1;
+}
+
+static int memory_resize(backend_t *backend, uint64_t size)
+{
+    return -1; // the buffer belongs to the caller
+}
+
+static void memory_advise(const backend_t *backend, uint64_t offset, uint64_t len, int advice)
+{
+}
+
+static void memory_close(backend_t *backend)
+{
+}
+
+const backend_ops_t memory_backend = {memory_open, mapped_read, mapped_readv, memory_resize, memory_advise, memory_close};
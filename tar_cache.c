@@ -0,0 +1,233 @@
+#include "tar_internal.h"
+#include <pthread.h>
+#include <string.h>
+
+#define CACHE_CHUNK_DEFAULT (256 * 1024)
+#define CACHE_CHUNK_MIN (64 * 1024)
+#define CACHE_CHUNK_MAX (1024 * 1024)
+
+typedef enum slot_state
+{
+    SLOT_EMPTY,
+    SLOT_LOADING, /* being read by the thread that claimed it, without the lock */
+    SLOT_READY
+} slot_state_t;
+
+typedef struct cache_slot
+{
+    uint32_t entry;     /* index of the entry the chunk belongs to */
+    uint64_t chunk;     /* index of the chunk in the payload of the entry */
+    uint32_t pins;      /* threads copying from or into the chunk, which keep it from being evicted */
+    int32_t next;       /* next slot in the same bucket, -1 at the end */
+    uint8_t state;
+    uint8_t referenced; /* second chance of the CLOCK eviction */
+} cache_slot_t;
+
+struct block_cache
+{
+    pthread_mutex_t lock;
+    pthread_cond_t loaded; /* signaled whenever a slot leaves SLOT_LOADING */
+    size_t chunk_size;
+    size_t no_slots;
+    size_t hand;           /* next slot the CLOCK looks at */
+    cache_slot_t *slots;
+    int32_t *buckets;      /* first slot holding each hash of (entry, chunk), -1 when none */
+    size_t bucket_mask;
+    uint8_t *arena;        /* no_slots chunks, allocated once */
+};
+
+block_cache_t *cache_create(uint64_t budget, size_t chunk_size)
+{
+    if (chunk_size == 0)
+        chunk_size = CACHE_CHUNK_DEFAULT;
+    if (chunk_size < CACHE_CHUNK_MIN)
+        chunk_size = CACHE_CHUNK_MIN;
+    if (chunk_size > CACHE_CHUNK_MAX)
+        chunk_size = CACHE_CHUNK_MAX;
+    // the budget covers the bookkeeping too: a slot, up to two buckets, and the chunk itself
+    uint64_t fixed = sizeof(block_cache_t) + 16 * sizeof(int32_t);
+    uint64_t slot_cost = chunk_size + sizeof(cache_slot_t) + 2 * sizeof(int32_t);
+    uint64_t no_slots = budget > fixed ? (budget - fixed) / slot_cost : 0;
+    if (no_slots == 0 || no_slots > INT32_MAX)
+        return NULL;
+
+    block_cache_t *cache = calloc(1, sizeof(block_cache_t));
+    if (cache == NULL)
+        return NULL;
+    size_t no_buckets = 16;
+    while (no_buckets < no_slots)
+        no_buckets *= 2;
+    cache->chunk_size = chunk_size;
+    cache->no_slots = no_slots;
+    cache->bucket_mask = no_buckets - 1;
+    cache->slots = calloc(no_slots, sizeof(cache_slot_t));
+    cache->buckets = malloc(no_buckets * sizeof(int32_t));
+    cache->arena = malloc(no_slots * chunk_size);
+    if (cache->slots == NULL || cache->buckets == NULL || cache->arena == NULL)
+    {
+        cache_free(cache);
+        return NULL;
+    }
+    memset(cache->buckets, 0xff, no_buckets * sizeof(int32_t));
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+    return cache;
+}
+
+void cache_free(block_cache_t *cache)
+{
+    if (cache == NULL)
+        return;
+    if (cache->arena != NULL)
+    {
+        pthread_mutex_destroy(&cache->lock);
+        pthread_cond_destroy(&cache->loaded);
+    }
+    free(cache->slots);
+    free(cache->buckets);
+    free(cache->arena);
+    free(cache);
+}
+
+static size_t bucket_of(const block_cache_t *cache, uint32_t entry, uint64_t chunk)
+{
+    uint64_t key = ((uint64_t)entry << 32 ^ chunk) * 0x9e3779b97f4a7c15ULL;
+    return (key >> 32) & cache->bucket_mask;
+}
+
+static cache_slot_t *find_slot(block_cache_t *cache, uint32_t entry, uint64_t chunk)
+{
+    for (int32_t i = cache->buckets[bucket_of(cache, entry, chunk)]; i != -1; i = cache->slots[i].next)
+    {
+        cache_slot_t *slot = &cache->slots[i];
+        if (slot->entry == entry && slot->chunk == chunk)
+            return slot;
+    }
+    return NULL;
+}
+
+static void unlink_slot(block_cache_t *cache, cache_slot_t *slot)
+{
+    int32_t index = slot - cache->slots;
+    int32_t *link = &cache->buckets[bucket_of(cache, slot->entry, slot->chunk)];
+    while (*link != index)
+        link = &cache->slots[*link].next;
+    *link = slot->next;
+    slot->state = SLOT_EMPTY;
+}
+
+/**
+ * Picks the slot to evict with the CLOCK policy, skipping pinned slots
+ * @return the slot, unlinked and empty, or NULL if every slot is pinned
+ */
+static cache_slot_t *evict_slot(block_cache_t *cache)
+{
+    // two turns at most: the first one may only clear the referenced bits
+    for (size_t step = 0; step < 2 * cache->no_slots; step++)
+    {
+        cache_slot_t *slot = &cache->slots[cache->hand];
+        cache->hand = (cache->hand + 1) % cache->no_slots;
+        if (slot->pins > 0)
+            continue;
+        if (slot->state == SLOT_READY && slot->referenced)
+        {
+            slot->referenced = 0;
+            continue;
+        }
+        if (slot->state == SLOT_READY)
+            unlink_slot(cache, slot);
+        return slot;
+    }
+    return NULL;
+}
+
+/**
+ * Copies the bytes of one chunk, loading the chunk in the cache if it is not there
+ * @return zero on success, -1 if the archive could not be read
+ */
+static int read_chunk(block_cache_t *cache, const tar_archive_t *tar, uint32_t entry, uint64_t data_off,
+                      uint64_t size, uint64_t chunk, size_t from, uint8_t *dest, size_t len)
+{
+    uint64_t chunk_off = chunk * cache->chunk_size;
+    size_t chunk_len = size - chunk_off < cache->chunk_size ? size - chunk_off : cache->chunk_size;
+    pthread_mutex_lock(&cache->lock);
+    cache_slot_t *slot;
+    while ((slot = find_slot(cache, entry, chunk)) != NULL && slot->state == SLOT_LOADING)
+        pthread_cond_wait(&cache->loaded, &cache->lock);
+    if (slot != NULL)
+    {
+        slot->pins++;
+        slot->referenced = 1;
+        pthread_mutex_unlock(&cache->lock);
+        STATS_ADD(tar, STAT_CACHE_HITS, 1);
+    }
+    else
+    {
+        slot = evict_slot(cache);
+        if (slot == NULL)
+        {
+            // every chunk is being copied: read around the cache rather than growing it
+            pthread_mutex_unlock(&cache->lock);
+            STATS_ADD(tar, STAT_CACHE_MISSES, 1);
+            return archive_read(tar, data_off + chunk_off + from, dest, len);
+        }
+        slot->entry = entry;
+        slot->chunk = chunk;
+        slot->pins = 1;
+        slot->referenced = 1;
+        slot->state = SLOT_LOADING;
+        size_t bucket = bucket_of(cache, entry, chunk);
+        slot->next = cache->buckets[bucket];
+        cache->buckets[bucket] = slot - cache->slots;
+        pthread_mutex_unlock(&cache->lock);
+        STATS_ADD(tar, STAT_CACHE_MISSES, 1);
+
+        int ret = archive_read(tar, data_off + chunk_off, cache->arena + (slot - cache->slots) * cache->chunk_size,
+                               chunk_len);
+        pthread_mutex_lock(&cache->lock);
+        if (ret != 0)
+        {
+            unlink_slot(cache, slot);
+            slot->pins = 0;
+        }
+        else
+        {
+            slot->state = SLOT_READY;
+        }
+        pthread_cond_broadcast(&cache->loaded);
+        pthread_mutex_unlock(&cache->lock);
+        if (ret != 0)
+            return -1;
+    }
+
+    memcpy(dest, cache->arena + (slot - cache->slots) * cache->chunk_size + from, len);
+    pthread_mutex_lock(&cache->lock);
+    slot->pins--;
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+int cache_read(block_cache_t *cache, const tar_archive_t *tar, uint32_t entry, uint64_t data_off, uint64_t size,
+               uint64_t offset, void *dest, size_t len)
+{
+    // a large read would evict most of the cache for chunks it is unlikely to read again
+    size_t max_chunks = cache->no_slots / 4 > 0 ? cache->no_slots / 4 : 1;
+    if (len > max_chunks * cache->chunk_size)
+    {
+        STATS_ADD(tar, STAT_CACHE_MISSES, 1);
+        return archive_read(tar, data_off + offset, dest, len);
+    }
+    uint8_t *out = dest;
+    while (len > 0)
+    {
+        uint64_t chunk = offset / cache->chunk_size;
+        size_t from = offset % cache->chunk_size;
+        size_t step = cache->chunk_size - from < len ? cache->chunk_size - from : len;
+        if (read_chunk(cache, tar, entry, data_off, size, chunk, from, out, step) != 0)
+            return -1;
+        out += step;
+        offset += step;
+        len -= step;
+    }
+    return 0;
+}
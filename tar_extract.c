@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include "tar_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* bytes read at once from the archive when the kernel cannot copy a payload by itself */
+#define EXTRACT_BUFFER_SIZE (64 * 1024)
+
+const char *extract_relative_path(const char *name)
+{
+    while (*name == '/')
+        name++;
+    if (*name == '\0')
+        return NULL;
+
+    const char *component = name;
+    while (component != NULL)
+    {
+        if (component[0] == '.' && component[1] == '.' && (component[2] == '/' || component[2] == '\0'))
+            return NULL;
+        component = strchr(component, '/');
+        if (component != NULL)
+            component++;
+    }
+    return name;
+}
+
+static void close_parent(int dir_fd, int parent)
+{
+    if (parent != dir_fd)
+        close(parent);
+}
+
+/**
+ * Opens the directory holding the last component of `path`, one component at a time from `dir_fd` and without
+ * following symlinks, so that no symlink already on disk leads outside of `dir_fd`
+ *
+ * @param create Whether to create the missing directories.
+ * @param name Set to the last component of `path`.
+ *
+ * @return a file descriptor on the directory, `dir_fd` itself for top-level paths, or -1 on error
+ */
+static int open_parent(int dir_fd, const char *path, int create, const char **name)
+{
+    char component[NAME_MAX + 1];
+    int fd = dir_fd;
+    const char *slash;
+    while ((slash = strchr(path, '/')) != NULL && slash[1] != '\0')
+    {
+        size_t len = slash - path;
+        path = slash + 1;
+        if (len > NAME_MAX)
+        {
+            close_parent(dir_fd, fd);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(component, slash - len, len);
+        component[len] = '\0';
+        if (len == 0 || strcmp(component, ".") == 0)
+            continue;
+
+        int child = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (child == -1 && errno == ENOENT && create &&
+            (mkdirat(fd, component, 0777) == 0 || errno == EEXIST))
+            child = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        close_parent(dir_fd, fd);
+        if (child == -1)
+            return -1;
+        fd = child;
+    }
+    // a name ending with several '/' is the directory before them, never an absolute path
+    *name = *path == '/' ? "." : path;
+    return fd;
+}
+
+int extract_directory(int dir_fd, const char *path, mode_t mode)
+{
+    const char *name;
+    int parent = open_parent(dir_fd, path, 1, &name);
+    if (parent == -1)
+        return -1;
+    // keep the directory writable for its children, as the umask would otherwise allow
+    int ret = mkdirat(parent, name, (mode & 07777) | S_IRWXU) == -1 && errno != EEXIST ? -1 : 0;
+    close_parent(dir_fd, parent);
+    return ret;
+}
+
+int extract_open_file(int dir_fd, const char *path, mode_t mode)
+{
+    const char *name;
+    int parent = open_parent(dir_fd, path, 1, &name);
+    if (parent == -1)
+        return -1;
+    unlinkat(parent, name, 0);
+    int fd = openat(parent, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode & 07777);
+    close_parent(dir_fd, parent);
+    return fd;
+}
+
+int extract_symlink(int dir_fd, const char *path, const char *target)
+{
+    const char *name;
+    int parent = open_parent(dir_fd, path, 1, &name);
+    if (parent == -1)
+        return -1;
+    unlinkat(parent, name, 0);
+    int ret = symlinkat(target, parent, name);
+    close_parent(dir_fd, parent);
+    return ret;
+}
+
+int extract_hardlink(int dir_fd, const char *path, const char *target)
+{
+    const char *relative_target = extract_relative_path(target);
+    if (relative_target == NULL)
+        return -1;
+    const char *target_name;
+    int target_parent = open_parent(dir_fd, relative_target, 0, &target_name);
+    if (target_parent == -1)
+        return -1;
+    const char *name;
+    int parent = open_parent(dir_fd, path, 1, &name);
+    int ret = -1;
+    if (parent != -1)
+    {
+        unlinkat(parent, name, 0);
+        // without AT_SYMLINK_FOLLOW, a target that is a symlink is linked to itself rather than followed
+        ret = linkat(target_parent, target_name, parent, name, 0);
+        close_parent(dir_fd, parent);
+    }
+    close_parent(dir_fd, target_parent);
+    return ret;
+}
+
+int extract_payload(int fd, int tar_fd, uint64_t offset, const uint8_t *data, uint64_t size)
+{
+    uint64_t done = 0;
+    loff_t in_off = offset;
+    while (done < size)
+    {
+        ssize_t ret = copy_file_range(tar_fd, &in_off, fd, NULL, size - done, 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break; // unsupported between these files, or the archive shrank
+        done += ret;
+    }
+    uint8_t buffer[data == NULL ? EXTRACT_BUFFER_SIZE : 1];
+    while (done < size)
+    {
+        size_t chunk = size - done;
+        if (data == NULL)
+        {
+            chunk = chunk < sizeof(buffer) ? chunk : sizeof(buffer);
+            if (pread(tar_fd, buffer, chunk, offset + done) != (ssize_t)chunk)
+                return -1;
+        }
+        ssize_t ret = pwrite(fd, data != NULL ? data + done : buffer, chunk, done);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+    return 0;
+}
+
+void extract_finish_directory(int dir_fd, const char *path, mode_t mode, time_t mtime)
+{
+    const char *name;
+    int parent = open_parent(dir_fd, path, 0, &name);
+    if (parent == -1)
+        return;
+    int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    close_parent(dir_fd, parent);
+    struct stat statbuf;
+    if (fd == -1)
+        return;
+    if (fstat(fd, &statbuf) == 0)
+    {
+        mode_t current = statbuf.st_mode & 07777;
+        mode_t wanted = current & ~(S_IRWXU & ~mode);
+        if (wanted != current)
+            fchmod(fd, wanted);
+    }
+    struct timespec times[2] = {
+        {.tv_sec = 0, .tv_nsec = UTIME_NOW},
+        {.tv_sec = mtime, .tv_nsec = 0},
+    };
+    futimens(fd, times);
+    close(fd);
+}
+
+void extract_mtime(int dir_fd, const char *path, time_t mtime)
+{
+    const char *name;
+    int parent = open_parent(dir_fd, path, 0, &name);
+    if (parent == -1)
+        return;
+    struct timespec times[2] = {
+        {.tv_sec = 0, .tv_nsec = UTIME_NOW},
+        {.tv_sec = mtime, .tv_nsec = 0},
+    };
+    utimensat(parent, name, times, AT_SYMLINK_NOFOLLOW);
+    close_parent(dir_fd, parent);
+}
@@ -0,0 +1,377 @@
+#include "tar_internal.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/* deflate back-references reach at most this far, so this much output restarts the inflation anywhere */
+#define GZ_WINDOW_SIZE 32768
+
+/* largest input handed to zlib at once, its lengths being 32-bit */
+#define GZ_MAX_INPUT (1U << 30)
+
+#define GZ_DEFAULT_INTERVAL (1024 * 1024)
+
+#define CHECKPOINT_MAGIC "TARGZCKP"
+#define CHECKPOINT_VERSION 1
+
+/* A point of the compressed stream the inflation can restart from, always at a deflate block boundary */
+typedef struct gz_checkpoint
+{
+    uint64_t in_off;  /* offset in the compressed file of the first byte the block does not share with the previous one */
+    uint64_t out_off; /* offset in the uncompressed archive */
+    uint32_t bits;    /* bits of the byte before in_off that belong to the block, zero to seven */
+    uint32_t unused;
+} gz_checkpoint_t;
+
+struct gz_index
+{
+    gz_checkpoint_t *checkpoints;
+    uint8_t *windows;           /* the GZ_WINDOW_SIZE bytes of output preceding each checkpoint */
+    size_t no_checkpoints;
+    size_t capacity;
+    uint64_t uncompressed_size;
+    uint8_t *map;               /* checkpoint file the arrays above point into, NULL when built in memory */
+    size_t map_size;
+};
+
+/**
+ * Layout of a checkpoint file, followed by the checkpoints and then their windows, both 8-byte aligned
+ */
+typedef struct checkpoint_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t window_size;
+    uint64_t archive_size; /* the compressed archive the checkpoints were recorded from */
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    uint64_t uncompressed_size;
+    uint64_t no_checkpoints;
+} checkpoint_header_t;
+
+int is_gzip(const uint8_t *data, size_t size)
+{
+    return size >= 2 && data[0] == 0x1f && data[1] == 0x8b;
+}
+
+/**
+ * Records a checkpoint, the last GZ_WINDOW_SIZE bytes of output being the circular `window`
+ * whose oldest byte is at `window + GZ_WINDOW_SIZE - left`
+ * @return zero on success, -1 if the index could not grow
+ */
+static int add_checkpoint(gz_index_t *index, const z_stream *strm, const uint8_t *data, uint64_t out_off,
+                          const uint8_t *window, unsigned int left)
+{
+    if (index->no_checkpoints == index->capacity)
+    {
+        size_t capacity = index->capacity == 0 ? 16 : index->capacity * 2;
+        gz_checkpoint_t *checkpoints = realloc(index->checkpoints, capacity * sizeof(gz_checkpoint_t));
+        if (checkpoints == NULL)
+            return -1;
+        index->checkpoints = checkpoints;
+        uint8_t *windows = realloc(index->windows, capacity * GZ_WINDOW_SIZE);
+        if (windows == NULL)
+            return -1;
+        index->windows = windows;
+        index->capacity = capacity;
+    }
+    gz_checkpoint_t *checkpoint = &index->checkpoints[index->no_checkpoints];
+    checkpoint->in_off = strm->next_in - data;
+    checkpoint->out_off = out_off;
+    checkpoint->bits = strm->data_type & 7;
+    checkpoint->unused = 0;
+    uint8_t *dest = index->windows + index->no_checkpoints * GZ_WINDOW_SIZE;
+    if (left > 0)
+        memcpy(dest, window + GZ_WINDOW_SIZE - left, left);
+    if (left < GZ_WINDOW_SIZE)
+        memcpy(dest + left, window, GZ_WINDOW_SIZE - left);
+    index->no_checkpoints++;
+    return 0;
+}
+
+/**
+ * Feeds zlib the next slice of the compressed data once it consumed the previous one
+ */
+static void feed_input(z_stream *strm, const uint8_t *data, size_t size)
+{
+    if (strm->avail_in > 0)
+        return;
+    size_t left = size - (strm->next_in - data);
+    strm->avail_in = left < GZ_MAX_INPUT ? left : GZ_MAX_INPUT;
+}
+
+/**
+ * Moves to the next member of a multi-member file once the current one ended
+ * @return zero if another member follows, -1 at the end of the file
+ */
+static int next_member(z_stream *strm, const uint8_t *data, size_t size, int raw)
+{
+    size_t pos = strm->next_in - data;
+    if (raw)
+        pos += 8; // the raw inflation stops before the CRC and length trailer of the member
+    if (!is_gzip(data + pos, pos > size ? 0 : size - pos))
+        return -1;
+    strm->next_in = (uint8_t *)data + pos;
+    strm->avail_in = 0;
+    feed_input(strm, data, size);
+    return inflateReset2(strm, 31) == Z_OK ? 0 : -1;
+}
+
+gz_index_t *gz_build_index(const uint8_t *data, size_t size, uint64_t interval, gz_consumer_t consume, void *arg)
+{
+    if (interval == 0)
+        interval = GZ_DEFAULT_INTERVAL;
+    gz_index_t *index = calloc(1, sizeof(gz_index_t));
+    uint8_t *window = calloc(1, GZ_WINDOW_SIZE);
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (index == NULL || window == NULL || inflateInit2(&strm, 31) != Z_OK)
+    {
+        free(window);
+        free(index);
+        return NULL;
+    }
+
+    strm.next_in = (uint8_t *)data;
+    strm.avail_in = 0;
+    uint64_t out_off = 0;
+    uint64_t last = 0;
+    int ret = Z_OK;
+    while (1)
+    {
+        feed_input(&strm, data, size);
+        if (strm.avail_out == 0)
+        {
+            strm.next_out = window;
+            strm.avail_out = GZ_WINDOW_SIZE;
+        }
+        uint8_t *out = strm.next_out;
+        unsigned int before = strm.avail_out;
+        // stop at the end of each deflate block, where checkpoints can be taken
+        ret = inflate(&strm, Z_BLOCK);
+        size_t produced = before - strm.avail_out;
+        if (produced > 0 && consume(arg, out, produced) != 0)
+        {
+            ret = Z_MEM_ERROR;
+            break;
+        }
+        out_off += produced;
+
+        if (ret == Z_STREAM_END)
+        {
+            if (next_member(&strm, data, size, 0) != 0)
+                break;
+            continue;
+        }
+        if (ret != Z_OK)
+            break; // corrupted, or truncated when Z_BUF_ERROR
+        if ((strm.data_type & 128) && !(strm.data_type & 64) && (index->no_checkpoints == 0 || out_off - last >= interval))
+        {
+            if (add_checkpoint(index, &strm, data, out_off, window, strm.avail_out) != 0)
+                break;
+            last = out_off;
+        }
+    }
+    inflateEnd(&strm);
+    free(window);
+    if (ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+    {
+        gz_free_index(index);
+        return NULL;
+    }
+    index->uncompressed_size = out_off;
+    return index;
+}
+
+ssize_t gz_copy(const gz_index_t *index, const uint8_t *data, size_t size, uint64_t offset, uint64_t len,
+                gz_consumer_t consume, void *arg)
+{
+    if (index->no_checkpoints == 0 || offset >= index->uncompressed_size)
+        return 0;
+
+    // last checkpoint at or before the offset
+    size_t low = 0, high = index->no_checkpoints;
+    while (high - low > 1)
+    {
+        size_t mid = (low + high) / 2;
+        if (index->checkpoints[mid].out_off <= offset)
+            low = mid;
+        else
+            high = mid;
+    }
+    const gz_checkpoint_t *checkpoint = &index->checkpoints[low];
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    uint8_t *buffer = malloc(GZ_WINDOW_SIZE);
+    if (buffer == NULL || checkpoint->in_off > size || inflateInit2(&strm, -15) != Z_OK)
+    {
+        free(buffer);
+        return -1;
+    }
+    strm.next_in = (uint8_t *)data + checkpoint->in_off;
+    if (checkpoint->bits > 0)
+        inflatePrime(&strm, checkpoint->bits, data[checkpoint->in_off - 1] >> (8 - checkpoint->bits));
+    inflateSetDictionary(&strm, index->windows + low * GZ_WINDOW_SIZE, GZ_WINDOW_SIZE);
+
+    uint64_t skip = offset - checkpoint->out_off;
+    uint64_t copied = 0;
+    int raw = 1;
+    while (copied < len)
+    {
+        feed_input(&strm, data, size);
+        strm.next_out = buffer;
+        strm.avail_out = GZ_WINDOW_SIZE;
+        int ret = inflate(&strm, Z_NO_FLUSH);
+        size_t produced = GZ_WINDOW_SIZE - strm.avail_out;
+        const uint8_t *out = buffer;
+        size_t discarded = skip < produced ? skip : produced;
+        skip -= discarded;
+        out += discarded;
+        produced -= discarded;
+        if (produced > len - copied)
+            produced = len - copied;
+        if (produced > 0 && consume(arg, out, produced) != 0)
+            break;
+        copied += produced;
+
+        if (ret == Z_STREAM_END)
+        {
+            if (next_member(&strm, data, size, raw) != 0)
+                break;
+            raw = 0;
+        }
+        else if (ret != Z_OK)
+        {
+            break;
+        }
+    }
+    inflateEnd(&strm);
+    free(buffer);
+    return copied;
+}
+
+uint64_t gz_uncompressed_size(const gz_index_t *index)
+{
+    return index->uncompressed_size;
+}
+
+void gz_free_index(gz_index_t *index)
+{
+    if (index == NULL)
+        return;
+    if (index->map != NULL)
+    {
+        munmap(index->map, index->map_size);
+    }
+    else
+    {
+        free(index->checkpoints);
+        free(index->windows);
+    }
+    free(index);
+}
+
+static size_t checkpoints_size(uint64_t no_checkpoints)
+{
+    return no_checkpoints * sizeof(gz_checkpoint_t);
+}
+
+int gz_save_index(const gz_index_t *index, const char *path, const struct stat *statbuf)
+{
+    checkpoint_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.window_size = GZ_WINDOW_SIZE;
+    header.archive_size = statbuf->st_size;
+    header.archive_mtime_sec = statbuf->st_mtim.tv_sec;
+    header.archive_mtime_nsec = statbuf->st_mtim.tv_nsec;
+    header.uncompressed_size = index->uncompressed_size;
+    header.no_checkpoints = index->no_checkpoints;
+
+    // written aside then renamed, so that concurrent openers never map a partial file
+    char tmp_path[strlen(path) + 5];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL)
+        return -1;
+    int failed = fwrite(&header, sizeof(header), 1, out) != 1 ||
+                 fwrite(index->checkpoints, 1, checkpoints_size(index->no_checkpoints), out) !=
+                     checkpoints_size(index->no_checkpoints) ||
+                 fwrite(index->windows, GZ_WINDOW_SIZE, index->no_checkpoints, out) != index->no_checkpoints;
+    if (fclose(out) != 0 || failed || rename(tmp_path, path) != 0)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Checks that the checkpoints of a file can be restarted from, as the file is only a cache
+ * anyone may have written over: each one points into the archive and at a bit of the byte
+ * before it, and they cover the uncompressed archive from its start in ascending order.
+ *
+ * @return non-zero if the checkpoints can be trusted
+ */
+static int checkpoints_valid(const checkpoint_header_t *header, const gz_checkpoint_t *checkpoints)
+{
+    for (uint64_t i = 0; i < header->no_checkpoints; i++)
+    {
+        const gz_checkpoint_t *checkpoint = &checkpoints[i];
+        if (checkpoint->bits > 7 || checkpoint->in_off > header->archive_size ||
+            (checkpoint->bits > 0 && checkpoint->in_off == 0) ||
+            checkpoint->out_off > header->uncompressed_size ||
+            (i == 0 ? checkpoint->out_off != 0 : checkpoint->out_off <= checkpoints[i - 1].out_off))
+            return 0;
+    }
+    return 1;
+}
+
+gz_index_t *gz_load_index(const char *path, const struct stat *statbuf)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    struct stat index_stat;
+    if (fstat(fd, &index_stat) == -1 || index_stat.st_size < (off_t)sizeof(checkpoint_header_t))
+    {
+        close(fd);
+        return NULL;
+    }
+    size_t size = index_stat.st_size;
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const checkpoint_header_t *header = (const checkpoint_header_t *)map;
+    uint64_t no_checkpoints = header->no_checkpoints;
+    int valid = memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) == 0 &&
+                header->version == CHECKPOINT_VERSION &&
+                header->window_size == GZ_WINDOW_SIZE &&
+                header->archive_size == (uint64_t)statbuf->st_size &&
+                header->archive_mtime_sec == statbuf->st_mtim.tv_sec &&
+                header->archive_mtime_nsec == statbuf->st_mtim.tv_nsec &&
+                no_checkpoints < size / GZ_WINDOW_SIZE + 1 &&
+                sizeof(checkpoint_header_t) + checkpoints_size(no_checkpoints) + no_checkpoints * GZ_WINDOW_SIZE == size &&
+                checkpoints_valid(header, (const gz_checkpoint_t *)(map + sizeof(checkpoint_header_t)));
+    gz_index_t *index = valid ? calloc(1, sizeof(gz_index_t)) : NULL;
+    if (index == NULL)
+    {
+        munmap(map, size);
+        return NULL;
+    }
+    index->map = map;
+    index->map_size = size;
+    index->checkpoints = (gz_checkpoint_t *)(map + sizeof(checkpoint_header_t));
+    index->windows = map + sizeof(checkpoint_header_t) + checkpoints_size(no_checkpoints);
+    index->no_checkpoints = no_checkpoints;
+    index->capacity = no_checkpoints;
+    index->uncompressed_size = header->uncompressed_size;
+    return index;
+}
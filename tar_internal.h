@@ -0,0 +1,343 @@
+#ifndef TAR_INTERNAL_H
+#define TAR_INTERNAL_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "lib_tar.h"
+
+/*
+ * Helpers shared between the translation units of the library, not part of its public API.
+ */
+
+/* Header validation and extension headers, see lib_tar.c */
+int checksum(tar_header_t *header);
+int checksum_scalar(tar_header_t *header);
+int validate_header(tar_header_t *header);
+
+/**
+ * @return whether a header failing validate_header() is a GNU one, with a "ustar  " magic and a correct checksum,
+ *         which is read as any other while the archive is reported invalid
+ */
+int is_gnu_header(tar_header_t *header);
+
+/* Fields of the next member overridden by PAX or GNU extension headers, pointing into their payloads */
+typedef struct header_ext
+{
+    const char *path;
+    size_t path_len;
+    const char *linkpath;
+    size_t linkpath_len;
+    uint64_t size;
+    int has_size;
+} header_ext_t;
+
+/*
+ * Payload bytes the extension headers of a member may take in all, as they are held in memory until the member.
+ * Headers past it are skipped unread, the member keeping the fields they would have overridden.
+ */
+#define EXTENSION_MAX_SIZE (1024 * 1024)
+
+/**
+ * @return whether headers of this type are PAX or GNU extension headers, describing the next member
+ */
+int is_extension_type(char typeflag);
+
+/**
+ * Folds an extension header, whose `size` bytes of payload are at `payload`, into the overrides of the next member
+ */
+void apply_extension(const tar_header_t *header, const char *payload, uint64_t size, header_ext_t *ext);
+
+/**
+ * Payload size of a header, once the overrides of preceding extension headers are applied
+ */
+uint64_t member_size(const tar_header_t *header, const header_ext_t *ext);
+
+/* Queries on the index for the other translation units, see lib_tar.c */
+
+/**
+ * Finds the regular file at `path`, following symlinks and hard links
+ * @return zero and the offset of its payload in the archive and its size, or -1 if there is no such file
+ */
+int archive_locate_file(const tar_archive_t *tar, const char *path, uint64_t *offset, uint64_t *size);
+
+/**
+ * @return the file descriptor the archive was opened from, or -1 for archives in memory
+ */
+int archive_fd(const tar_archive_t *tar);
+
+/**
+ * Copies `len` bytes of the archive from `offset`, decompressing them for compressed archives.
+ * Offsets are always offsets in the decompressed archive.
+ *
+ * @return zero on success, -1 if the archive ends before or its compressed data is corrupted
+ */
+int archive_read(const tar_archive_t *tar, uint64_t offset, void *dest, size_t len);
+
+/**
+ * @return whether the archive is compressed, its offsets being offsets in the decompressed archive
+ */
+int archive_is_compressed(const tar_archive_t *tar);
+
+/* Sources of the bytes of an archive, selected by tar_options_t.backend, see tar_backend.c */
+
+/* Reads of at least this many bytes have the pages they cover or follow fetched ahead */
+#define READ_WILLNEED_MIN (64 * 1024)
+
+typedef struct backend backend_t;
+
+typedef struct backend_ops
+{
+    /* Makes the `size` bytes of the archive available, setting `data` when they are addressable, zero on success */
+    int (*open)(backend_t *backend, const tar_options_t *options);
+    /* Copies `len` bytes from `offset`, zero on success, -1 past the end of the archive or on I/O error */
+    int (*read)(const backend_t *backend, uint64_t offset, void *dest, size_t len);
+    /* Same as read, scattering the bytes from `offset` over `count` buffers in order */
+    int (*readv)(const backend_t *backend, uint64_t offset, const struct iovec *iov, int count);
+    /* Makes the archive, grown to `size` bytes, available whole again, zero on success */
+    int (*resize)(backend_t *backend, uint64_t size);
+    /* Applies a MADV_* advice to `len` bytes from `offset`, best effort */
+    void (*advise)(const backend_t *backend, uint64_t offset, uint64_t len, int advice);
+    void (*close)(backend_t *backend);
+} backend_ops_t;
+
+struct backend
+{
+    const backend_ops_t *ops;
+    int fd;               /* -1 for archives in memory */
+    uint64_t size;
+    const uint8_t *data;  /* whole archive, NULL when it is read with pread(2) */
+    size_t readahead;     /* bytes fetched past the large reads of the pread backend */
+};
+
+extern const backend_ops_t mmap_backend;
+extern const backend_ops_t pread_backend;
+extern const backend_ops_t memory_backend;
+
+/* Mappings of the archive, see tar_map.c */
+
+/**
+ * Maps a whole archive read-only, populating it and asking for huge pages as `flags` tells
+ * @return the mapping, or NULL on error
+ */
+uint8_t *map_archive(int fd, size_t size, int flags);
+
+/**
+ * Applies a madvise(2) advice to the pages holding `len` bytes from `offset` in a mapping, best effort
+ */
+void map_advise(const uint8_t *map, size_t map_size, uint64_t offset, uint64_t len, int advice);
+
+/* A mapping of at most `size` bytes of the archive, slid along the archive as it is walked */
+typedef struct map_window
+{
+    int fd;
+    uint64_t file_size;
+    size_t size;
+    int buffered;    /* read with pread(2) into a buffer at base rather than mapped */
+    uint8_t *base;   /* NULL when nothing is mapped */
+    uint64_t start;  /* offset of base in the archive, page-aligned */
+    size_t len;
+    size_t capacity; /* bytes allocated at base when buffered */
+    uint64_t no_maps; /* mmap(2) calls made to move the window, and the time they took */
+    uint64_t map_ns;
+} map_window_t;
+
+/**
+ * Makes `len` bytes from `offset` in the archive available, moving the window if they are not in it.
+ * Pointers returned before are invalidated when the window moves.
+ *
+ * @return the bytes, or NULL if they are past the end of the archive or could not be mapped
+ */
+const uint8_t *window_at(map_window_t *window, uint64_t offset, size_t len);
+
+/**
+ * Unmaps the window, or frees its buffer
+ */
+void window_release(map_window_t *window);
+
+/* Counters of tar_stats_get(), see tar_stats.c. The macros compile to nothing without TAR_STATS */
+
+typedef struct stats stats_t;
+
+typedef enum stats_counter
+{
+    STAT_HEADERS,
+    STAT_VALIDATE_NS,
+    STAT_MAPS,
+    STAT_MAP_NS,
+    STAT_PROBES,
+    STAT_NAME_COMPARES,
+    STAT_BYTES_COPIED,
+    STAT_CACHE_HITS,
+    STAT_CACHE_MISSES,
+    STAT_COUNTERS
+} stats_counter_t;
+
+#ifdef TAR_STATS
+
+/**
+ * @return the counters of a handle, or NULL if they could not be allocated
+ */
+stats_t *stats_create(void);
+
+void stats_free(stats_t *stats);
+
+/**
+ * @return the counters of the handle, see lib_tar.c
+ */
+stats_t *archive_stats(const tar_archive_t *tar);
+
+/**
+ * @return a monotonic time in nanoseconds
+ */
+uint64_t stats_now(void);
+
+void stats_add(stats_t *stats, stats_counter_t counter, uint64_t n);
+
+/**
+ * Counts a call of `op` that took `ns` nanoseconds
+ */
+void stats_record(stats_t *stats, tar_stats_op_t op, uint64_t ns);
+
+#define STATS_ADD(tar, counter, n) stats_add(archive_stats(tar), counter, n)
+#define STATS_START(start) uint64_t start = stats_now()
+#define STATS_SINCE(tar, counter, start) stats_add(archive_stats(tar), counter, stats_now() - (start))
+#define STATS_OP(tar, op, start) stats_record(archive_stats(tar), op, stats_now() - (start))
+
+#else
+
+#define STATS_ADD(tar, counter, n) ((void)0)
+#define STATS_START(start) ((void)0)
+#define STATS_SINCE(tar, counter, start) ((void)0)
+#define STATS_OP(tar, op, start) ((void)0)
+
+#endif
+
+/* Chunks of payloads kept in memory for archives not read straight from a mapping, see tar_cache.c */
+
+typedef struct block_cache block_cache_t;
+
+/**
+ * Creates a cache of `chunk_size` chunks, zero for 256 KiB, clamped between 64 KiB and 1 MiB,
+ * its chunks and bookkeeping taking at most `budget` bytes
+ * @return the cache, or NULL if the budget does not fit a single chunk or memory ran out
+ */
+block_cache_t *cache_create(uint64_t budget, size_t chunk_size);
+
+void cache_free(block_cache_t *cache);
+
+/**
+ * Copies `len` bytes from `offset` in the payload of the entry at index `entry`, whose `size` bytes start at
+ * `data_off` in the archive, through the chunks of the cache. Chunks missing are read with archive_read(),
+ * evicting the least recently used ones that no thread is copying. Reads longer than a quarter of the cache go
+ * straight to archive_read(), leaving its chunks in place. Safe to call from several threads.
+ *
+ * @return zero on success, -1 if the archive could not be read
+ */
+int cache_read(block_cache_t *cache, const tar_archive_t *tar, uint32_t entry, uint64_t data_off, uint64_t size,
+               uint64_t offset, void *dest, size_t len);
+
+/* Random access to gzip-compressed archives through a checkpoint index, see tar_gzip.c */
+
+typedef struct gz_index gz_index_t;
+
+/* Receives decompressed bytes in order, returns zero to go on */
+typedef int (*gz_consumer_t)(void *arg, const uint8_t *data, size_t len);
+
+/**
+ * @return whether `data` starts with the gzip magic bytes
+ */
+int is_gzip(const uint8_t *data, size_t size);
+
+/**
+ * Inflates a whole gzip file, possibly made of several members, handing the decompressed bytes to `consume`.
+ * A checkpoint is recorded every `interval` decompressed bytes, zero for the default of 1 MiB.
+ * A truncated file yields the checkpoints of what could be decompressed.
+ *
+ * @return the checkpoint index, or NULL if the data is corrupted, memory ran out or `consume` stopped the inflation.
+ */
+gz_index_t *gz_build_index(const uint8_t *data, size_t size, uint64_t interval, gz_consumer_t consume, void *arg);
+
+/**
+ * Decompresses `len` bytes from `offset` in the decompressed archive, starting from the closest checkpoint.
+ * Safe to call from several threads on the same index.
+ *
+ * @return the number of bytes handed to `consume`, fewer than `len` if the archive ends or `consume` stopped,
+ *         or -1 if memory ran out.
+ */
+ssize_t gz_copy(const gz_index_t *index, const uint8_t *data, size_t size, uint64_t offset, uint64_t len,
+                gz_consumer_t consume, void *arg);
+
+uint64_t gz_uncompressed_size(const gz_index_t *index);
+
+/**
+ * Writes a checkpoint index to `path`, tagged with the size and modification time of the compressed archive
+ * @return zero on success, -1 otherwise
+ */
+int gz_save_index(const gz_index_t *index, const char *path, const struct stat *statbuf);
+
+/**
+ * Maps the checkpoint index written to `path` if it was recorded from the current version of the archive
+ * @return the index, or NULL if the file is missing, stale or invalid
+ */
+gz_index_t *gz_load_index(const char *path, const struct stat *statbuf);
+
+void gz_free_index(gz_index_t *index);
+
+/* Extraction of entries below a destination directory, see tar_extract.c.
+ * Paths are resolved one component at a time without following symlinks, so that an entry cannot be written
+ * through a symlink extracted before it or already on disk, and fail with ELOOP or ENOTDIR if they would be */
+
+/**
+ * Turns an entry path into a path relative to the destination directory.
+ * Leading '/' are stripped.
+ *
+ * @return the relative path, or NULL if the path is empty or has a ".." component
+ */
+const char *extract_relative_path(const char *name);
+
+/**
+ * Creates the directory `path` and the missing directories leading to it, or keeps it if it already exists
+ * @return zero on success, -1 otherwise
+ */
+int extract_directory(int dir_fd, const char *path, mode_t mode);
+
+/**
+ * Creates the regular file `path`, replacing any existing entry
+ * @return a file descriptor open for writing on the file, or -1 on error
+ */
+int extract_open_file(int dir_fd, const char *path, mode_t mode);
+
+/**
+ * Creates the symlink `path` pointing to `target`, replacing any existing entry
+ * @return zero on success, -1 otherwise
+ */
+int extract_symlink(int dir_fd, const char *path, const char *target);
+
+/**
+ * Creates the hard link `path` to the already extracted entry `target`, itself resolved below `dir_fd`
+ * @return zero on success, -1 otherwise
+ */
+int extract_hardlink(int dir_fd, const char *path, const char *target);
+
+/**
+ * Writes the `size` bytes of payload found at `offset` in the archive to the start of `fd`, letting the kernel
+ * copy them between the files when it can and writing them from `data`, the same bytes mapped, otherwise,
+ * or reading them from `tar_fd` when `data` is NULL
+ * @return zero on success, -1 otherwise
+ */
+int extract_payload(int fd, int tar_fd, uint64_t offset, const uint8_t *data, uint64_t size);
+
+/**
+ * Gives the directory `path`, created by extract_directory(), the permissions of `mode` it was created
+ * without and its modification time
+ */
+void extract_finish_directory(int dir_fd, const char *path, mode_t mode, time_t mtime);
+
+/**
+ * Sets the modification time of `path` (of the link itself for symlinks), the access time
+ * becoming the current time
+ */
+void extract_mtime(int dir_fd, const char *path, time_t mtime);
+
+#endif
@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+#include "tar_internal.h"
+#include <errno.h>
+#include <sys/mman.h>
+
+static uint64_t page_size(void)
+{
+    return sysconf(_SC_PAGESIZE);
+}
+
+uint8_t *map_archive(int fd, size_t size, int flags)
+{
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_SHARED | (flags & TAR_MAP_POPULATE ? MAP_POPULATE : 0), fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    // only honored by kernels able to back read-only file mappings with huge pages
+    if (flags & TAR_MAP_HUGEPAGES)
+        madvise(map, size, MADV_HUGEPAGE);
+#endif
+    return map;
+}
+
+void map_advise(const uint8_t *map, size_t map_size, uint64_t offset, uint64_t len, int advice)
+{
+    if (map == NULL || offset >= map_size)
+        return;
+    if (len > map_size - offset)
+        len = map_size - offset;
+    uint64_t start = offset & ~(page_size() - 1);
+    madvise((void *)(map + start), offset - start + len, advice);
+}
+
+/**
+ * Fills the buffer of a buffered window with `len` bytes from `start`
+ * @return zero on success, -1 if they could not be read
+ */
+static int window_fill(map_window_t *window, uint64_t start, size_t len)
+{
+    if (len > window->capacity)
+    {
+        uint8_t *base = realloc(window->base, len);
+        if (base == NULL)
+            return -1;
+        window->base = base;
+        window->capacity = len;
+    }
+    window->len = 0; // nothing valid until the read completes
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t got = pread(window->fd, window->base + done, len - done, start + done);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        done += got;
+    }
+    window->start = start;
+    window->len = len;
+    return 0;
+}
+
+const uint8_t *window_at(map_window_t *window, uint64_t offset, size_t len)
+{
+    if (offset > window->file_size || len > window->file_size - offset)
+        return NULL;
+    if (window->base != NULL && offset >= window->start && offset + len <= window->start + window->len)
+        return window->base + (offset - window->start);
+
+    uint64_t start = offset & ~(page_size() - 1);
+    size_t map_len = window->size;
+    if (offset - start + len > map_len)
+        map_len = offset - start + len; // a single range larger than the window is mapped whole
+    if (map_len > window->file_size - start)
+        map_len = window->file_size - start;
+    if (window->buffered)
+        return window_fill(window, start, map_len) == 0 ? window->base + (offset - start) : NULL;
+
+    window_release(window);
+    STATS_START(started);
+    uint8_t *base = mmap(NULL, map_len, PROT_READ, MAP_SHARED, window->fd, start);
+#ifdef TAR_STATS
+    window->map_ns += stats_now() - started;
+#endif
+    if (base == MAP_FAILED)
+        return NULL;
+    window->no_maps++;
+    madvise(base, map_len, MADV_SEQUENTIAL);
+    window->base = base;
+    window->start = start;
+    window->len = map_len;
+    return base + (offset - start);
+}
+
+void window_release(map_window_t *window)
+{
+    if (window->buffered)
+        free(window->base);
+    else if (window->base != NULL)
+        munmap(window->base, window->len);
+    window->base = NULL;
+    window->capacity = 0;
+}
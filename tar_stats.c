@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include "tar_internal.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#ifdef TAR_STATS
+
+/* threads update the shard their id falls in, so that they rarely share cache lines */
+#define STATS_SHARDS 64
+
+typedef struct stats_shard
+{
+    uint64_t counters[STAT_COUNTERS];
+    tar_op_stats_t ops[TAR_STATS_OPS];
+} __attribute__((aligned(64))) stats_shard_t;
+
+struct stats
+{
+    stats_shard_t shards[STATS_SHARDS];
+    struct rusage opened; /* usage of the process when the handle was opened */
+};
+
+static unsigned int next_thread_id;
+static __thread unsigned int thread_id; /* zero until the thread first updates counters */
+
+static stats_shard_t *thread_shard(stats_t *stats)
+{
+    if (thread_id == 0)
+        thread_id = __atomic_add_fetch(&next_thread_id, 1, __ATOMIC_RELAXED);
+    return &stats->shards[(thread_id - 1) % STATS_SHARDS];
+}
+
+stats_t *stats_create(void)
+{
+    stats_t *stats = calloc(1, sizeof(stats_t));
+    if (stats != NULL)
+        getrusage(RUSAGE_SELF, &stats->opened);
+    return stats;
+}
+
+void stats_free(stats_t *stats)
+{
+    free(stats);
+}
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_add(stats_t *stats, stats_counter_t counter, uint64_t n)
+{
+    if (stats != NULL)
+        __atomic_fetch_add(&thread_shard(stats)->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void stats_record(stats_t *stats, tar_stats_op_t op, uint64_t ns)
+{
+    if (stats == NULL)
+        return;
+    tar_op_stats_t *op_stats = &thread_shard(stats)->ops[op];
+    int bucket = 63 - __builtin_clzll(ns | 1);
+    if (bucket >= TAR_STATS_BUCKETS)
+        bucket = TAR_STATS_BUCKETS - 1;
+    __atomic_fetch_add(&op_stats->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&op_stats->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&op_stats->histogram[bucket], 1, __ATOMIC_RELAXED);
+}
+
+int tar_stats_get(const tar_archive_t *tar, tar_stats_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    const stats_t *stats = archive_stats(tar);
+    if (stats == NULL)
+        return -1;
+    uint64_t counters[STAT_COUNTERS] = {0};
+    for (size_t s = 0; s < STATS_SHARDS; s++)
+    {
+        const stats_shard_t *shard = &stats->shards[s];
+        for (size_t c = 0; c < STAT_COUNTERS; c++)
+            counters[c] += __atomic_load_n(&shard->counters[c], __ATOMIC_RELAXED);
+        for (size_t op = 0; op < TAR_STATS_OPS; op++)
+        {
+            out->ops[op].calls += __atomic_load_n(&shard->ops[op].calls, __ATOMIC_RELAXED);
+            out->ops[op].total_ns += __atomic_load_n(&shard->ops[op].total_ns, __ATOMIC_RELAXED);
+            for (size_t b = 0; b < TAR_STATS_BUCKETS; b++)
+                out->ops[op].histogram[b] += __atomic_load_n(&shard->ops[op].histogram[b], __ATOMIC_RELAXED);
+        }
+    }
+    out->headers_scanned = counters[STAT_HEADERS];
+    out->validate_ns = counters[STAT_VALIDATE_NS];
+    out->maps = counters[STAT_MAPS];
+    out->map_ns = counters[STAT_MAP_NS];
+    out->probes = counters[STAT_PROBES];
+    out->name_compares = counters[STAT_NAME_COMPARES];
+    out->bytes_copied = counters[STAT_BYTES_COPIED];
+    out->cache_hits = counters[STAT_CACHE_HITS];
+    out->cache_misses = counters[STAT_CACHE_MISSES];
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    out->minor_faults = usage.ru_minflt - stats->opened.ru_minflt;
+    out->major_faults = usage.ru_majflt - stats->opened.ru_majflt;
+    return 0;
+}
+
+#else
+
+int tar_stats_get(const tar_archive_t *tar, tar_stats_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    return -1;
+}
+
+#endif
+
+/**
+ * Upper bound of the histogram bucket holding the call at `rank`, from zero, in the order of latencies
+ */
+static uint64_t percentile_ns(const tar_op_stats_t *op, uint64_t rank)
+{
+    uint64_t seen = 0;
+    for (int b = 0; b < TAR_STATS_BUCKETS; b++)
+    {
+        seen += op->histogram[b];
+        if (seen > rank)
+            return (2ULL << b) - 1;
+    }
+    return 0;
+}
+
+/**
+ * Rank, from zero, of the `percent`th percentile of `calls` latencies by the nearest-rank method,
+ * that is ceil(calls * percent / 100) - 1
+ */
+static uint64_t nearest_rank(uint64_t calls, uint64_t percent)
+{
+    return (calls * percent + 99) / 100 - 1;
+}
+
+int tar_stats_dump(const tar_archive_t *tar, int fd)
+{
+    tar_stats_t stats;
+    if (tar_stats_get(tar, &stats) != 0)
+        return -1;
+    static const char *names[TAR_STATS_OPS] = {"check", "list", "read"};
+    for (int op = 0; op < TAR_STATS_OPS; op++)
+    {
+        const tar_op_stats_t *op_stats = &stats.ops[op];
+        uint64_t calls = op_stats->calls;
+        dprintf(fd, "%-5s %12llu calls, mean %9.0f ns, p50 < %9llu ns, p99 < %9llu ns\n", names[op],
+                (unsigned long long)calls, calls > 0 ? (double)op_stats->total_ns / calls : 0.0,
+                calls > 0 ? (unsigned long long)percentile_ns(op_stats, nearest_rank(calls, 50)) : 0ULL,
+                calls > 0 ? (unsigned long long)percentile_ns(op_stats, nearest_rank(calls, 99)) : 0ULL);
+    }
+    dprintf(fd, "headers scanned %llu in %llu ns of validation\n", (unsigned long long)stats.headers_scanned,
+            (unsigned long long)stats.validate_ns);
+    dprintf(fd, "mappings %llu in %llu ns\n", (unsigned long long)stats.maps, (unsigned long long)stats.map_ns);
+    dprintf(fd, "index probes %llu, name comparisons %llu\n", (unsigned long long)stats.probes,
+            (unsigned long long)stats.name_compares);
+    dprintf(fd, "bytes copied %llu\n", (unsigned long long)stats.bytes_copied);
+    dprintf(fd, "cache chunks hit %llu, missed %llu\n", (unsigned long long)stats.cache_hits,
+            (unsigned long long)stats.cache_misses);
+    dprintf(fd, "page faults since opened %ld minor, %ld major\n", stats.minor_faults, stats.major_faults);
+    return 0;
+}
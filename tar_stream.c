@@ -0,0 +1,440 @@
+#include "tar_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define STREAM_DEFAULT_BUFFER (64 * 1024)
+
+struct tar_stream
+{
+    int fd;
+    int seekable;          /* whether payloads can be skipped with lseek() */
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t start;          /* unconsumed bytes are buffer[start..end[ */
+    size_t end;
+    int eof;
+    uint64_t remaining;    /* payload bytes of the current entry not read yet */
+    uint64_t padding;      /* bytes padding the current payload to a block boundary */
+    int headers;           /* non-null headers read, extension headers included */
+    int error;             /* validation error of the first GNU header read, which are read still */
+    header_ext_t ext;      /* overrides of the next member by the extension headers read before it */
+    char **kept;           /* payloads of these extension headers, `ext` pointing into them */
+    size_t no_kept;
+    uint64_t kept_size;    /* bytes of these payloads, at most EXTENSION_MAX_SIZE */
+    char name[sizeof(((tar_header_t *)0)->prefix) + 1 + sizeof(((tar_header_t *)0)->name) + 1];
+    char linkname[sizeof(((tar_header_t *)0)->linkname) + 1];
+};
+
+tar_stream_t *tar_stream_open(int tar_fd, size_t buffer_size)
+{
+    if (buffer_size == 0)
+        buffer_size = STREAM_DEFAULT_BUFFER;
+    buffer_size = (buffer_size + BLK_SIZE - 1) / BLK_SIZE * BLK_SIZE;
+
+    tar_stream_t *stream = calloc(1, sizeof(tar_stream_t));
+    if (stream == NULL)
+        return NULL;
+    stream->buffer = malloc(buffer_size);
+    if (stream->buffer == NULL)
+    {
+        free(stream);
+        return NULL;
+    }
+    stream->buffer_size = buffer_size;
+    stream->fd = tar_fd;
+
+    struct stat statbuf;
+    stream->seekable = fstat(tar_fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode);
+    return stream;
+}
+
+/**
+ * Frees the payloads of the extension headers of the entry left, and their overrides
+ */
+static void release_kept(tar_stream_t *stream)
+{
+    for (size_t i = 0; i < stream->no_kept; i++)
+        free(stream->kept[i]);
+    stream->no_kept = 0;
+    stream->kept_size = 0;
+    memset(&stream->ext, 0, sizeof(stream->ext));
+}
+
+void tar_stream_close(tar_stream_t *stream)
+{
+    if (stream == NULL)
+        return;
+    release_kept(stream);
+    free(stream->kept);
+    free(stream->buffer);
+    free(stream);
+}
+
+/**
+ * Reads from the file descriptor until at least `need` bytes are buffered or the end of the file is reached
+ * @return the number of buffered bytes, or -1 on read error
+ */
+static ssize_t fill(tar_stream_t *stream, size_t need)
+{
+    if (stream->end - stream->start >= need || stream->eof)
+        return stream->end - stream->start;
+    if (stream->start + need > stream->buffer_size)
+    {
+        memmove(stream->buffer, stream->buffer + stream->start, stream->end - stream->start);
+        stream->end -= stream->start;
+        stream->start = 0;
+    }
+    while (stream->end - stream->start < need)
+    {
+        ssize_t got = read(stream->fd, stream->buffer + stream->end, stream->buffer_size - stream->end);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1)
+            return -1;
+        if (got == 0)
+        {
+            stream->eof = 1;
+            break;
+        }
+        stream->end += got;
+    }
+    return stream->end - stream->start;
+}
+
+/**
+ * Discards `len` bytes of the archive
+ * @return zero on success, -1 on read error or if the archive ends before
+ */
+static int skip(tar_stream_t *stream, uint64_t len)
+{
+    size_t buffered = stream->end - stream->start;
+    if (len <= buffered)
+    {
+        stream->start += len;
+        return 0;
+    }
+    len -= buffered;
+    stream->start = stream->end = 0;
+    if (stream->seekable && lseek(stream->fd, len, SEEK_CUR) != -1)
+        return 0;
+
+    while (len > 0)
+    {
+        ssize_t got = fill(stream, 1);
+        if (got <= 0)
+            return -1;
+        size_t discarded = (uint64_t)got < len ? (size_t)got : len;
+        stream->start += discarded;
+        len -= discarded;
+    }
+    return 0;
+}
+
+/**
+ * Copies the next `len` bytes of the archive to `dest`
+ * @return zero on success, -1 on read error or if the archive ends before
+ */
+static int read_exact(tar_stream_t *stream, char *dest, uint64_t len)
+{
+    while (len > 0)
+    {
+        ssize_t got = fill(stream, 1);
+        if (got <= 0)
+            return -1;
+        size_t copied = (uint64_t)got < len ? (size_t)got : len;
+        memcpy(dest, stream->buffer + stream->start, copied);
+        stream->start += copied;
+        dest += copied;
+        len -= copied;
+    }
+    return 0;
+}
+
+/**
+ * Reads the payload of an extension header and folds it into the overrides of the next member,
+ * or skips it past EXTENSION_MAX_SIZE
+ * @return zero on success, -1 on read error or if memory ran out
+ */
+static int read_extension(tar_stream_t *stream, const tar_header_t *header, uint64_t size)
+{
+    uint64_t padding = (BLK_SIZE - size % BLK_SIZE) % BLK_SIZE;
+    if (size > EXTENSION_MAX_SIZE - stream->kept_size)
+        return skip(stream, size + padding);
+    tar_header_t copy = *header; // the buffer holding the header moves as the payload is read
+    char **kept = realloc(stream->kept, (stream->no_kept + 1) * sizeof(char *));
+    if (kept == NULL)
+        return -1;
+    stream->kept = kept;
+    char *payload = malloc(size + 1);
+    if (payload == NULL)
+        return -1;
+    kept[stream->no_kept++] = payload;
+    stream->kept_size += size;
+    if (read_exact(stream, payload, size) != 0 || skip(stream, padding) != 0)
+        return -1;
+    payload[size] = '\0';
+    apply_extension(&copy, payload, size, &stream->ext);
+    return 0;
+}
+
+/**
+ * Copies a NUL or field-length terminated header field
+ */
+static size_t copy_field(char *dest, const char *field, size_t field_len)
+{
+    size_t len = strnlen(field, field_len);
+    memcpy(dest, field, len);
+    dest[len] = '\0';
+    return len;
+}
+
+int tar_next_entry(tar_stream_t *stream, tar_entry_info_t *info)
+{
+    if (skip(stream, stream->remaining + stream->padding) != 0)
+        return -4;
+    stream->remaining = stream->padding = 0;
+    release_kept(stream);
+
+    while (1)
+    {
+        ssize_t got = fill(stream, BLK_SIZE);
+        if (got == -1)
+            return -4;
+        if (got < BLK_SIZE)
+            return 0; // a trailing partial block is not part of the archive
+
+        tar_header_t *header = (tar_header_t *)(stream->buffer + stream->start);
+        stream->start += BLK_SIZE;
+        if (header->name[0] == '\0')
+            continue;
+        int ret = validate_header(header);
+        if (ret != 0 && !is_gnu_header(header))
+            return ret;
+        if (ret != 0 && stream->error == 0)
+            stream->error = ret;
+        stream->headers++;
+        uint64_t size = member_size(header, &stream->ext);
+        if (is_extension_type(header->typeflag))
+        {
+            if (read_extension(stream, header, size) != 0)
+                return -4;
+            continue;
+        }
+
+        size_t prefix_len = copy_field(stream->name, header->prefix, sizeof(header->prefix));
+        if (prefix_len > 0)
+            stream->name[prefix_len++] = '/';
+        copy_field(stream->name + prefix_len, header->name, sizeof(header->name));
+        copy_field(stream->linkname, header->linkname, sizeof(header->linkname));
+
+        // the payloads are copies of the stream's own, a value being followed by its '\n' or the NUL added after them
+        info->name = stream->name;
+        info->linkname = stream->linkname;
+        if (stream->ext.path != NULL)
+        {
+            ((char *)stream->ext.path)[stream->ext.path_len] = '\0';
+            info->name = stream->ext.path;
+        }
+        if (stream->ext.linkpath != NULL)
+        {
+            ((char *)stream->ext.linkpath)[stream->ext.linkpath_len] = '\0';
+            info->linkname = stream->ext.linkpath;
+        }
+        info->size = size;
+        info->mode = TAR_INT(header->mode);
+        info->mtime = TAR_INT(header->mtime);
+        info->typeflag = header->typeflag;
+
+        stream->remaining = info->size;
+        stream->padding = (BLK_SIZE - info->size % BLK_SIZE) % BLK_SIZE;
+        return 1;
+    }
+}
+
+ssize_t tar_read_data(tar_stream_t *stream, void *dest, size_t len)
+{
+    if (len > stream->remaining)
+        len = stream->remaining;
+    if (len == 0)
+        return 0;
+
+    size_t buffered = stream->end - stream->start;
+    if (buffered == 0 && len >= stream->buffer_size)
+    {
+        // large reads go straight to the caller's buffer
+        ssize_t got;
+        do
+            got = read(stream->fd, dest, len);
+        while (got == -1 && errno == EINTR);
+        if (got <= 0)
+            return -1;
+        stream->remaining -= got;
+        return got;
+    }
+
+    ssize_t got = fill(stream, 1);
+    if (got <= 0)
+        return -1;
+    if (len > (size_t)got)
+        len = got;
+    memcpy(dest, stream->buffer + stream->start, len);
+    stream->start += len;
+    stream->remaining -= len;
+    return len;
+}
+
+int tar_stream_check(int tar_fd)
+{
+    tar_stream_t *stream = tar_stream_open(tar_fd, 0);
+    if (stream == NULL)
+        return -1;
+    tar_entry_info_t info;
+    int ret;
+    while ((ret = tar_next_entry(stream, &info)) == 1)
+        ;
+    // extension headers count, as for check_archive(), although they are folded into the entries they describe
+    int header_amount = stream->headers;
+    int error = stream->error;
+    tar_stream_close(stream);
+    if (ret == -4)
+        return -1;
+    if (error != 0)
+        return error;
+    return ret < 0 ? ret : header_amount;
+}
+
+/**
+ * Writes the rest of the current payload of `stream` to `fd`
+ * @return zero on success, -1 otherwise
+ */
+static int copy_payload(tar_stream_t *stream, int fd)
+{
+    while (stream->remaining > 0)
+    {
+        ssize_t got = fill(stream, 1);
+        if (got <= 0)
+            return -1;
+        size_t len = (uint64_t)got < stream->remaining ? (size_t)got : stream->remaining;
+        size_t written = 0;
+        while (written < len)
+        {
+            ssize_t ret = write(fd, stream->buffer + stream->start + written, len - written);
+            if (ret == -1 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return -1;
+            written += ret;
+        }
+        stream->start += len;
+        stream->remaining -= len;
+    }
+    return 0;
+}
+
+/* A directory extracted by tar_stream_extract(), given its mode and time once its children are written */
+typedef struct extracted_dir
+{
+    char *path;
+    mode_t mode;
+    time_t mtime;
+} extracted_dir_t;
+
+/**
+ * Remembers a directory to finish, growing `*dirs` as needed
+ * @return zero on success, -1 if memory ran out
+ */
+static int remember_dir(extracted_dir_t **dirs, size_t *no_dirs, size_t *capacity, const char *path,
+                        const tar_entry_info_t *info)
+{
+    if (*no_dirs == *capacity)
+    {
+        size_t grown_capacity = *capacity > 0 ? *capacity * 2 : 16;
+        extracted_dir_t *grown = realloc(*dirs, grown_capacity * sizeof(extracted_dir_t));
+        if (grown == NULL)
+            return -1;
+        *dirs = grown;
+        *capacity = grown_capacity;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL)
+        return -1;
+    (*dirs)[(*no_dirs)++] = (extracted_dir_t){.path = copy, .mode = info->mode, .mtime = info->mtime};
+    return 0;
+}
+
+int tar_stream_extract(int tar_fd, const char *dest_dir)
+{
+    if (mkdir(dest_dir, 0777) == -1 && errno != EEXIST)
+        return -4;
+    int dir_fd = open(dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+        return -4;
+    tar_stream_t *stream = tar_stream_open(tar_fd, 0);
+    if (stream == NULL)
+    {
+        close(dir_fd);
+        return -4;
+    }
+
+    tar_entry_info_t info;
+    extracted_dir_t *dirs = NULL;
+    size_t no_dirs = 0, dirs_capacity = 0;
+    int extracted = 0;
+    int ret;
+    while ((ret = tar_next_entry(stream, &info)) == 1)
+    {
+        const char *path = extract_relative_path(info.name);
+        if (path == NULL)
+            continue;
+
+        int err = 0;
+        switch (info.typeflag)
+        {
+        case REGTYPE:
+        case AREGTYPE:
+        {
+            int fd = extract_open_file(dir_fd, path, info.mode);
+            err = fd == -1 || copy_payload(stream, fd) != 0;
+            if (fd != -1 && close(fd) != 0)
+                err = 1;
+            break;
+        }
+        case DIRTYPE:
+            err = extract_directory(dir_fd, path, info.mode) != 0 ||
+                  remember_dir(&dirs, &no_dirs, &dirs_capacity, path, &info) != 0;
+            break;
+        case SYMTYPE:
+            err = extract_symlink(dir_fd, path, info.linkname) != 0;
+            break;
+        case LNKTYPE:
+            err = extract_hardlink(dir_fd, path, info.linkname) != 0;
+            break;
+        default:
+            continue; // devices and fifos are not extracted
+        }
+        if (err)
+        {
+            ret = -4;
+            break;
+        }
+        if (info.typeflag != DIRTYPE)
+            extract_mtime(dir_fd, path, info.mtime);
+        extracted++;
+    }
+
+    // directories were created writable and their children changed their times, fix both once all is written
+    for (size_t i = 0; i < no_dirs; i++)
+    {
+        if (ret != -4)
+            extract_finish_directory(dir_fd, dirs[i].path, dirs[i].mode, dirs[i].mtime);
+        free(dirs[i].path);
+    }
+    free(dirs);
+    if (ret == 0 && stream->error != 0)
+        ret = stream->error;
+    tar_stream_close(stream);
+    close(dir_fd);
+    return ret < 0 ? ret : extracted;
+}
@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include "tar_internal.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* headers and small payloads are gathered in a buffer of this size before being written at once */
+#define WRITER_BUFFER_SIZE (1024 * 1024)
+
+/* payloads at least this large are written straight from the caller's memory or file, next to the buffer */
+#define WRITER_DIRECT_PAYLOAD (64 * 1024)
+
+/* largest value an 11-digit octal field holds, larger sizes need a PAX size record */
+#define USTAR_MAX_OCTAL 077777777777ULL
+
+struct tar_writer
+{
+    int fd;
+    uint8_t *buffer;
+    size_t buffered;
+    int failed; /* set once a write failed, the archive is then left as is */
+};
+
+/**
+ * Writes all the bytes of `iov`, updating it as it goes
+ * @return zero on success, -1 otherwise
+ */
+static int write_vector(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        while (count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes the buffered bytes, followed by `len` bytes of `data` if not NULL and the zeros padding them to a block
+ * @return zero on success, -1 otherwise
+ */
+static int flush(tar_writer_t *writer, const void *data, size_t len)
+{
+    static const uint8_t zeros[BLK_SIZE];
+    struct iovec iov[3] = {
+        {writer->buffer, writer->buffered},
+        {(void *)data, data != NULL ? len : 0},
+        {(void *)zeros, data != NULL ? (BLK_SIZE - len % BLK_SIZE) % BLK_SIZE : 0},
+    };
+    int ret = write_vector(writer->fd, iov, 3);
+    writer->buffered = 0;
+    if (ret != 0)
+        writer->failed = 1;
+    return ret;
+}
+
+/**
+ * Reserves `len` bytes, zeroed, at the end of the buffer, flushing it first when they do not fit
+ * @return the reserved bytes, or NULL if the flush failed
+ */
+static uint8_t *reserve(tar_writer_t *writer, size_t len)
+{
+    if (writer->buffered + len > WRITER_BUFFER_SIZE && flush(writer, NULL, 0) != 0)
+        return NULL;
+    uint8_t *dest = writer->buffer + writer->buffered;
+    memset(dest, 0, len);
+    writer->buffered += len;
+    return dest;
+}
+
+/**
+ * Splits `path` into the prefix and name fields of a ustar header
+ * @return zero if it fits, -1 if the path needs a PAX record
+ */
+static int split_path(tar_header_t *header, const char *path, size_t len)
+{
+    if (len <= sizeof(header->name))
+    {
+        memcpy(header->name, path, len);
+        return 0;
+    }
+    // the prefix ends at a '/' that is not stored, leaving at most 100 bytes for the name: the leftmost such '/'
+    // gives the shortest prefix, so if its prefix does not fit in 155 bytes, no other one does
+    size_t first = len - sizeof(header->name) - 1 > 0 ? len - sizeof(header->name) - 1 : 1;
+    for (size_t slash = first; slash < len - 1; slash++)
+    {
+        if (path[slash] != '/')
+            continue;
+        if (slash > sizeof(header->prefix))
+            return -1;
+        memcpy(header->prefix, path, slash);
+        memcpy(header->name, path + slash + 1, len - slash - 1);
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Fills the fields of a ustar header but its path and checksum
+ */
+static void fill_fields(tar_header_t *header, char typeflag, uint64_t size, mode_t mode, time_t mtime)
+{
+    snprintf(header->mode, sizeof(header->mode), "%07o", (unsigned int)(mode & 07777));
+    snprintf(header->uid, sizeof(header->uid), "%07o", 0);
+    snprintf(header->gid, sizeof(header->gid), "%07o", 0);
+    snprintf(header->size, sizeof(header->size), "%011llo", (unsigned long long)(size > USTAR_MAX_OCTAL ? 0 : size));
+    uint64_t time = mtime < 0 ? 0 : (uint64_t)mtime;
+    snprintf(header->mtime, sizeof(header->mtime), "%011llo", (unsigned long long)(time & USTAR_MAX_OCTAL));
+    header->typeflag = typeflag;
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+}
+
+static void seal_header(tar_header_t *header)
+{
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", checksum(header));
+    header->chksum[7] = ' ';
+}
+
+/**
+ * Appends a "<length> <key>=<value>\n" record to `records`
+ * @return the length of the record
+ */
+static size_t pax_record(char *records, const char *key, const char *value, size_t value_len)
+{
+    // the length counts its own digits, which may take one more digit
+    size_t len = strlen(key) + value_len + 3;
+    size_t total = len;
+    for (int i = 0; i < 2; i++)
+    {
+        size_t digits = 1;
+        for (size_t n = total; n >= 10; n /= 10)
+            digits++;
+        total = len + digits;
+    }
+    if (records != NULL)
+    {
+        int prefix = sprintf(records, "%zu %s=", total, key);
+        memcpy(records + prefix, value, value_len);
+        records[prefix + value_len] = '\n';
+    }
+    return total;
+}
+
+/**
+ * Buffers the header of a member, preceded by a PAX extended header for what ustar cannot represent
+ * @return zero on success, -1 if it could not be written
+ */
+static int add_header(tar_writer_t *writer, const char *path, char typeflag, uint64_t size, mode_t mode,
+                      time_t mtime, const char *linkname)
+{
+    if (writer->failed || path == NULL || path[0] == '\0')
+        return -1;
+    tar_header_t header;
+    memset(&header, 0, sizeof(header));
+    fill_fields(&header, typeflag, size, mode, mtime);
+
+    size_t path_len = strlen(path);
+    size_t link_len = linkname != NULL ? strlen(linkname) : 0;
+    int long_path = split_path(&header, path, path_len) != 0;
+    int long_link = link_len > sizeof(header.linkname);
+    int large = size > USTAR_MAX_OCTAL;
+    if (!long_link && link_len > 0)
+        memcpy(header.linkname, linkname, link_len);
+    if (long_path)
+        memcpy(header.name, path, sizeof(header.name)); // readers without PAX support still get something
+    seal_header(&header);
+
+    if (long_path || long_link || large)
+    {
+        char size_value[24];
+        int size_len = snprintf(size_value, sizeof(size_value), "%llu", (unsigned long long)size);
+        size_t records_len = (long_path ? pax_record(NULL, "path", path, path_len) : 0) +
+                             (long_link ? pax_record(NULL, "linkpath", linkname, link_len) : 0) +
+                             (large ? pax_record(NULL, "size", size_value, size_len) : 0);
+        size_t padded = (records_len + BLK_SIZE - 1) / BLK_SIZE * BLK_SIZE;
+        if (BLK_SIZE + padded > WRITER_BUFFER_SIZE)
+            return -1;
+        tar_header_t *pax = (tar_header_t *)reserve(writer, BLK_SIZE + padded);
+        if (pax == NULL)
+            return -1;
+        char *records = (char *)(pax + 1);
+        if (long_path)
+            records += pax_record(records, "path", path, path_len);
+        if (long_link)
+            records += pax_record(records, "linkpath", linkname, link_len);
+        if (large)
+            pax_record(records, "size", size_value, size_len);
+        snprintf(pax->name, sizeof(pax->name), "PaxHeaders/%.88s", header.name);
+        fill_fields(pax, XHDTYPE, records_len, 0644, mtime);
+        seal_header(pax);
+    }
+
+    uint8_t *dest = reserve(writer, BLK_SIZE);
+    if (dest == NULL)
+        return -1;
+    memcpy(dest, &header, BLK_SIZE);
+    return 0;
+}
+
+/**
+ * Finds where the trailing zero blocks of an existing archive start, folding PAX records into the
+ * size of the member they precede as the reader does
+ * @return the offset, or -1 if the file is not a valid archive or a PAX header is too large to be read
+ */
+static off_t find_archive_end(int fd)
+{
+    tar_header_t header;
+    header_ext_t ext;
+    memset(&ext, 0, sizeof(ext));
+    off_t off = 0;
+    while (1)
+    {
+        ssize_t got = pread(fd, &header, BLK_SIZE, off);
+        if (got == 0)
+            return off;
+        if (got != BLK_SIZE)
+            return -1;
+        if (header.name[0] == '\0')
+            return off;
+        if (validate_header(&header) != 0 && !is_gnu_header(&header))
+            return -1;
+
+        uint64_t size = member_size(&header, &ext);
+        if (header.typeflag == XHDTYPE)
+        {
+            // skipping it would lose a size record, and the next member would be stepped over wrongly
+            if (size > EXTENSION_MAX_SIZE)
+                return -1;
+            char *records = malloc(size + 1);
+            if (records == NULL || pread(fd, records, size, off + BLK_SIZE) != (ssize_t)size)
+            {
+                free(records);
+                return -1;
+            }
+            records[size] = '\0';
+            apply_extension(&header, records, size, &ext);
+            free(records);
+            ext.path = ext.linkpath = NULL; // pointed into the records, only the size is used here
+        }
+        else if (!is_extension_type(header.typeflag))
+        {
+            memset(&ext, 0, sizeof(ext));
+        }
+        off += BLK_SIZE + (size + BLK_SIZE - 1) / BLK_SIZE * BLK_SIZE;
+    }
+}
+
+tar_writer_t *tar_writer_open(int tar_fd, int append)
+{
+    off_t start = 0;
+    if (append)
+    {
+        start = find_archive_end(tar_fd);
+        if (start == -1)
+            return NULL;
+    }
+    if (lseek(tar_fd, start, SEEK_SET) == -1 && (append || errno != ESPIPE))
+        return NULL;
+
+    tar_writer_t *writer = calloc(1, sizeof(tar_writer_t));
+    if (writer == NULL)
+        return NULL;
+    writer->buffer = malloc(WRITER_BUFFER_SIZE);
+    if (writer->buffer == NULL)
+    {
+        free(writer);
+        return NULL;
+    }
+    writer->fd = tar_fd;
+    return writer;
+}
+
+int tar_writer_add_buffer(tar_writer_t *writer, const char *path, const void *data, size_t size, mode_t mode,
+                          time_t mtime)
+{
+    if (add_header(writer, path, REGTYPE, size, mode, mtime, NULL) != 0)
+        return -1;
+    if (size >= WRITER_DIRECT_PAYLOAD)
+        return flush(writer, data, size);
+    uint8_t *dest = reserve(writer, (size + BLK_SIZE - 1) / BLK_SIZE * BLK_SIZE);
+    if (dest == NULL)
+        return -1;
+    memcpy(dest, data, size);
+    return 0;
+}
+
+int tar_writer_add_fd(tar_writer_t *writer, const char *path, int fd)
+{
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1 || !S_ISREG(statbuf.st_mode))
+        return -1;
+    uint64_t size = statbuf.st_size;
+    if (add_header(writer, path, REGTYPE, size, statbuf.st_mode, statbuf.st_mtim.tv_sec, NULL) != 0)
+        return -1;
+
+    uint64_t padded = (size + BLK_SIZE - 1) / BLK_SIZE * BLK_SIZE;
+    if (size < WRITER_DIRECT_PAYLOAD)
+    {
+        uint8_t *dest = reserve(writer, padded);
+        if (dest == NULL || pread(fd, dest, size, 0) != (ssize_t)size)
+            return writer->failed = -1;
+        return 0;
+    }
+
+    // large files go from file to file, in the kernel when it can
+    if (flush(writer, NULL, 0) != 0)
+        return -1;
+    uint64_t done = 0;
+    loff_t in_off = 0;
+    while (done < size)
+    {
+        ssize_t ret = copy_file_range(fd, &in_off, writer->fd, NULL, size - done, 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+    while (done < size)
+    {
+        size_t chunk = size - done < WRITER_BUFFER_SIZE ? size - done : WRITER_BUFFER_SIZE;
+        ssize_t got = pread(fd, writer->buffer, chunk, done);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return writer->failed = -1; // the file shrank, the member would be short
+        writer->buffered = got;
+        if (flush(writer, NULL, 0) != 0)
+            return -1;
+        done += got;
+    }
+    return reserve(writer, padded - size) != NULL ? 0 : -1;
+}
+
+int tar_writer_add_directory(tar_writer_t *writer, const char *path, mode_t mode, time_t mtime)
+{
+    size_t len = path != NULL ? strlen(path) : 0;
+    if (len == 0 || path[len - 1] == '/')
+        return add_header(writer, path, DIRTYPE, 0, mode, mtime, NULL);
+    char dir[len + 2];
+    memcpy(dir, path, len);
+    dir[len] = '/';
+    dir[len + 1] = '\0';
+    return add_header(writer, dir, DIRTYPE, 0, mode, mtime, NULL);
+}
+
+int tar_writer_add_symlink(tar_writer_t *writer, const char *path, const char *target, time_t mtime)
+{
+    if (target == NULL)
+        return -1;
+    return add_header(writer, path, SYMTYPE, 0, 0777, mtime, target);
+}
+
+int tar_writer_close(tar_writer_t *writer)
+{
+    if (writer == NULL)
+        return -1;
+    int ret = -1;
+    // the end of an archive is marked by two zero blocks
+    if (!writer->failed && reserve(writer, 2 * BLK_SIZE) != NULL)
+        ret = flush(writer, NULL, 0);
+    free(writer->buffer);
+    free(writer);
+    return ret;
+}
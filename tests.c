@@ -1,7 +1,12 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <string.h>
+#include <zlib.h>
 
 #include "lib_tar.h"
 
@@ -24,6 +29,92 @@ void debug_dump(const uint8_t *bytes, size_t len) {
     }
 }
 
+static int remove_entry(const char *path, const struct stat *statbuf, int type, struct FTW *ftw) {
+    return remove(path);
+}
+
+/* Removes a directory extracted by a test and everything below it, without following symlinks */
+void remove_tree(const char *path) {
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* Writes a ustar header, for the entries and size encodings tar_writer does not produce */
+void write_header(int fd, const char *name, char typeflag, const char *linkname, uint64_t size) {
+    tar_header_t header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.name, name, sizeof(header.name));
+    strncpy(header.linkname, linkname, sizeof(header.linkname));
+    header.typeflag = typeflag;
+    strcpy(header.mode, "0000755");
+    strcpy(header.mtime, "00000000000");
+    if (size > 077777777777ULL) {
+        header.size[0] = (char) 0x80;
+        for (int i = 11; i > 0; i--, size >>= 8)
+            header.size[i] = (char) (size & 0xff);
+    } else {
+        snprintf(header.size, sizeof(header.size), "%011llo", (unsigned long long) size);
+    }
+    memcpy(header.magic, TMAGIC, TMAGLEN);
+    memcpy(header.version, TVERSION, TVERSLEN);
+    memset(header.chksum, ' ', sizeof(header.chksum));
+    unsigned int sum = 0;
+    for (size_t i = 0; i < sizeof(header); i++)
+        sum += ((uint8_t *) &header)[i];
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", sum);
+    write(fd, &header, sizeof(header));
+}
+
+/* Opens the archive `*arg` is the file descriptor of, on a thread whose stack is smaller than its names */
+void *open_archive(void *arg) {
+    return tar_open(*(int *) arg);
+}
+
+/* Compresses the archive `fd` points to with gzip, into a temporary file */
+FILE *gzip_archive(int fd) {
+    struct stat plain_stat;
+    fstat(fd, &plain_stat);
+    uint8_t *plain = malloc(plain_stat.st_size);
+    pread(fd, plain, plain_stat.st_size, 0);
+    z_stream deflater = {0};
+    deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    size_t len = deflateBound(&deflater, plain_stat.st_size);
+    uint8_t *compressed = malloc(len);
+    deflater.next_in = plain;
+    deflater.avail_in = plain_stat.st_size;
+    deflater.next_out = compressed;
+    deflater.avail_out = len;
+    deflate(&deflater, Z_FINISH);
+    len = deflater.total_out;
+    deflateEnd(&deflater);
+    FILE *out = tmpfile();
+    write(fileno(out), compressed, len);
+    free(plain);
+    free(compressed);
+    return out;
+}
+
+#define READER_THREADS 4
+
+/* Reads the same file over and over through a shared handle, counting the reads that differ from `expected` */
+typedef struct reader {
+    const tar_archive_t *tar;
+    const uint8_t *expected;
+    size_t expected_len;
+    int mismatches;
+} reader_t;
+
+void *read_concurrently(void *arg) {
+    reader_t *reader = arg;
+    uint8_t buffer[2048];
+    for (int i = 0; i < 10000; i++) {
+        size_t len = sizeof(buffer);
+        if (tar_read_file(reader->tar, "truc/test.txt", 0, buffer, &len) != 0 || len != reader->expected_len
+            || memcmp(buffer, reader->expected, len) != 0)
+            reader->mismatches++;
+    }
+    return NULL;
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
         printf("Usage: %s tar_file\n", argv[0]);
@@ -68,7 +159,674 @@ int main(int argc, char **argv) {
         free(entries[i]);
     }
     free(entries);
-    
+
+    tar_archive_t *tar = tar_open(fd);
+    if (tar == NULL) {
+        printf("tar_open failed\n");
+        close(fd);
+        return -1;
+    }
+    printf("tar_check_archive returned %d (valid if > 0)\n", tar_check_archive(tar));
+    printf("tar_is_dir returned %d (valid if != 0)\n", tar_is_dir(tar, "truc/"));
+    printf("tar_is_file returned %d (valid if != 0)\n", tar_is_file(tar, "truc/test.txt"));
+    printf("tar_is_symlink returned %d (valid if != 0)\n", tar_is_symlink(tar, "symlinkmachin.txt"));
+    const uint8_t *view;
+    len = SIZE_MAX;
+    ret = tar_read_view(tar, "truc/test.txt", 0, &view, &len);
+    printf("tar_read_view returned %d (valid if >= 0)\n", ret);
+    fwrite(view, 1, len, stdout);
+
+    const char *matches[3];
+    size_t cursor = 0, no_matched = 0;
+    int more;
+    do {
+        size_t no_matches = sizeof(matches) / sizeof(matches[0]);
+        more = tar_glob(tar, "truc/**.txt", &cursor, matches, &no_matches);
+        no_matched += no_matches;
+    } while (more == 1);
+    printf("tar_glob matched %zu paths in pages of 3 (valid if == 4)\n", no_matched);
+
+    pthread_t threads[READER_THREADS];
+    reader_t readers[READER_THREADS];
+    int mismatches = 0;
+    for (int i = 0; i < READER_THREADS; i++) {
+        readers[i] = (reader_t) {.tar = tar, .expected = view, .expected_len = len};
+        pthread_create(&threads[i], NULL, read_concurrently, &readers[i]);
+    }
+    for (int i = 0; i < READER_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        mismatches += readers[i].mismatches;
+    }
+    printf("concurrent tar_read_file mismatched %d times (valid if == 0)\n", mismatches);
+
+    tar_options_t cached = {.map_window = 1, .cache_size = 1 << 20};
+    tar_archive_t *windowed = tar_open_with(fd, &cached);
+    uint8_t chunk[2048];
+    mismatches = 0;
+    for (int i = 0; i < 2; i++) {
+        size_t chunk_len = sizeof(chunk);
+        if (tar_read_file(windowed, "truc/test.txt", 0, chunk, &chunk_len) != 0 || chunk_len != len
+            || memcmp(chunk, view, len) != 0)
+            mismatches++;
+    }
+    tar_close(windowed);
+    printf("cached tar_read_file mismatched %d times (valid if == 0)\n", mismatches);
+
+    struct stat statbuf;
+    fstat(fd, &statbuf);
+    uint8_t *archive = malloc(statbuf.st_size);
+    pread(fd, archive, statbuf.st_size, 0);
+    tar_options_t in_memory = {.backend = TAR_BACKEND_MEMORY, .buffer = archive, .buffer_size = statbuf.st_size};
+    tar_archive_t *memory = tar_open_with(-1, &in_memory);
+    tar_archive_t *pread_tar = tar_open_with(fd, &(tar_options_t) {.backend = TAR_BACKEND_PREAD});
+    printf("tar_check_archive returned %d from memory, %d with pread (valid if > 0)\n", tar_check_archive(memory),
+           tar_check_archive(pread_tar));
+    tar_range_t ranges[2] = {{.offset = len - 4, .len = 4, .dest = chunk}, {.offset = 0, .len = 4, .dest = chunk + 4}};
+    ret = tar_read_file_ranges(pread_tar, "truc/test.txt", ranges, 2);
+    printf("tar_read_file_ranges returned %d, footer and header match: %d (valid if == 0, 1)\n", ret,
+           memcmp(chunk, view + len - 4, 4) == 0 && memcmp(chunk + 4, view, 4) == 0);
+    tar_close(memory);
+    tar_close(pread_tar);
+    free(archive);
+    tar_stats_t stats;
+    ret = tar_stats_get(tar, &stats);
+    printf("tar_stats_get returned %d, counted %llu reads (valid if == 0, 40000 with make STATS=1)\n", ret,
+           (unsigned long long)stats.ops[TAR_STATS_READ].calls);
+    if (ret == 0) {
+        fflush(stdout);
+        tar_stats_dump(tar, STDOUT_FILENO);
+    }
+    tar_close(tar);
+
+    tar_stream_t *stream = tar_stream_open(fd, 0);
+    tar_entry_info_t info;
+    int streamed = 0;
+    while ((ret = tar_next_entry(stream, &info)) == 1)
+        streamed++;
+    tar_stream_close(stream);
+    printf("tar_next_entry returned %d after %d entries (valid if == 0)\n", ret, streamed);
+
+    FILE *written = tmpfile();
+    int written_fd = fileno(written);
+    tar_writer_t *writer = tar_writer_open(written_fd, 0);
+    tar_writer_add_directory(writer, "new", 0755, 0);
+    tar_writer_add_buffer(writer, "new/file.txt", "written\n", 8, 0644, 0);
+    tar_writer_add_symlink(writer, "new/link", "file.txt", 0);
+    ret = tar_writer_close(writer);
+    writer = tar_writer_open(written_fd, 1);
+    tar_writer_add_fd(writer, "new/archive.tar", fd);
+    ret |= tar_writer_close(writer);
+    tar = tar_open(written_fd);
+    uint8_t content[16];
+    size_t written_len = sizeof(content) - 1;
+    tar_read_file(tar, "new/link", 0, content, &written_len);
+    content[written_len] = '\0';
+    printf("tar_writer_close returned %d, tar_check_archive returned %d after appending (valid if == 0, 4)\n", ret,
+           tar_check_archive(tar));
+    printf("%s", content);
+    writer = tar_writer_open(written_fd, 1);
+    tar_writer_add_buffer(writer, "new/file.txt", "rewritten\n", 10, 0644, 0);
+    tar_writer_close(writer);
+    ret = tar_refresh(tar);
+    written_len = sizeof(content) - 1;
+    tar_read_file(tar, "new/link", 0, content, &written_len);
+    content[written_len] = '\0';
+    printf("tar_refresh returned %d (valid if == 1)\n", ret);
+    printf("%s", content);
+    tar_close(tar);
+    fclose(written);
+
+    char outside[] = "/tmp/tests_outside_XXXXXX", dest[] = "/tmp/tests_dest_XXXXXX", payload[64];
+    mkdtemp(outside);
+    mkdtemp(dest);
+    written = tmpfile();
+    written_fd = fileno(written);
+    writer = tar_writer_open(written_fd, 0);
+    tar_writer_add_symlink(writer, "evil", outside, 0);
+    tar_writer_add_buffer(writer, "evil/payload", "escaped\n", 8, 0644, 0);
+    tar_writer_close(writer);
+    lseek(written_fd, 0, SEEK_SET);
+    ret = tar_stream_extract(written_fd, dest);
+    snprintf(payload, sizeof(payload), "%s/payload", outside);
+    printf("tar_stream_extract returned %d through a symlink, wrote outside: %d (valid if == -4, 0)\n", ret,
+           access(payload, F_OK) == 0);
+    fclose(written);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    char secret[64], stolen[64];
+    snprintf(secret, sizeof(secret), "%s/secret", outside);
+    close(open(secret, O_WRONLY | O_CREAT, 0600));
+    write_header(written_fd, "l", SYMTYPE, outside, 0);
+    write_header(written_fd, "stolen", LNKTYPE, "l/secret", 0);
+    write_header(written_fd, "l/x", SYMTYPE, "anywhere", 0);
+    uint8_t end[2 * BLK_SIZE] = {0};
+    write(written_fd, end, sizeof(end));
+    tar = tar_open(written_fd);
+    ret = tar_extract_all(tar, dest, 1);
+    snprintf(payload, sizeof(payload), "%s/x", outside);
+    snprintf(stolen, sizeof(stolen), "%s/stolen", dest);
+    printf("tar_extract_all returned %d through a symlink, linked outside: %d (valid if == -4, 0)\n", ret,
+           access(payload, F_OK) == 0 || access(stolen, F_OK) == 0);
+    tar_close(tar);
+    fclose(written);
+    remove_tree(dest);
+    remove_tree(outside);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    size_t long_len = 600 * 1024;
+    char *long_link = malloc(long_len + 1);
+    memset(long_link, 'a', long_len);
+    memcpy(long_link, "s/", 2);
+    long_link[long_len] = '\0';
+    writer = tar_writer_open(written_fd, 0);
+    tar_writer_add_directory(writer, "d", 0755, 0);
+    tar_writer_add_symlink(writer, "s", "d", 0);
+    tar_writer_add_symlink(writer, "long", long_link, 0);
+    tar_writer_close(writer);
+    pthread_attr_t small_stack;
+    pthread_attr_init(&small_stack);
+    pthread_attr_setstacksize(&small_stack, 128 * 1024);
+    pthread_t opener;
+    pthread_create(&opener, &small_stack, open_archive, &written_fd);
+    pthread_join(opener, (void **) &tar);
+    pthread_attr_destroy(&small_stack);
+    printf("tar_open on a 128 KiB stack with a %zu-byte link target returned %d, tar_is_symlink returned %d "
+           "(valid if == 1, 1)\n", long_len, tar != NULL, tar_is_symlink(tar, "long"));
+    tar_close(tar);
+    free(long_link);
+    fclose(written);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    char long_path[151];
+    memset(long_path, 'p', sizeof(long_path) - 1);
+    long_path[sizeof(long_path) - 1] = '\0';
+    writer = tar_writer_open(written_fd, 0);
+    tar_writer_add_buffer(writer, long_path, "long\n", 5, 0644, 0);
+    tar_writer_close(writer);
+    lseek(written_fd, 0, SEEK_SET);
+    stream = tar_stream_open(written_fd, 0);
+    int long_named = 0;
+    streamed = 0;
+    while ((ret = tar_next_entry(stream, &info)) == 1) {
+        streamed++;
+        long_named += strcmp(info.name, long_path) == 0 && info.size == 5;
+    }
+    tar_stream_close(stream);
+    printf("tar_next_entry read %d entries, %d with the 150-byte path (valid if == 1, 1)\n", streamed, long_named);
+    fclose(written);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    write_header(written_fd, "dir", DIRTYPE, "", 0);
+    write_header(written_fd, "dir-x", REGTYPE, "", 0);
+    write_header(written_fd, "dir/a.txt", REGTYPE, "", 0);
+    write_header(written_fd, "dir.txt", REGTYPE, "", 0);
+    write_header(written_fd, "dir/sub/b.txt", REGTYPE, "", 0);
+    write(written_fd, end, sizeof(end));
+    tar = tar_open(written_fd);
+    size_t no_all = 0, no_in_dir = 0;
+    const char *page[8];
+    cursor = 0;
+    no_all = sizeof(page) / sizeof(page[0]);
+    tar_glob(tar, "**", &cursor, page, &no_all);
+    cursor = 0;
+    no_in_dir = sizeof(page) / sizeof(page[0]);
+    tar_glob(tar, "dir/*", &cursor, page, &no_in_dir);
+    printf("tar_glob matched %zu paths, %zu in a directory without its '/', tar_is_dir returned %d "
+           "(valid if == 6, 2, 1)\n", no_all, no_in_dir, tar_is_dir(tar, "dir/"));
+    tar_close(tar);
+    fclose(written);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    char split[232];
+    memset(split, 'a', sizeof(split) - 1);
+    split[140] = split[171] = '/';
+    split[sizeof(split) - 1] = '\0';
+    writer = tar_writer_open(written_fd, 0);
+    tar_writer_add_buffer(writer, split, "split\n", 6, 0644, 0);
+    tar_writer_add_buffer(writer, long_path, "long\n", 5, 0644, 0);
+    tar_writer_close(writer);
+    writer = tar_writer_open(written_fd, 1);
+    ret = tar_writer_add_buffer(writer, "appended", "appended\n", 9, 0644, 0);
+    ret |= tar_writer_close(writer);
+    tar = tar_open(written_fd);
+    printf("tar_writer_close returned %d, tar_check_archive returned %d, all found: %d (valid if == 0, 4, 1)\n", ret,
+           tar_check_archive(tar), tar_exists(tar, split) && tar_exists(tar, long_path) && tar_exists(tar, "appended"));
+    tar_close(tar);
+    fclose(written);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    writer = tar_writer_open(written_fd, 0);
+    tar_writer_add_buffer(writer, "dir/b.txt", "indexed\n", 8, 0644, 0);
+    tar_writer_close(writer);
+    char index_path[] = "/tmp/tests-index-XXXXXX";
+    close(mkstemp(index_path));
+    tar_options_t indexed = {.index_path = index_path};
+    tar_close(tar_open_with(written_fd, &indexed));
+    // a sidecar is replaced by a new file whenever it is rewritten
+    struct stat index_stat, reused_stat;
+    stat(index_path, &index_stat);
+    tar_close(tar_open_with(written_fd, &indexed));
+    stat(index_path, &reused_stat);
+    printf("the sidecar of an archive with an implicit directory was reused: %d (valid if == 1)\n",
+           index_stat.st_ino == reused_stat.st_ino);
+    // keep the header of the sidecar so that it is still taken for the index of the archive
+    int index_fd = open(index_path, O_RDWR);
+    uint8_t *garbage = malloc(index_stat.st_size);
+    memset(garbage, 0xff, index_stat.st_size);
+    pwrite(index_fd, garbage, index_stat.st_size - 144, 144);
+    close(index_fd);
+    free(garbage);
+    tar = tar_open_with(written_fd, &indexed);
+    uint8_t indexed_data[16];
+    size_t indexed_len = sizeof(indexed_data);
+    ret = tar != NULL ? (int) tar_read_file(tar, "dir/b.txt", 0, indexed_data, &indexed_len) : -1;
+    printf("tar_read_file with a corrupted sidecar returned %d, data matches: %d (valid if == 0, 1)\n", ret,
+           indexed_len == 8 && memcmp(indexed_data, "indexed\n", 8) == 0);
+    tar_close(tar);
+    FILE *compressed = gzip_archive(written_fd);
+    fclose(written);
+    char saved_path[] = "/tmp/tests-checkpoints-XXXXXX";
+    close(mkstemp(saved_path));
+    // the checkpoints are only used along with a sidecar
+    tar_options_t saved = {.index_path = index_path, .checkpoint_path = saved_path};
+    tar_close(tar_open_with(fileno(compressed), &saved));
+    // past the 56-byte header, the first checkpoint now claims to start one byte into the archive
+    uint64_t out_off = 1;
+    index_fd = open(saved_path, O_WRONLY);
+    pwrite(index_fd, &out_off, sizeof(out_off), 56 + sizeof(uint64_t));
+    close(index_fd);
+    tar = tar_open_with(fileno(compressed), &saved);
+    memset(indexed_data, 0, sizeof(indexed_data));
+    indexed_len = sizeof(indexed_data);
+    ret = tar != NULL ? (int) tar_read_file(tar, "dir/b.txt", 0, indexed_data, &indexed_len) : -1;
+    printf("tar_read_file with corrupted checkpoints returned %d, data matches: %d (valid if == 0, 1)\n", ret,
+           indexed_len == 8 && memcmp(indexed_data, "indexed\n", 8) == 0);
+    tar_close(tar);
+    unlink(index_path);
+    unlink(saved_path);
+    fclose(compressed);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    size_t big_len = 1 << 20;
+    uint8_t *big = malloc(big_len), *big_copy = malloc(big_len);
+    for (size_t i = 0; i < big_len; i++)
+        big[i] = i * 7 + i / 4096;
+    writer = tar_writer_open(written_fd, 0);
+    tar_writer_add_buffer(writer, "big.bin", big, big_len, 0644, 0);
+    tar_writer_close(writer);
+    // four 64 KiB chunks, a read of two chunks already goes around them
+    tar = tar_open_with(written_fd, &(tar_options_t) {.backend = TAR_BACKEND_PREAD, .cache_size = 300000,
+                                                      .cache_chunk = 64 * 1024});
+    mismatches = 0;
+    size_t sizes[] = {100, 100, big_len, 100};
+    for (int i = 0; i < 4; i++) {
+        size_t big_read = sizes[i];
+        if (tar_read_file(tar, "big.bin", 0, big_copy, &big_read) != (ssize_t) (big_len - sizes[i])
+            || big_read != sizes[i] || memcmp(big_copy, big, sizes[i]) != 0)
+            mismatches++;
+    }
+    memset(&stats, 0, sizeof(stats));
+    tar_stats_get(tar, &stats);
+    printf("cached tar_read_file of a whole file mismatched %d times, %llu hits, %llu misses "
+           "(valid if == 0, 2, 2 with make STATS=1)\n", mismatches, (unsigned long long) stats.cache_hits,
+           (unsigned long long) stats.cache_misses);
+    tar_close(tar);
+    free(big);
+    free(big_copy);
+    fclose(written);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    size_t plain_len = 1 << 20;
+    uint8_t *plain = malloc(plain_len);
+    for (size_t i = 0; i < plain_len; i++)
+        plain[i] = i * 13 + i / 1000;
+    writer = tar_writer_open(written_fd, 0);
+    tar_writer_add_buffer(writer, "plain.bin", plain, plain_len, 0644, 0);
+    tar_writer_add_buffer(writer, "after.txt", "after\n", 6, 0644, 0);
+    tar_writer_close(writer);
+    compressed = gzip_archive(written_fd);
+    fclose(written);
+    written = compressed;
+    written_fd = fileno(written);
+    char checkpoint_path[] = "/tmp/tests-checkpoints-XXXXXX";
+    close(mkstemp(checkpoint_path));
+    // the first handle decompresses the whole archive, the second one starts from the saved checkpoints
+    tar_options_t checkpointed = {.checkpoint_path = checkpoint_path, .checkpoint_interval = 64 * 1024};
+    int gz_checks[2], gz_mismatches[2] = {0, 0};
+    size_t gz_offsets[] = {0, 65536 - 100, 300001, 700000, (1 << 20) - 50};
+    uint8_t gz_chunk[4096];
+    for (int pass = 0; pass < 2; pass++) {
+        tar = tar_open_with(written_fd, &checkpointed);
+        gz_checks[pass] = tar != NULL ? tar_check_archive(tar) : -1;
+        for (int i = 0; i < 5 && tar != NULL; i++) {
+            size_t gz_read = sizeof(gz_chunk);
+            size_t expected = plain_len - gz_offsets[i] < gz_read ? plain_len - gz_offsets[i] : gz_read;
+            if (tar_read_file(tar, "plain.bin", gz_offsets[i], gz_chunk, &gz_read) < 0 || gz_read != expected
+                || memcmp(gz_chunk, plain + gz_offsets[i], expected) != 0)
+                gz_mismatches[pass]++;
+        }
+        size_t gz_read = sizeof(gz_chunk);
+        if (tar == NULL || tar_read_file(tar, "after.txt", 0, gz_chunk, &gz_read) != 0 || gz_read != 6
+            || memcmp(gz_chunk, "after\n", 6) != 0)
+            gz_mismatches[pass]++;
+        tar_close(tar);
+    }
+    printf("compressed tar_check_archive returned %d, %d, tar_read_file mismatched %d, %d times "
+           "(valid if == 2, 2, 0, 0)\n", gz_checks[0], gz_checks[1], gz_mismatches[0], gz_mismatches[1]);
+    unlink(checkpoint_path);
+    free(plain);
+    fclose(written);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    uint8_t async_data[200];
+    for (size_t i = 0; i < sizeof(async_data); i++)
+        async_data[i] = i * 31;
+    char async_paths[10][32];
+    writer = tar_writer_open(written_fd, 0);
+    for (int i = 0; i < 8; i++) {
+        snprintf(async_paths[i], sizeof(async_paths[i]), "async/%d.bin", i);
+        tar_writer_add_buffer(writer, async_paths[i], async_data, (i + 1) * 20, 0644, 0);
+    }
+    tar_writer_add_symlink(writer, "async/link", "7.bin", 0);
+    tar_writer_close(writer);
+    strcpy(async_paths[8], "async/link");
+    strcpy(async_paths[9], "async/missing");
+    tar = tar_open(written_fd);
+    // read 64 bytes from offset 30: beyond the end of the first file, partial or whole for the others
+    ssize_t async_rets[10] = {-2, 0, 0, 0, 0, 0, 0, 0, 0, -1};
+    size_t async_lens[10] = {0, 10, 30, 50, 64, 64, 64, 64, 64, 0};
+    for (int i = 4; i < 9; i++)
+        async_rets[i] = (i == 8 ? 160 : (i + 1) * 20) - 30 - 64;
+    tar_async_backend_t async_backends[] = {TAR_ASYNC_THREADS, TAR_ASYNC_IO_URING};
+    for (int b = 0; b < 2; b++) {
+        tar_async_t *async = tar_async_open(tar, 4, async_backends[b]);
+        if (async == NULL) {
+            printf("tar_async_open failed for %s (valid if == io_uring, when the kernel does not allow it)\n",
+                   b == 0 ? "threads" : "io_uring");
+            continue;
+        }
+        uint8_t async_dest[10][64];
+        tar_async_completion_t completions[10];
+        size_t submitted = 0, completed = 0;
+        mismatches = 0;
+        while (completed < 10) {
+            while (submitted < 10) {
+                tar_async_read_t read = {.path = async_paths[submitted], .offset = 30, .dest = async_dest[submitted],
+                                         .len = sizeof(async_dest[submitted]), .user_data = async_dest[submitted]};
+                if (tar_async_submit(async, &read, 1) == 0)
+                    break;
+                submitted++;
+            }
+            size_t got = tar_async_complete(async, completions, 10, 1);
+            for (size_t i = 0; i < got; i++) {
+                size_t index = (uint8_t (*)[64]) completions[i].user_data - async_dest;
+                if (completions[i].ret != async_rets[index] || completions[i].len != async_lens[index]
+                    || memcmp(async_dest[index], async_data + 30, async_lens[index]) != 0)
+                    mismatches++;
+            }
+            completed += got;
+        }
+        printf("tar_async_complete with %s mismatched %d times (valid if == 0)\n",
+               tar_async_backend(async) == TAR_ASYNC_IO_URING ? "io_uring" : "threads", mismatches);
+        tar_async_close(async);
+    }
+    tar_close(tar);
+    fclose(written);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    writer = tar_writer_open(written_fd, 0);
+    tar_writer_add_directory(writer, "tree/sub", 0750, 1200000000);
+    tar_writer_add_buffer(writer, "tree/sub/file.txt", "contents\n", 9, 0640, 1000000000);
+    tar_writer_add_buffer(writer, "tree/run.sh", "#!/bin/sh\n", 10, 0777, 1100000000);
+    tar_writer_add_symlink(writer, "tree/link", "sub/file.txt", 1300000000);
+    tar_writer_close(writer);
+    // the writer has no hard links, overwrite its end with one
+    uint8_t block[BLK_SIZE];
+    off_t archive_end = 0;
+    while (pread(written_fd, block, BLK_SIZE, archive_end) == BLK_SIZE && memcmp(block, end, BLK_SIZE) != 0)
+        archive_end += BLK_SIZE;
+    lseek(written_fd, archive_end, SEEK_SET);
+    write_header(written_fd, "tree/hard", LNKTYPE, "tree/sub/file.txt", 0);
+    write(written_fd, end, sizeof(end));
+    strcpy(dest, "/tmp/tests_dest_XXXXXX");
+    mkdtemp(dest);
+    mode_t old_umask = umask(022);
+    tar = tar_open(written_fd);
+    ret = tar_extract_all(tar, dest, 2);
+    umask(old_umask);
+    tar_close(tar);
+    fclose(written);
+    struct stat sub_stat, file_stat, run_stat, link_stat, hard_stat;
+    char extracted[96], link_target[32] = {0};
+    int stat_failed = 0;
+    snprintf(extracted, sizeof(extracted), "%s/tree/sub", dest);
+    stat_failed |= stat(extracted, &sub_stat);
+    snprintf(extracted, sizeof(extracted), "%s/tree/sub/file.txt", dest);
+    stat_failed |= stat(extracted, &file_stat);
+    int file_fd = open(extracted, O_RDONLY);
+    char contents[16] = {0};
+    read(file_fd, contents, sizeof(contents) - 1);
+    close(file_fd);
+    snprintf(extracted, sizeof(extracted), "%s/tree/run.sh", dest);
+    stat_failed |= stat(extracted, &run_stat);
+    snprintf(extracted, sizeof(extracted), "%s/tree/hard", dest);
+    stat_failed |= stat(extracted, &hard_stat);
+    snprintf(extracted, sizeof(extracted), "%s/tree/link", dest);
+    stat_failed |= lstat(extracted, &link_stat);
+    readlink(extracted, link_target, sizeof(link_target) - 1);
+    printf("tar_extract_all returned %d, stat failed: %d (valid if == 5, 0)\n", ret, stat_failed != 0);
+    printf("extracted modes %o %o %o, mtimes %lld %lld %lld (valid if == 750 640 755, 1200000000 1100000000 "
+           "1300000000)\n", sub_stat.st_mode & 07777, file_stat.st_mode & 07777, run_stat.st_mode & 07777,
+           (long long) sub_stat.st_mtime, (long long) run_stat.st_mtime, (long long) link_stat.st_mtime);
+    printf("extracted link to %s, hard link shared: %d, contents matches: %d (valid if == sub/file.txt, 1, 1)\n",
+           link_target, hard_stat.st_ino == file_stat.st_ino, strcmp(contents, "contents\n") == 0);
+    remove_tree(dest);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    // a sparse member past the 8 GiB the octal size field holds, its size stored in base-256
+    uint64_t huge_size = (9ULL << 30) + 100;
+    uint64_t huge_padded = (huge_size + BLK_SIZE - 1) / BLK_SIZE * BLK_SIZE;
+    write_header(written_fd, "huge.bin", REGTYPE, "", huge_size);
+    pwrite(written_fd, "the end\n", 8, BLK_SIZE + huge_size - 8);
+    lseek(written_fd, BLK_SIZE + huge_padded, SEEK_SET);
+    write_header(written_fd, "after.txt", REGTYPE, "", 6);
+    memset(block, 0, sizeof(block));
+    memcpy(block, "after\n", 6);
+    write(written_fd, block, sizeof(block));
+    write(written_fd, end, sizeof(end));
+    tar = tar_open(written_fd);
+    uint8_t huge_tail[16] = {0}, after[16] = {0};
+    size_t huge_read = sizeof(huge_tail), after_read = sizeof(after);
+    ssize_t huge_ret = tar_read_file(tar, "huge.bin", huge_size - 8, huge_tail, &huge_read);
+    ssize_t after_ret = tar_read_file(tar, "after.txt", 0, after, &after_read);
+    printf("tar_check_archive returned %d, tar_read_file returned %zd, %zd past 8 GiB, data matches: %d "
+           "(valid if == 2, 0, 0, 1)\n", tar_check_archive(tar), huge_ret, after_ret,
+           huge_read == 8 && memcmp(huge_tail, "the end\n", 8) == 0 && after_read == 6
+           && memcmp(after, "after\n", 6) == 0);
+    tar_close(tar);
+    lseek(written_fd, 0, SEEK_SET);
+    stream = tar_stream_open(written_fd, 0);
+    uint64_t huge_streamed = 0;
+    streamed = 0;
+    while ((ret = tar_next_entry(stream, &info)) == 1) {
+        streamed++;
+        if (strcmp(info.name, "huge.bin") == 0)
+            huge_streamed = info.size;
+    }
+    tar_stream_close(stream);
+    printf("tar_next_entry read %d entries, the base-256 size matches: %d (valid if == 2, 1)\n", streamed,
+           huge_streamed == huge_size);
+    fclose(written);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    // names and link targets past the 100 bytes of the ustar fields, in GNU 'L'/'K' and in PAX records
+    char gnu_name[160], pax_name[160], records[2][BLK_SIZE];
+    snprintf(gnu_name, sizeof(gnu_name), "gnu/%0150d.txt", 1);
+    snprintf(pax_name, sizeof(pax_name), "pax/%0150d.txt", 2);
+    const char *records_of[2][2] = {{"path", pax_name}, {"linkpath", gnu_name}};
+    for (int i = 0; i < 2; i++) {
+        // the length counts itself: three digits, then ' ', '=' and '\n'
+        int record_len = 3 + strlen(records_of[i][0]) + strlen(records_of[i][1]) + 3;
+        memset(records[i], 0, BLK_SIZE);
+        snprintf(records[i], BLK_SIZE, "%d %s=%s\n", record_len, records_of[i][0], records_of[i][1]);
+    }
+    memset(block, 0, sizeof(block));
+    strcpy((char *) block, gnu_name);
+    write_header(written_fd, "././@LongLink", 'L', "", strlen(gnu_name) + 1);
+    write(written_fd, block, BLK_SIZE);
+    write_header(written_fd, "gnu/truncated", REGTYPE, "", 5);
+    write(written_fd, "gnu!\n", 5);
+    write(written_fd, end, BLK_SIZE - 5);
+    write_header(written_fd, "PaxHeaders/pax", 'x', "", strlen(records[0]));
+    write(written_fd, records[0], BLK_SIZE);
+    write_header(written_fd, "pax/truncated", REGTYPE, "", 5);
+    write(written_fd, "pax!\n", 5);
+    write(written_fd, end, BLK_SIZE - 5);
+    memset(block, 0, sizeof(block));
+    strcpy((char *) block, pax_name);
+    write_header(written_fd, "././@LongLink", 'K', "", strlen(pax_name) + 1);
+    write(written_fd, block, BLK_SIZE);
+    write_header(written_fd, "gnu-link", SYMTYPE, "truncated", 0);
+    write_header(written_fd, "PaxHeaders/pax-link", 'x', "", strlen(records[1]));
+    write(written_fd, records[1], BLK_SIZE);
+    write_header(written_fd, "pax-link", SYMTYPE, "truncated", 0);
+    write(written_fd, end, sizeof(end));
+    tar = tar_open(written_fd);
+    char long_read[4][8] = {{0}};
+    const char *long_paths[] = {gnu_name, pax_name, "gnu-link", "pax-link"};
+    int long_found = 0;
+    for (int i = 0; i < 4; i++) {
+        size_t long_len = sizeof(long_read[i]) - 1;
+        long_found += tar_exists(tar, long_paths[i]) && tar_read_file(tar, long_paths[i], 0,
+                                                                       (uint8_t *) long_read[i], &long_len) == 0;
+    }
+    printf("tar_check_archive returned %d, %d long names found, read %s, %s, %s, %s, truncated ones found: %d "
+           "(valid if == 8, 4, gnu!, pax!, pax!, gnu!, 0)\n", tar_check_archive(tar), long_found,
+           strtok(long_read[0], "\n"), strtok(long_read[1], "\n"), strtok(long_read[2], "\n"),
+           strtok(long_read[3], "\n"), tar_exists(tar, "gnu/truncated") || tar_exists(tar, "pax/truncated"));
+    tar_close(tar);
+    fclose(written);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    // a chain of 40 symlinks resolves, one of 41 only from its second link on, whichever order they are stored in
+    char chain_name[32], chain_link[32];
+    for (int c = 0; c < 3; c++) {
+        int links = c == 0 ? 40 : 41;
+        for (int j = 0; j < links; j++) {
+            int i = c == 2 ? links - 1 - j : j;
+            snprintf(chain_name, sizeof(chain_name), "chain/%c%02d", 'a' + c, i);
+            snprintf(chain_link, sizeof(chain_link), "%c%02d", 'a' + c, i + 1);
+            write_header(written_fd, chain_name, SYMTYPE, i == links - 1 ? "target.txt" : chain_link, 0);
+        }
+    }
+    write_header(written_fd, "chain/target.txt", REGTYPE, "", 6);
+    memset(block, 0, sizeof(block));
+    memcpy(block, "chain\n", 6);
+    write(written_fd, block, sizeof(block));
+    write_header(written_fd, "cycle/x", SYMTYPE, "y", 0);
+    write_header(written_fd, "cycle/y", SYMTYPE, "../cycle/x", 0);
+    write_header(written_fd, "deep/dir/up", SYMTYPE, "../../chain/./target.txt", 0);
+    write_header(written_fd, "deep/via", SYMTYPE, "../chain", 0);
+    write_header(written_fd, "deep/escape", SYMTYPE, "../../target.txt", 0);
+    write(written_fd, end, sizeof(end));
+    tar = tar_open(written_fd);
+    const char *link_paths[] = {"chain/a00", "chain/b00", "chain/b01", "chain/c00", "chain/c01", "cycle/x",
+                                "deep/dir/up", "deep/via/target.txt", "deep/escape"};
+    ssize_t link_rets[9];
+    mismatches = 0;
+    for (int i = 0; i < 9; i++) {
+        uint8_t link_data[8];
+        size_t link_len = sizeof(link_data);
+        link_rets[i] = tar_read_file(tar, link_paths[i], 0, link_data, &link_len);
+        mismatches += link_rets[i] == 0 && (link_len != 6 || memcmp(link_data, "chain\n", 6) != 0);
+    }
+    printf("tar_read_file through links returned %zd %zd %zd %zd %zd %zd %zd %zd %zd, mismatched %d times, "
+           "tar_is_symlink returned %d (valid if == 0 -1 0 -1 0 -1 0 0 -1, 0, 1)\n", link_rets[0], link_rets[1],
+           link_rets[2], link_rets[3], link_rets[4], link_rets[5], link_rets[6], link_rets[7], link_rets[8], mismatches,
+           tar_is_symlink(tar, "cycle/x"));
+    tar_close(tar);
+    fclose(written);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    // an extension header claiming far more than the archive holds, which is never allocated
+    write_header(written_fd, "before.txt", REGTYPE, "", 7);
+    memset(block, 0, sizeof(block));
+    memcpy(block, "before\n", 7);
+    write(written_fd, block, sizeof(block));
+    write_header(written_fd, "PaxHeaders/huge", 'x', "", 1ULL << 40);
+    write(written_fd, end, sizeof(end));
+    compressed = gzip_archive(written_fd);
+    tar = tar_open(fileno(compressed));
+    memset(indexed_data, 0, sizeof(indexed_data));
+    indexed_len = sizeof(indexed_data);
+    ret = tar != NULL ? (int) tar_read_file(tar, "before.txt", 0, indexed_data, &indexed_len) : -2;
+    printf("compressed tar_read_file before a 1 TiB extension header returned %d, data matches: %d "
+           "(valid if == 0, 1)\n", ret, indexed_len == 7 && memcmp(indexed_data, "before\n", 7) == 0);
+    tar_close(tar);
+    fclose(compressed);
+    lseek(written_fd, 0, SEEK_SET);
+    stream = tar_stream_open(written_fd, 0);
+    ret = tar_next_entry(stream, &info);
+    int before_found = ret == 1 && strcmp(info.name, "before.txt") == 0;
+    ret = tar_next_entry(stream, &info);
+    tar_stream_close(stream);
+    printf("tar_next_entry found the entry before a 1 TiB extension header: %d, then returned %d "
+           "(valid if == 1, 0)\n", before_found, ret);
+    fclose(written);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    // a single component too long for ustar goes to a PAX path record, holding what reads as a size record
+    char tricky[160];
+    memset(tricky, 'a', sizeof(tricky));
+    strcpy(tricky + 120, " size=99999");
+    writer = tar_writer_open(written_fd, 0);
+    tar_writer_add_buffer(writer, tricky, "tricky\n", 7, 0644, 0);
+    tar_writer_close(writer);
+    writer = tar_writer_open(written_fd, 1);
+    ret = writer != NULL ? tar_writer_add_buffer(writer, "appended", "appended\n", 9, 0644, 0) : -2;
+    ret |= tar_writer_close(writer);
+    tar = tar_open(written_fd);
+    // the PAX header, its records, both members and the end blocks: appending right after the first member
+    printf("tar_writer_close after a path with \" size=\" returned %d, archive length %ld, tar_check_archive returned "
+           "%d, all found: %d (valid if == 0, 4096, 3, 1)\n", ret, (long)lseek(written_fd, 0, SEEK_END),
+           tar_check_archive(tar), tar_exists(tar, tricky) && tar_exists(tar, "appended"));
+    tar_close(tar);
+    fclose(written);
+
+    written = tmpfile();
+    written_fd = fileno(written);
+    // a PAX header past what the writer reads, whose size record could not be honoured
+    size_t pax_len = (1 << 20) + BLK_SIZE;
+    write_header(written_fd, "PaxHeaders/large", 'x', "", pax_len);
+    char *pax_payload = calloc(1, pax_len);
+    snprintf(pax_payload, pax_len, "%zu comment=", pax_len);
+    memset(pax_payload + strlen(pax_payload), 'c', pax_len - strlen(pax_payload) - 1);
+    pax_payload[pax_len - 1] = '\n';
+    write(written_fd, pax_payload, pax_len);
+    free(pax_payload);
+    write_header(written_fd, "described.txt", REGTYPE, "", 0);
+    write(written_fd, end, sizeof(end));
+    writer = tar_writer_open(written_fd, 1);
+    printf("tar_writer_open appending after a %zu-byte PAX header returned %s (valid if == NULL)\n", pax_len,
+           writer == NULL ? "NULL" : "a writer");
+    tar_writer_close(writer);
+    fclose(written);
+
     close(fd);
     return 0;
 }
\ No newline at end of file